@@ -0,0 +1,563 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "fsarchiver.h"
+#include "archindex.h"
+#include "archreader.h"
+#include "strlist.h"
+#include "writebuf.h"
+#include "common.h"
+#include "dico.h"
+#include "error.h"
+
+// the index (--index) is built by the writer thread which knows where each header is written: an
+// entry per object header with its position, the position of its first data block and of its group
+// of small files, plus where the filesystems start and end. It is written at the end of the archive
+// in FSA_MAGIC_INDX headers and the footer of the last volume says where the first one starts.
+// An entry is stored as: objectid(u64) fsid(u16) flags(u8) objt(u32+u64) data(u32+u64) group(u32+u64)
+// pathlen(u16) path, all the integers in little endian
+
+#define ARCHINDEX_FSPOSSIZE   26 // fsid(u16) startvol(u32) startoff(u64) endvol(u32) endoff(u64)
+
+static void archindex_put_pos(u8 *p, u32 vol, u64 off)
+{
+    u32 temp32;
+    u64 temp64;
+    
+    temp32=cpu_to_le32(vol);
+    temp64=cpu_to_le64(off);
+    memcpy(p, &temp32, sizeof(temp32));
+    memcpy(p+sizeof(temp32), &temp64, sizeof(temp64));
+}
+
+static void archindex_get_pos(u8 *p, u32 *vol, u64 *off)
+{
+    u32 temp32;
+    u64 temp64;
+    
+    memcpy(&temp32, p, sizeof(temp32));
+    memcpy(&temp64, p+sizeof(temp32), sizeof(temp64));
+    *vol=le32_to_cpu(temp32);
+    *off=le64_to_cpu(temp64);
+}
+
+carchindex *archindex_alloc()
+{
+    carchindex *idx;
+    int i;
+    
+    if ((idx=calloc(1, sizeof(carchindex)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)sizeof(carchindex));
+        return NULL;
+    }
+    if ((idx->entries=writebuf_alloc())==NULL)
+    {   errprintf("writebuf_alloc() failed\n");
+        free(idx);
+        return NULL;
+    }
+    for (i=0; i < FSA_MAX_FSPERARCH; i++)
+    {   idx->fs[i].startvol=ARCHINDEX_NOVOL;
+        idx->fs[i].endvol=ARCHINDEX_NOVOL;
+    }
+    return idx;
+}
+
+void archindex_destroy(carchindex *idx)
+{
+    if (idx==NULL)
+        return;
+    writebuf_destroy(idx->entries);
+    free(idx);
+}
+
+// called by the writer for each header with the position where it has been written
+int archindex_add_header(carchindex *idx, char *magic, cdico *d, u16 fsid, u32 vol, u64 off)
+{
+    u8 entry[ARCHINDEX_ENTRYSIZE];
+    char path[PATH_MAX];
+    u32 filescount;
+    u64 objectid;
+    u16 pathlen;
+    u16 temp16;
+    u64 temp64;
+    u8 flags;
+    
+    assert(idx);
+    assert(d);
+    
+    if (memcmp(magic, FSA_MAGIC_FSYB, FSA_SIZEOF_MAGIC)==0 && fsid < FSA_MAX_FSPERARCH)
+    {   idx->fs[fsid].startvol=vol;
+        idx->fs[fsid].startoff=off;
+    }
+    else if (memcmp(magic, FSA_MAGIC_DATF, FSA_SIZEOF_MAGIC)==0 && fsid < FSA_MAX_FSPERARCH)
+    {   idx->fs[fsid].endvol=vol;
+        idx->fs[fsid].endoff=off;
+    }
+    else if (memcmp(magic, FSA_MAGIC_DATF, FSA_SIZEOF_MAGIC)==0) // the objects of savedir are in fs 0 but their footer has no fsid
+    {   idx->fs[0].endvol=vol;
+        idx->fs[0].endoff=off;
+    }
+    
+    // the next data block belongs to the last object header, or to all the headers of a group of small files
+    if (memcmp(magic, FSA_MAGIC_OBJT, FSA_SIZEOF_MAGIC)!=0)
+    {   idx->pending=idx->entries->size;
+        return 0;
+    }
+    
+    if (dico_get_u64(d, DICO_OBJ_SECTION_STDATTR, DISKITEMKEY_OBJECTID, &objectid)!=0 ||
+        dico_get_string(d, DICO_OBJ_SECTION_STDATTR, DISKITEMKEY_PATH, path, sizeof(path))!=0)
+    {   errprintf("cannot read the objectid and the path of an object header\n");
+        return -1;
+    }
+    
+    flags=0;
+    if (idx->multiremain > 0) // next header of the current group of small files
+    {   idx->multiremain--;
+        flags=ARCHINDEX_REGMULTI;
+    }
+    else if (dico_get_u32(d, DICO_OBJ_SECTION_STDATTR, DISKITEMKEY_MULTIFILESCOUNT, &filescount)==0 && filescount>0)
+    {   idx->pending=idx->entries->size;
+        idx->multiremain=filescount-1;
+        idx->groupvol=vol;
+        idx->groupoff=off;
+        flags=ARCHINDEX_REGMULTI;
+    }
+    else // normal object
+    {   idx->pending=idx->entries->size;
+    }
+    
+    pathlen=strnlen(path, sizeof(path));
+    temp64=cpu_to_le64(objectid);
+    memcpy(entry, &temp64, sizeof(temp64));
+    temp16=cpu_to_le16(fsid);
+    memcpy(entry+8, &temp16, sizeof(temp16));
+    entry[10]=flags;
+    archindex_put_pos(entry+11, vol, off);
+    archindex_put_pos(entry+23, ARCHINDEX_NOVOL, 0);
+    if (flags==ARCHINDEX_REGMULTI)
+        archindex_put_pos(entry+35, idx->groupvol, idx->groupoff);
+    else
+        archindex_put_pos(entry+35, vol, off);
+    temp16=cpu_to_le16(pathlen);
+    memcpy(entry+47, &temp16, sizeof(temp16));
+    
+    if (writebuf_add_data(idx->entries, entry, sizeof(entry))!=0 || writebuf_add_data(idx->entries, path, pathlen)!=0)
+    {   errprintf("cannot add an entry to the index\n");
+        return -1;
+    }
+    idx->count++;
+    
+    return 0;
+}
+
+// called by the writer for each data block with the position of its header
+int archindex_add_block(carchindex *idx, u32 vol, u64 off)
+{
+    u16 pathlen;
+    u16 temp16;
+    u8 *entry;
+    
+    assert(idx);
+    
+    for (entry=(u8*)idx->entries->data+idx->pending; entry < (u8*)idx->entries->data+idx->entries->size; entry+=ARCHINDEX_ENTRYSIZE+pathlen)
+    {
+        archindex_put_pos(entry+23, vol, off);
+        memcpy(&temp16, entry+47, sizeof(temp16));
+        pathlen=le16_to_cpu(temp16);
+    }
+    idx->pending=idx->entries->size;
+    
+    return 0;
+}
+
+// serialize the index: the first header has the positions of the filesystems and each header has the
+// entries which fit in ARCHINDEX_CHUNKSIZE bytes. returns 1 when all the entries have been written
+int archindex_get_dico(carchindex *idx, u64 *cursor, cdico **d)
+{
+    u8 fspos[ARCHINDEX_FSPOSSIZE*FSA_MAX_FSPERARCH];
+    u64 fsposlen;
+    u64 first;
+    u64 count;
+    u16 pathlen;
+    u16 temp16;
+    u8 *entry;
+    int i;
+    
+    assert(idx);
+    assert(cursor);
+    
+    if ((*cursor > 0) && (*cursor >= idx->entries->size))
+        return 1;
+    if ((*d=dico_alloc())==NULL)
+    {   errprintf("dico_alloc() failed\n");
+        return -1;
+    }
+    
+    if (*cursor==0)
+    {
+        fsposlen=0;
+        for (i=0; i < FSA_MAX_FSPERARCH; i++)
+        {
+            if (idx->fs[i].startvol!=ARCHINDEX_NOVOL || idx->fs[i].endvol!=ARCHINDEX_NOVOL)
+            {   temp16=cpu_to_le16((u16)i);
+                memcpy(fspos+fsposlen, &temp16, sizeof(temp16));
+                archindex_put_pos(fspos+fsposlen+2, idx->fs[i].startvol, idx->fs[i].startoff);
+                archindex_put_pos(fspos+fsposlen+14, idx->fs[i].endvol, idx->fs[i].endoff);
+                fsposlen+=ARCHINDEX_FSPOSSIZE;
+            }
+        }
+        dico_add_data(*d, 0, INDEXKEY_FSPOS, fspos, fsposlen);
+    }
+    
+    // whole entries only: an entry is never split between two headers
+    first=*cursor;
+    count=0;
+    while (*cursor < idx->entries->size)
+    {
+        entry=(u8*)idx->entries->data+*cursor;
+        memcpy(&temp16, entry+47, sizeof(temp16));
+        pathlen=le16_to_cpu(temp16);
+        if (*cursor-first+ARCHINDEX_ENTRYSIZE+pathlen > ARCHINDEX_CHUNKSIZE)
+            break;
+        *cursor+=ARCHINDEX_ENTRYSIZE+pathlen;
+        count++;
+    }
+    dico_add_u32(*d, 0, INDEXKEY_ENTRYCOUNT, count);
+    dico_add_data(*d, 0, INDEXKEY_ENTRIES, idx->entries->data+first, *cursor-first);
+    if (*cursor==0) // empty index: the cursor must move so that the next call returns 1
+        *cursor=1;
+    
+    return 0;
+}
+
+// add the contents of an index header which has been read from an archive
+int archindex_add_dico(carchindex *idx, cdico *d, bool withentries)
+{
+    u8 buffer[ARCHINDEX_CHUNKSIZE];
+    u16 size;
+    u16 fsid;
+    u16 temp16;
+    u32 count;
+    int i;
+    
+    assert(idx);
+    assert(d);
+    
+    if (dico_get_data(d, 0, INDEXKEY_FSPOS, buffer, sizeof(buffer), &size)==0)
+    {
+        for (i=0; i+ARCHINDEX_FSPOSSIZE <= size; i+=ARCHINDEX_FSPOSSIZE)
+        {
+            memcpy(&temp16, buffer+i, sizeof(temp16));
+            if ((fsid=le16_to_cpu(temp16)) >= FSA_MAX_FSPERARCH)
+                continue;
+            archindex_get_pos(buffer+i+2, &idx->fs[fsid].startvol, &idx->fs[fsid].startoff);
+            archindex_get_pos(buffer+i+14, &idx->fs[fsid].endvol, &idx->fs[fsid].endoff);
+        }
+    }
+    
+    if (withentries==false)
+        return 0;
+    
+    if (dico_get_u32(d, 0, INDEXKEY_ENTRYCOUNT, &count)!=0 || dico_get_data(d, 0, INDEXKEY_ENTRIES, buffer, sizeof(buffer), &size)!=0)
+    {   errprintf("cannot read the entries of the index header\n");
+        return -1;
+    }
+    if (writebuf_add_data(idx->entries, buffer, size)!=0)
+    {   errprintf("cannot add the entries to the index\n");
+        return -1;
+    }
+    idx->count+=count;
+    
+    return 0;
+}
+
+// decode the entry at cursor and move the cursor to the next one: returns 1 after the last entry
+int archindex_get_entry(carchindex *idx, u64 *cursor, carchindexent *ent)
+{
+    u16 pathlen;
+    u16 temp16;
+    u64 temp64;
+    u8 *entry;
+    
+    assert(idx);
+    assert(ent);
+    
+    if (*cursor >= idx->entries->size)
+        return 1;
+    if (*cursor+ARCHINDEX_ENTRYSIZE > idx->entries->size)
+    {   errprintf("the index is truncated\n");
+        return -1;
+    }
+    
+    entry=(u8*)idx->entries->data+*cursor;
+    memcpy(&temp16, entry+47, sizeof(temp16));
+    pathlen=le16_to_cpu(temp16);
+    if ((*cursor+ARCHINDEX_ENTRYSIZE+pathlen > idx->entries->size) || (pathlen >= PATH_MAX))
+    {   errprintf("the index is truncated\n");
+        return -1;
+    }
+    
+    memcpy(&temp64, entry, sizeof(temp64));
+    ent->objectid=le64_to_cpu(temp64);
+    memcpy(&temp16, entry+8, sizeof(temp16));
+    ent->fsid=le16_to_cpu(temp16);
+    ent->flags=entry[10];
+    archindex_get_pos(entry+11, &ent->objtvol, &ent->objtoff);
+    archindex_get_pos(entry+23, &ent->datavol, &ent->dataoff);
+    archindex_get_pos(entry+35, &ent->groupvol, &ent->groupoff);
+    memcpy(ent->path, entry+ARCHINDEX_ENTRYSIZE, pathlen);
+    ent->path[pathlen]=0;
+    *cursor+=ARCHINDEX_ENTRYSIZE+pathlen;
+    
+    return 0;
+}
+
+// returns true if the index knows where the filesystem starts and ends
+bool archindex_get_fs(carchindex *idx, u16 fsid, carchindexfs *fs)
+{
+    assert(idx);
+    
+    if ((fsid >= FSA_MAX_FSPERARCH) || (idx->fs[fsid].startvol==ARCHINDEX_NOVOL) || (idx->fs[fsid].endvol==ARCHINDEX_NOVOL))
+        return false;
+    *fs=idx->fs[fsid];
+    return true;
+}
+
+static int archindex_add_skip(carchindexrange **skips, u64 *count, u64 *maxcount, carchindexrange *run)
+{
+    carchindexrange *newskips;
+    
+    if (*count >= *maxcount)
+    {
+        *maxcount=(*maxcount>0)?(*maxcount*2):64;
+        if ((newskips=realloc(*skips, *maxcount*sizeof(carchindexrange)))==NULL)
+        {   errprintf("realloc(%ld) failed: out of memory\n", (long)(*maxcount*sizeof(carchindexrange)));
+            return -1;
+        }
+        *skips=newskips;
+    }
+    (*skips)[(*count)++]=*run;
+    return 0;
+}
+
+// list the parts of the archive which don't have to be read when only the objects which match the patterns
+// are restored: the runs of objects (or of groups of small files) which have no selected object. a run ends
+// before the footer of its filesystem so that the reader still finds the end of the filesystem
+int archindex_get_skips(carchindex *idx, cstrlist *only, u8 *fsbitmap, carchindexrange **skips, u64 *count)
+{
+    carchindexent ent;
+    carchindexrange run;
+    u64 maxcount=0;
+    u64 cursor=0;
+    bool inunit=false; // the entries of the current object or group of small files
+    bool unitsel=false;
+    u32 unitvol=0;
+    u64 unitoff=0;
+    u16 unitfsid=0;
+    bool inrun=false; // the objects of the current run are not selected
+    u16 runfsid=0;
+    int res;
+    
+    assert(idx);
+    assert(skips);
+    assert(count);
+    
+    *skips=NULL;
+    *count=0;
+    
+    while (true)
+    {
+        if ((res=archindex_get_entry(idx, &cursor, &ent))<0)
+            goto archindex_get_skips_error;
+        
+        if ((res==0) && (inunit==true) && (ent.fsid==unitfsid) && (ent.groupvol==unitvol) && (ent.groupoff==unitoff))
+        {   unitsel|=((fsbitmap[ent.fsid]!=0) && (pathlist_check(only, ent.path)==true));
+            continue;
+        }
+        
+        // the current unit is complete: a selected unit ends the run, the others start one
+        if ((inunit==true) && (unitsel==true) && (inrun==true))
+        {   run.endvol=unitvol;
+            run.endoff=unitoff;
+            if (archindex_add_skip(skips, count, &maxcount, &run)!=0)
+                goto archindex_get_skips_error;
+            inrun=false;
+        }
+        else if ((inunit==true) && (unitsel==false) && (inrun==false))
+        {   run.startvol=unitvol;
+            run.startoff=unitoff;
+            runfsid=unitfsid;
+            inrun=true;
+        }
+        
+        // a run stops at the end of its filesystem (it is not skipped when the end is not known)
+        if ((inrun==true) && ((res==1) || (ent.fsid!=runfsid)))
+        {
+            if (idx->fs[runfsid].endvol!=ARCHINDEX_NOVOL)
+            {   run.endvol=idx->fs[runfsid].endvol;
+                run.endoff=idx->fs[runfsid].endoff;
+                if (archindex_add_skip(skips, count, &maxcount, &run)!=0)
+                    goto archindex_get_skips_error;
+            }
+            inrun=false;
+        }
+        
+        if (res==1) // no more entries
+            break;
+        
+        // the objects of the filesystems which are not known are always read
+        inunit=(ent.fsid < FSA_MAX_FSPERARCH);
+        unitsel=(inunit==false) || ((fsbitmap[ent.fsid]!=0) && (pathlist_check(only, ent.path)==true));
+        unitfsid=ent.fsid;
+        unitvol=ent.groupvol;
+        unitoff=ent.groupoff;
+    }
+    
+    return 0;
+    
+archindex_get_skips_error:
+    free(*skips);
+    *skips=NULL;
+    *count=0;
+    return -1;
+}
+
+// read the index of the archive which is read by ai (its main header must have been read): the
+// footer of the last volume is found at the end of the last volume. returns 1 if there is no index
+int archindex_load(carchindex *idx, carchreader *ai, bool withentries)
+{
+    char magic[FSA_SIZEOF_MAGIC];
+    char volpath[PATH_MAX];
+    carchreader ar;
+    cdico *d=NULL;
+    u32 indexvol;
+    u64 indexoff;
+    u32 lastvol;
+    s64 footpos;
+    u16 fsid;
+    int ret=1;
+    
+    assert(idx);
+    assert(ai);
+    
+    // the index is read with its own reader so that the archive can still be read from the current position
+    archreader_init(&ar);
+    snprintf(ar.basepath, PATH_MAX, "%s", ai->basepath);
+    ar.archid=ai->archid;
+    ar.sumalgo=ai->sumalgo;
+    
+    // the last volume is the last one which exists, the volumes of another archive with the
+    // same name (which have no footer with the same archive id) are ignored
+    ar.curvol=ai->curvol;
+    while ((get_path_to_volume(volpath, PATH_MAX, ar.basepath, ar.curvol+1)==0) && (regfile_exists(volpath)==true))
+        ar.curvol++;
+    for (footpos=-1; footpos < 0; ar.curvol--)
+    {
+        if (archreader_volpath(&ar)!=0 || archreader_open(&ar)!=0)
+        {   msgprintf(MSG_STACK, "cannot open volume %ld of the archive\n", (long)ar.curvol);
+            goto archindex_load_end;
+        }
+        if ((footpos=archreader_find_volfooter(&ar)) >= 0)
+            break;
+        archreader_close(&ar);
+        if (ar.curvol==ai->curvol)
+        {   msgprintf(MSG_VERB2, "cannot find the footer of the last volume: the archive has no index\n");
+            goto archindex_load_end;
+        }
+    }
+    
+    if (archreader_seek(&ar, footpos)!=0 || archreader_read_header(&ar, magic, &d, false, &fsid)!=FSAERR_SUCCESS)
+    {   msgprintf(MSG_STACK, "cannot read the footer of the last volume\n");
+        goto archindex_load_end;
+    }
+    if ((dico_get_u32(d, 0, VOLUMEFOOTKEY_LASTVOL, &lastvol)!=0) || (lastvol!=true) ||
+        (dico_get_u32(d, 0, VOLUMEFOOTKEY_INDEXVOL, &indexvol)!=0) ||
+        (dico_get_u64(d, 0, VOLUMEFOOTKEY_INDEXOFFSET, &indexoff)!=0))
+    {   msgprintf(MSG_VERB2, "the archive has no index\n");
+        goto archindex_load_end;
+    }
+    dico_destroy(d);
+    d=NULL;
+    
+    // the index may start in a previous volume
+    if (indexvol!=ar.curvol)
+    {
+        archreader_close(&ar);
+        ar.curvol=indexvol;
+        if (archreader_volpath(&ar)!=0 || archreader_open(&ar)!=0 || archreader_read_volheader(&ar)!=0)
+        {   msgprintf(MSG_STACK, "cannot open volume %ld where the index starts\n", (long)indexvol);
+            ret=-1;
+            goto archindex_load_end;
+        }
+    }
+    if (archreader_seek(&ar, indexoff)!=0)
+    {   ret=-1;
+        goto archindex_load_end;
+    }
+    
+    ret=-1;
+    while (true)
+    {
+        if (archreader_read_header(&ar, magic, &d, false, &fsid)!=FSAERR_SUCCESS)
+        {   errprintf("cannot read the index of the archive\n");
+            goto archindex_load_end;
+        }
+        if (memcmp(magic, FSA_MAGIC_INDX, FSA_SIZEOF_MAGIC)==0)
+        {
+            if (archindex_add_dico(idx, d, withentries)!=0)
+            {   msgprintf(MSG_STACK, "archindex_add_dico() failed\n");
+                goto archindex_load_end;
+            }
+            if (withentries==false) // the positions of the filesystems are in the first header
+                break;
+        }
+        else if (memcmp(magic, FSA_MAGIC_VOLF, FSA_SIZEOF_MAGIC)==0)
+        {
+            if (dico_get_u32(d, 0, VOLUMEFOOTKEY_LASTVOL, &lastvol)==0 && lastvol==true)
+                break;
+            archreader_close(&ar);
+            archreader_incvolume(&ar, false);
+            if (archreader_open(&ar)!=0 || archreader_read_volheader(&ar)!=0)
+            {   msgprintf(MSG_STACK, "cannot open volume %s of the index\n", ar.volpath);
+                goto archindex_load_end;
+            }
+        }
+        else
+        {   errprintf("unexpected header in the index: [%.4s]\n", magic);
+            goto archindex_load_end;
+        }
+        dico_destroy(d);
+        d=NULL;
+    }
+    msgprintf(MSG_VERB2, "the index of the archive has %lld entries\n", (long long)idx->count);
+    ret=0;
+    
+archindex_load_end:
+    if (d!=NULL)
+        dico_destroy(d);
+    archreader_close(&ar);
+    archreader_destroy(&ar);
+    return ret;
+}
@@ -0,0 +1,97 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __ARCHINDEX_H__
+#define __ARCHINDEX_H__
+
+#include <limits.h>
+
+struct s_dico;
+struct s_writebuf;
+struct s_archreader;
+struct s_strlist;
+
+#define ARCHINDEX_CHUNKSIZE   60000 // bytes of entries per index header (the data of a dico item is limited to 64K)
+#define ARCHINDEX_ENTRYSIZE   49 // size of an entry without its path
+#define ARCHINDEX_NOVOL       0xFFFFFFFF // volume of a position which is not known
+
+enum {ARCHINDEX_REGMULTI=1}; // flags of the entries
+
+struct s_archindexfs;
+typedef struct s_archindexfs carchindexfs;
+
+struct s_archindexent;
+typedef struct s_archindexent carchindexent;
+
+struct s_archindexrange;
+typedef struct s_archindexrange carchindexrange;
+
+struct s_archindex;
+typedef struct s_archindex carchindex;
+
+// where a filesystem starts (FSA_MAGIC_FSYB) and where its contents end (FSA_MAGIC_DATF)
+struct s_archindexfs
+{   u32    startvol;
+    u64    startoff;
+    u32    endvol;
+    u64    endoff;
+};
+
+// part of the archive which does not have to be read: the reader jumps from start to end
+struct s_archindexrange
+{   u32    startvol;
+    u64    startoff;
+    u32    endvol;
+    u64    endoff;
+};
+
+// position of an object in the archive: each position is a volume number and an offset in that volume
+struct s_archindexent
+{   u64    objectid; // DISKITEMKEY_OBJECTID of the object
+    u16    fsid; // filesystem of the object
+    u8     flags; // ARCHINDEX_REGMULTI when the object is a small file which shares a block with other files
+    u32    objtvol; // object header (FSA_MAGIC_OBJT)
+    u64    objtoff;
+    u32    datavol; // first data block of a regular file, or shared block of a small file (FSA_MAGIC_BLKH)
+    u64    dataoff;
+    u32    groupvol; // first header of the group of small files (this is where the restore of the object starts)
+    u64    groupoff;
+    char   path[PATH_MAX]; // DISKITEMKEY_PATH of the object
+};
+
+struct s_archindex
+{   struct s_writebuf *entries; // the entries packed as they are stored in the archive (little endian)
+    u64    count; // number of entries
+    u64    pending; // offset of the first entry which waits for the position of its first data block
+    u32    multiremain; // headers of the current group of small files which have not been indexed yet
+    u32    groupvol; // first header of the current group of small files
+    u64    groupoff;
+    carchindexfs fs[FSA_MAX_FSPERARCH];
+};
+
+carchindex *archindex_alloc();
+void archindex_destroy(carchindex *idx);
+int  archindex_add_header(carchindex *idx, char *magic, struct s_dico *d, u16 fsid, u32 vol, u64 off);
+int  archindex_add_block(carchindex *idx, u32 vol, u64 off);
+int  archindex_get_dico(carchindex *idx, u64 *cursor, struct s_dico **d);
+int  archindex_add_dico(carchindex *idx, struct s_dico *d, bool withentries);
+int  archindex_get_entry(carchindex *idx, u64 *cursor, carchindexent *ent);
+bool archindex_get_fs(carchindex *idx, u16 fsid, carchindexfs *fs);
+int  archindex_load(carchindex *idx, struct s_archreader *ai, bool withentries);
+int  archindex_get_skips(carchindex *idx, struct s_strlist *only, u8 *fsbitmap, carchindexrange **skips, u64 *count);
+
+#endif // __ARCHINDEX_H__
@@ -37,6 +37,8 @@ char *compalgostr(int algo)
         case COMPRESS_GZIP:    return "gzip";
         case COMPRESS_BZIP2:   return "bzip2";
         case COMPRESS_LZMA:    return "lzma";
+        case COMPRESS_ZSTD:    return "zstd";
+        case COMPRESS_LZ4:     return "lz4";
         default:               return "unknown";
     }
 }
@@ -47,10 +49,23 @@ char *cryptalgostr(int algo)
     {
         case ENCRYPT_NONE:     return "none";
         case ENCRYPT_BLOWFISH: return "blowfish";
+        case ENCRYPT_AES256GCM: return "aes256-gcm";
+        case ENCRYPT_CHACHA20: return "chacha20-poly1305";
         default:               return "unknown";
     }
 }
 
+char *sumalgostr(int algo)
+{
+    switch (algo)
+    {
+        case CHECKSUM_FLETCHER32: return "fletcher32";
+        case CHECKSUM_CRC32C:     return "crc32c";
+        case CHECKSUM_XXH3:       return "xxh3";
+        default:                  return "unknown";
+    }
+}
+
 int archinfo_show_mainhead(carchreader *ai, cdico *dicomainhead)
 {
     char buffer[256];
@@ -74,6 +89,8 @@ int archinfo_show_mainhead(carchreader *ai, cdico *dicomainhead)
             (int)FSA_VERSION_GET_B(ai->minfsaver), (int)FSA_VERSION_GET_C(ai->minfsaver), (int)FSA_VERSION_GET_D(ai->minfsaver));
     msgprintf(MSG_FORCE, "Compression level: \t\t%d (%s level %d)\n", ai->fsacomp, compalgostr(ai->compalgo), ai->complevel);
     msgprintf(MSG_FORCE, "Encryption algorithm: \t\t%s\n", cryptalgostr(ai->cryptalgo));
+    msgprintf(MSG_FORCE, "Checksum algorithm: \t\t%s\n", sumalgostr(ai->sumalgo));
+    msgprintf(MSG_FORCE, "File checksums: \t\t%s\n", (ai->hasblkhashes==true)?"sha256 per block":"md5");
     msgprintf(MSG_FORCE, "\n");
     
     return 0;
@@ -25,5 +25,6 @@ int archinfo_show_mainhead(struct s_archreader *ai, struct s_dico *dicomainhead)
 int archinfo_show_fshead(struct s_dico *dicofshead, int fsid);
 char *compalgostr(int algo);
 char *cryptalgostr(int algo);
+char *sumalgostr(int algo);
 
 #endif // __ARCHINFO_H__
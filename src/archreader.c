@@ -36,6 +36,9 @@
 #include "comp_gzip.h"
 #include "comp_bzip2.h"
 #include "error.h"
+#include "pipestats.h"
+#include "bufpool.h"
+#include "checksum.h"
 
 int archreader_init(carchreader *ai)
 {
@@ -46,10 +49,14 @@ int archreader_init(carchreader *ai)
     ai->fsacomp=-1;
     ai->complevel=-1;
     ai->archfd=-1;
+    ai->buf=NULL;
+    ai->lastblkpos=-1;
     ai->archid=0;
     ai->curvol=0;
     ai->filefmtver=0;
     ai->hasdirsinfohead=false;
+    ai->hasblkhashes=false;
+    ai->sumalgo=CHECKSUM_FLETCHER32;
     return 0;
 }
 
@@ -85,17 +92,20 @@ int archreader_open(carchreader *ai)
         return -1;
     }
     
-    // read file format version and rewind to beginning of the volume
-    if (read(ai->archfd, volhead, sizeof(volhead))!=sizeof(volhead))
+    // the volume is read sequentially: a larger read-ahead keeps several reads in flight on the device
+    posix_fadvise(ai->archfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    
+    // read file format version (the volume is then read from the beginning)
+    if (pread(ai->archfd, volhead, sizeof(volhead), 0)!=sizeof(volhead))
     {   sysprintf("cannot read magic from %s\n", ai->volpath);
         close(ai->archfd);
         return -1;
     }
-    if (lseek64(ai->archfd, 0, SEEK_SET)!=0)
-    {   sysprintf("cannot rewind volume %s\n", ai->volpath);
-        close(ai->archfd);
-        return -1;
-    }
+    ai->bufpos=0;
+    ai->bufoff=0;
+    ai->bufsize=0;
+    ai->sliceend=0;
+    ai->lastblkpos=-1;
     
     // interpret magic an get file format version
     magiclen=strlen(FSA_FILEFORMAT);
@@ -131,6 +141,10 @@ int archreader_close(carchreader *ai)
     res=lockf(ai->archfd, F_ULOCK, 0);
     close(ai->archfd);
     ai->archfd=-1;
+    
+    // the buffer is released when the last block which is a slice of it is released
+    bufpool_free(ai->buf);
+    ai->buf=NULL;
 
     return 0;
 }
@@ -149,30 +163,137 @@ int archreader_incvolume(carchreader *ai, bool waitkeypress)
     return archreader_volpath(ai);
 }
 
-int archreader_read_data(carchreader *ai, void *data, u64 size)
+// the volume is read in large chunks and the headers are parsed from memory: make sure that the size
+// bytes which follow the current position are in buf (size must not exceed ARCHREADER_BUFSIZE/2)
+static int archreader_fill(carchreader *ai, u64 size)
 {
+    char *newbuf;
+    u64 first;
+    u64 keep;
+    u64 start;
     long lres;
     
+    if (ai->bufsize-ai->bufoff >= size)
+        return 0;
+    
+    // a few bytes before the current position are kept so that a block can be a slice of buf
+    keep=min(ai->bufoff, ARCHREADER_KEEP);
+    first=ai->bufoff-keep;
+    if ((ai->buf==NULL) || (bufpool_refcount(ai->buf)>1)) // blocks still use buf: the data go to a new buffer
+    {
+        if ((newbuf=bufpool_alloc(ARCHREADER_BUFSIZE))==NULL)
+        {   errprintf("cannot allocate the read buffer: bufpool_alloc(%ld) failed\n", (long)ARCHREADER_BUFSIZE);
+            return -1;
+        }
+        if (ai->bufsize > first)
+            memcpy(newbuf, ai->buf+first, ai->bufsize-first);
+        bufpool_free(ai->buf);
+        ai->buf=newbuf;
+    }
+    else if (first>0)
+    {
+        memmove(ai->buf, ai->buf+first, ai->bufsize-first);
+    }
+    ai->bufpos+=first;
+    ai->bufsize-=first;
+    ai->bufoff=keep;
+    ai->sliceend=0; // the slices are in the previous buffer, or they have all been released
+    
+    // read as much as possible so that the next headers are already in memory
+    while (ai->bufsize-ai->bufoff < size)
+    {
+        start=pipestats_start();
+        lres=pread(ai->archfd, ai->buf+ai->bufsize, ARCHREADER_BUFSIZE-ai->bufsize, ai->bufpos+ai->bufsize);
+        pipestats_add(PIPESTATS_READ, start, max(lres, 0));
+        if (lres<=0) // end of the volume or error
+            return -1;
+        ai->bufsize+=lres;
+    }
+    
+    return 0;
+}
+
+// position in the current volume of the next byte which will be read
+s64 archreader_get_pos(carchreader *ai)
+{
     assert(ai);
+    return ai->bufpos+ai->bufoff;
+}
 
-    if ((lres=read(ai->archfd, (char*)data, (long)size))!=(long)size)
-    {   sysprintf("read failed: read(size=%ld)=%ld\n", (long)size, lres);
+int archreader_seek(carchreader *ai, s64 pos)
+{
+    assert(ai);
+    
+    if (pos < 0)
+    {   errprintf("invalid position in archive: pos=%lld\n", (long long)pos);
         return -1;
     }
     
+    if ((pos>=ai->bufpos) && (pos<=ai->bufpos+(s64)ai->bufsize)) // the position is in the buffer
+    {
+        ai->bufoff=pos-ai->bufpos;
+    }
+    else // the buffer is refilled from the new position by the next read
+    {
+        ai->bufpos=pos;
+        ai->bufoff=0;
+        ai->bufsize=0;
+    }
+    
     return 0;
 }
 
-int archreader_read_dico(carchreader *ai, cdico *d)
+int archreader_read_data(carchreader *ai, void *data, u64 size)
+{
+    u64 avail;
+    u64 start;
+    long lres;
+    
+    assert(ai);
+    
+    // large data are read directly after what remains in the buffer
+    if (size > ARCHREADER_BUFSIZE/2)
+    {
+        avail=min(ai->bufsize-ai->bufoff, size);
+        if (avail>0)
+            memcpy(data, ai->buf+ai->bufoff, avail);
+        ai->bufoff+=avail;
+        if (avail==size)
+            return 0;
+        start=pipestats_start();
+        lres=pread(ai->archfd, (char*)data+avail, (long)(size-avail), ai->bufpos+ai->bufsize);
+        pipestats_add(PIPESTATS_READ, start, max(lres, 0));
+        if (lres!=(long)(size-avail))
+        {   sysprintf("read failed: read(size=%ld)=%ld\n", (long)(size-avail), lres);
+            return -1;
+        }
+        ai->bufpos+=ai->bufsize+lres;
+        ai->bufoff=0;
+        ai->bufsize=0;
+        return 0;
+    }
+    
+    if (archreader_fill(ai, size)!=0)
+    {   sysprintf("read failed: read(size=%ld) reached the end of the volume or failed\n", (long)size);
+        return -1;
+    }
+    memcpy(data, ai->buf+ai->bufoff, size);
+    ai->bufoff+=size;
+    
+    return 0;
+}
+
+int archreader_read_dico(carchreader *ai, cdico *d, int sumalgo)
 {
     u16 size;
     u32 headerlen;
-    u32 origsum;
-    u32 newsum;
+    u64 origsum;
+    u64 newsum;
     u8 *buffer;
     u8 *bufpos;
     u16 temp16;
     u32 temp32;
+    u64 temp64;
     u8 section;
     u16 count;
     u8 type;
@@ -216,15 +337,16 @@ int archreader_read_dico(carchreader *ai, cdico *d)
         return OLDERR_FATAL;
     }
     
-    if (archreader_read_data(ai, &temp32, sizeof(temp32))!=0)
+    // the size of the checksum depends on the algorithm
+    if (archreader_read_data(ai, (checksum_size(sumalgo)==8)?(void*)&temp64:(void*)&temp32, checksum_size(sumalgo))!=0)
     {   errprintf("cannot read header checksum\n");
         free(buffer);
         return OLDERR_FATAL;
     }
-    origsum=le32_to_cpu(temp32);
+    origsum=(checksum_size(sumalgo)==8)?le64_to_cpu(temp64):le32_to_cpu(temp32);
     
     // check header-data integrity using checksum    
-    newsum=fletcher32(buffer, headerlen);
+    newsum=checksum_compute(sumalgo, buffer, headerlen);
     
     if (newsum!=origsum)
     {   errprintf("bad checksum for header\n");
@@ -268,8 +390,145 @@ int archreader_read_dico(carchreader *ai, cdico *d)
     return FSAERR_SUCCESS;
 }
 
+// search the next header magic from the current position: the buffer is scanned for the first
+// byte of the magics and each candidate is compared with all of them
+static int archreader_scan_magic(carchreader *ai)
+{
+    u8 firstbyte[256];
+    u8 *data;
+    u64 i;
+    int j;
+    
+    memset(firstbyte, 0, sizeof(firstbyte));
+    for (j=0; valid_magic[j]!=NULL; j++)
+        firstbyte[(u8)valid_magic[j][0]]=true;
+    
+    while (archreader_fill(ai, FSA_SIZEOF_MAGIC)==0)
+    {
+        data=(u8*)ai->buf;
+        for (i=ai->bufoff; i+FSA_SIZEOF_MAGIC <= ai->bufsize; i++)
+        {
+            if (firstbyte[data[i]] && is_magic_valid((char*)data+i))
+            {   ai->bufoff=i;
+                return 0;
+            }
+        }
+        // the last bytes may be the beginning of a magic which continues in the next chunk
+        ai->bufoff=i;
+    }
+    
+    return -1; // end of the volume
+}
+
+// a magic found by the scanner may be part of the data of a block: the candidate is accepted if it
+// is followed by the right archive-id and a header which matches its checksum (checked in memory)
+static bool archreader_check_candidate(carchreader *ai)
+{
+    char magic[FSA_SIZEOF_MAGIC];
+    u64 headerlen;
+    u32 lenfieldsize;
+    u32 prefixsize;
+    u16 temp16;
+    u32 temp32;
+    u64 temp64;
+    u64 origsum;
+    u8 *data;
+    int sumalgo;
+    int sumsize;
+    
+    lenfieldsize=(ai->filefmtver==1)?sizeof(u16):sizeof(u32);
+    prefixsize=FSA_SIZEOF_MAGIC+sizeof(u32)+sizeof(u16)+lenfieldsize;
+    if (archreader_fill(ai, prefixsize)!=0)
+        return false;
+    data=(u8*)ai->buf+ai->bufoff;
+    
+    memcpy(magic, data, FSA_SIZEOF_MAGIC);
+    memcpy(&temp32, data+FSA_SIZEOF_MAGIC, sizeof(temp32));
+    if ((ai->archid) && (le32_to_cpu(temp32)!=ai->archid))
+        return false;
+    
+    if (lenfieldsize==sizeof(u16))
+    {   memcpy(&temp16, data+prefixsize-lenfieldsize, sizeof(temp16));
+        headerlen=le16_to_cpu(temp16);
+    }
+    else
+    {   memcpy(&temp32, data+prefixsize-lenfieldsize, sizeof(temp32));
+        headerlen=le32_to_cpu(temp32);
+    }
+    
+    // a header must have a count of items and must fit in the buffer to be checked
+    sumalgo=checksum_header_algo(magic, ai->sumalgo);
+    sumsize=checksum_size(sumalgo);
+    if ((headerlen < sizeof(u16)) || (prefixsize+headerlen+sumsize > ARCHREADER_BUFSIZE/2))
+        return false;
+    if (archreader_fill(ai, prefixsize+headerlen+sumsize)!=0)
+        return false;
+    data=(u8*)ai->buf+ai->bufoff;
+    
+    if (sumsize==8)
+    {   memcpy(&temp64, data+prefixsize+headerlen, sizeof(temp64));
+        origsum=le64_to_cpu(temp64);
+    }
+    else
+    {   memcpy(&temp32, data+prefixsize+headerlen, sizeof(temp32));
+        origsum=le32_to_cpu(temp32);
+    }
+    
+    return (checksum_compute(sumalgo, data+prefixsize, headerlen)==origsum);
+}
+
+// position of the last valid volume footer in the last ARCHREADER_TAILSIZE bytes of the current volume
+// (the index follows the data of the archive and it is referenced from the last volume footer)
+s64 archreader_find_volfooter(carchreader *ai)
+{
+    struct stat64 st;
+    s64 footpos=-1;
+    
+    assert(ai);
+    
+    if (fstat64(ai->archfd, &st)!=0)
+    {   sysprintf("fstat64(%s) failed\n", ai->volpath);
+        return -1;
+    }
+    if (archreader_seek(ai, max(st.st_size-ARCHREADER_TAILSIZE, 0))!=0)
+        return -1;
+    
+    while (archreader_scan_magic(ai)==0)
+    {
+        if ((memcmp(ai->buf+ai->bufoff, FSA_MAGIC_VOLF, FSA_SIZEOF_MAGIC)==0) && (archreader_check_candidate(ai)==true))
+            footpos=archreader_get_pos(ai);
+        ai->bufoff++;
+    }
+    
+    return footpos;
+}
+
+// continue to read the archive from another position, which may be in another volume
+int archreader_goto(carchreader *ai, u32 vol, s64 pos)
+{
+    assert(ai);
+    
+    if (vol!=ai->curvol)
+    {
+        archreader_close(ai);
+        ai->curvol=vol;
+        if (archreader_volpath(ai)!=0 || archreader_open(ai)!=0)
+        {   msgprintf(MSG_STACK, "cannot open volume %ld\n", (long)vol);
+            return -1;
+        }
+        if (archreader_read_volheader(ai)!=0)
+        {   msgprintf(MSG_STACK, "archreader_read_volheader() failed\n");
+            return -1;
+        }
+    }
+    ai->lastblkpos=-1;
+    
+    return archreader_seek(ai, pos);
+}
+
 int archreader_read_header(carchreader *ai, char *magic, cdico **d, bool allowseek, u16 *fsid)
 {
+    s64 lastblkpos;
     s64 curpos;
     u16 temp16;
     u32 temp32;
@@ -291,10 +550,9 @@ int archreader_read_header(carchreader *ai, char *magic, cdico **d, bool allowse
     }
     
     // search for next read header marker and magic (it may be further if corruption in archive)
-    if ((curpos=lseek64(ai->archfd, 0, SEEK_CUR))<0)
-    {   sysprintf("lseek64() failed to get the current position in archive\n");
-        return OLDERR_FATAL;
-    }
+    curpos=archreader_get_pos(ai);
+    lastblkpos=ai->lastblkpos;
+    ai->lastblkpos=-1;
     
     if ((res=archreader_read_data(ai, magic, FSA_SIZEOF_MAGIC))!=FSAERR_SUCCESS)
     {   msgprintf(MSG_STACK, "cannot read header magic: res=%d\n", res);
@@ -307,12 +565,26 @@ int archreader_read_header(carchreader *ai, char *magic, cdico **d, bool allowse
         return OLDERR_FATAL;
     }
     
-    while (is_magic_valid(magic)!=true)
+    // the archive is corrupt: skip the data until the next valid header (the previous block may be corrupt
+    // and shorter than expected, so the header is searched from the beginning of its data in that case)
+    if (is_magic_valid(magic)!=true)
     {
-        if (lseek64(ai->archfd, curpos++, SEEK_SET)<0)
-        {   sysprintf("lseek64(pos=%lld, SEEK_SET) failed\n", (long long)curpos);
+        if (archreader_seek(ai, (lastblkpos>=0)?lastblkpos:curpos)!=0)
+        {   errprintf("archreader_seek(pos=%lld) failed\n", (long long)curpos);
             return OLDERR_FATAL;
         }
+        do
+        {
+            if (archreader_scan_magic(ai)!=0)
+            {   errprintf("cannot find a valid header after the corrupt data at offset %lld of %s\n", (long long)curpos, ai->volpath);
+                return OLDERR_FATAL;
+            }
+            if (archreader_check_candidate(ai)==true)
+                break;
+            ai->bufoff++; // false positive: the scan continues after the first byte of the candidate
+        } while (true);
+        errprintf("corrupt data at offset %lld of %s: the next valid header is at offset %lld\n", (long long)curpos, ai->volpath, (long long)archreader_get_pos(ai));
+        
         if ((res=archreader_read_data(ai, magic, FSA_SIZEOF_MAGIC))!=FSAERR_SUCCESS)
         {   msgprintf(MSG_STACK, "cannot read header magic: res=%d\n", res);
             return OLDERR_FATAL;
@@ -341,7 +613,7 @@ int archreader_read_header(carchreader *ai, char *magic, cdico **d, bool allowse
     *fsid=le16_to_cpu(temp16);
     
     // read the dico of the header
-    if ((res=archreader_read_dico(ai, *d))!=FSAERR_SUCCESS)
+    if ((res=archreader_read_dico(ai, *d, checksum_header_algo(magic, ai->sumalgo)))!=FSAERR_SUCCESS)
     {   msgprintf(MSG_STACK, "imgdisk_read_dico() failed\n");
         return res;
     }
@@ -434,26 +706,26 @@ archio_read_volheader_error:
     return ret;
 }
 
-int archreader_read_block(carchreader *ai, cdico *in_blkdico, int in_skipblock, int *out_sumok, struct s_blockinfo *out_blkinfo)
+int archreader_read_block(carchreader *ai, cdico *in_blkdico, int in_skipblock, struct s_blockinfo *out_blkinfo)
 {
-    u32 arblockcsumorig;
-    u32 arblockcsumcalc;
+    u64 arblockcsumorig;
+    u32 arblockcsum32;
+    u16 sumalgo;
     u32 curblocksize; // data size
     u64 blockoffset; // offset of the block in the file
     u16 compalgo; // compression algo used
     u16 cryptalgo; // encryption algo used
     u32 finalsize; // compressed  block size
     u32 compsize;
+    u16 hashsize;
     u8 *buffer;
     
     assert(ai);
-    assert(out_sumok);
     assert(in_blkdico);
     assert(out_blkinfo);
     
     // init
     memset(out_blkinfo, 0, sizeof(struct s_blockinfo));
-    *out_sumok=-1;
     
     if (dico_get_u64(in_blkdico, 0, BLOCKHEADITEMKEY_BLOCKOFFSET, &blockoffset)!=0)
     {   msgprintf(3, "cannot get blockoffset from block-header\n");
@@ -485,30 +757,64 @@ int archreader_read_block(carchreader *ai, cdico *in_blkdico, int in_skipblock,
         return -1;
     }
     
-    if (dico_get_u32(in_blkdico, 0, BLOCKHEADITEMKEY_ARCSUM, &arblockcsumorig)!=0)
-    {   msgprintf(3, "cannot get BLOCKHEADITEMKEY_ARCSUM from block-header\n");
+    // blocks without BLOCKHEADITEMKEY_ARCSUMALGO have a fletcher32 checksum
+    if (dico_get_u16(in_blkdico, 0, BLOCKHEADITEMKEY_ARCSUMALGO, &sumalgo)!=0)
+    {   sumalgo=CHECKSUM_FLETCHER32;
+        if (dico_get_u32(in_blkdico, 0, BLOCKHEADITEMKEY_ARCSUM, &arblockcsum32)!=0)
+        {   msgprintf(3, "cannot get BLOCKHEADITEMKEY_ARCSUM from block-header\n");
+            return -1;
+        }
+        arblockcsumorig=arblockcsum32;
+    }
+    else if (checksum_supported(sumalgo)==false || dico_get_u64(in_blkdico, 0, BLOCKHEADITEMKEY_ARCSUM64, &arblockcsumorig)!=0)
+    {   msgprintf(3, "cannot get BLOCKHEADITEMKEY_ARCSUM64 from block-header (checksum algorithm %d)\n", (int)sumalgo);
         return -1;
     }
     
     if (in_skipblock==true) // the main thread does not need that block (block belongs to a filesys we want to skip)
     {
-        if (lseek64(ai->archfd, (long)finalsize, SEEK_CUR)<0)
-        {   sysprintf("cannot skip block (finalsize=%ld) failed\n", (long)finalsize);
+        if (archreader_seek(ai, archreader_get_pos(ai)+finalsize)!=0)
+        {   errprintf("cannot skip block (finalsize=%ld) failed\n", (long)finalsize);
             return -1;
         }
         return 0;
     }
     
-    // ---- allocate memory
-    if ((buffer=malloc(finalsize))==NULL)
-    {   errprintf("cannot allocate block: malloc(%d) failed\n", finalsize);
-        return FSAERR_ENOMEM;
+    // blocks of the archives created with --block-hashes have the hash of their contents
+    if ((dico_get_data(in_blkdico, 0, BLOCKHEADITEMKEY_BLKHASH, out_blkinfo->blkhash, FSA_BLKHASH_SIZE, &hashsize)==0) && (hashsize==FSA_BLKHASH_SIZE))
+        out_blkinfo->blkhashed=true;
+    
+    // the checksum is verified by the decompression threads: if the block is corrupt the next header
+    // may not be where the block ends, so it will be searched from the beginning of the block
+    ai->lastblkpos=archreader_get_pos(ai);
+    
+    // the block is a slice of the read buffer: the data are not copied
+    buffer=NULL;
+    if (finalsize <= ARCHREADER_BUFSIZE/2)
+    {
+        if (archreader_fill(ai, finalsize)!=0)
+        {   sysprintf("cannot read block (finalsize=%ld) failed\n", (long)finalsize);
+            return -1;
+        }
+        // after a resync the block may be in the data of the previous one which is still being processed
+        if ((buffer=bufpool_slice(ai->buf, ai->bufoff, finalsize, ai->sliceend))!=NULL)
+        {   ai->bufoff+=finalsize;
+            ai->sliceend=ai->bufoff;
+        }
     }
     
-    if (read(ai->archfd, buffer, (long)finalsize)!=(long)finalsize)
-    {   sysprintf("cannot read block (finalsize=%ld) failed\n", (long)finalsize);
-        free(buffer);
-        return -1;
+    // copy the block when there is no room for the header of the slice before it, or it is too big
+    if (buffer==NULL)
+    {
+        if ((buffer=bufpool_alloc(finalsize))==NULL)
+        {   errprintf("cannot allocate block: bufpool_alloc(%d) failed\n", finalsize);
+            return FSAERR_ENOMEM;
+        }
+        if (archreader_read_data(ai, buffer, finalsize)!=0)
+        {   msgprintf(MSG_STACK, "cannot read block (finalsize=%ld) failed\n", (long)finalsize);
+            bufpool_free(buffer);
+            return -1;
+        }
     }
     
     // prepare blkinfo
@@ -516,32 +822,11 @@ int archreader_read_block(carchreader *ai, cdico *in_blkdico, int in_skipblock,
     out_blkinfo->blkrealsize=curblocksize;
     out_blkinfo->blkoffset=blockoffset;
     out_blkinfo->blkarcsum=arblockcsumorig;
+    out_blkinfo->blksumalgo=sumalgo;
     out_blkinfo->blkcompalgo=compalgo;
     out_blkinfo->blkcryptalgo=cryptalgo;
     out_blkinfo->blkarsize=finalsize;
     out_blkinfo->blkcompsize=compsize;
     
-    // ---- checksum
-    arblockcsumcalc=fletcher32(buffer, finalsize);
-    if (arblockcsumcalc!=arblockcsumorig) // bad checksum
-    {
-        errprintf("block is corrupt at offset=%ld, blksize=%ld\n", (long)blockoffset, (long)curblocksize);
-        free(out_blkinfo->blkdata);
-        if ((out_blkinfo->blkdata=malloc(curblocksize))==NULL)
-        {   errprintf("cannot allocate block: malloc(%d) failed\n", curblocksize);
-            return FSAERR_ENOMEM;
-        }
-        memset(out_blkinfo->blkdata, 0, curblocksize);
-        *out_sumok=false;
-        // go to the beginning of the corrupted contents so that the next header is searched here
-        if (lseek64(ai->archfd, -(long long)finalsize, SEEK_CUR)<0)
-        {   errprintf("lseek64() failed\n");
-        }
-    }
-    else // no corruption detected
-    {
-        *out_sumok=true;
-    }
-    
     return 0;
 }
@@ -24,11 +24,21 @@ struct s_blockinfo;
 struct s_headinfo;
 struct s_dico;
 
+#define ARCHREADER_BUFSIZE    (1LL*1024LL*1024LL) // read-ahead buffer: biggest buffer of the pool so that it is recycled
+#define ARCHREADER_KEEP       64 // bytes before the current position kept when the buffer is refilled
+#define ARCHREADER_TAILSIZE   4096 // the footer of the last volume is searched in the last bytes of the volume
+
 struct s_archreader;
 typedef struct s_archreader carchreader;
 
 struct s_archreader
 {   int    archfd; // file descriptor of the current volume (set to -1 when closed)
+    char   *buf; // read-ahead buffer (from the buffer pool: the data blocks are slices of it)
+    u64    bufsize; // number of bytes of the volume which are in buf
+    u64    bufoff; // position in buf of the next byte to read
+    s64    bufpos; // offset in the volume of the first byte of buf
+    s64    lastblkpos; // offset of the data of the block which has just been read (-1 if the last item was a header)
+    u64    sliceend; // end in buf of the last block which is a slice of it (the next slices must not overwrite it)
     u32    archid; // 32bit archive id for checking (random number generated at creation)
     u64    fscount; // how many filesystems in archive (valid only if archtype=filesystems)
     u32    archtype; // what has been saved in the archive: filesystems or directories
@@ -40,6 +50,8 @@ struct s_archreader
     u64    creattime; // archive create time (number of seconds since epoch)
     u64    minfsaver; // minimum fsarchiver version required to restore that archive
     u32    hasdirsinfohead; // true if the archive has a "DiRs" header (introduced in 0.6.7)
+    u32    hasblkhashes; // true if the files are verified with the hashes of the blocks (--block-hashes)
+    u16    sumalgo; // checksum of the headers (CHECKSUM_FLETCHER32 until the main header has been read)
     int    filefmtver; // set to 1 for "FsArCh_001" or 2 for "FsArCh_002"
     char   filefmt[FSA_MAX_FILEFMTLEN]; // file format of that archive
     char   creatver[FSA_MAX_PROGVERLEN]; // fsa version used to create archive
@@ -54,10 +66,14 @@ int archreader_open(carchreader *ai);
 int archreader_close(carchreader *ai);
 int archreader_incvolume(carchreader *ai, bool waitkeypress);
 int archreader_volpath(carchreader *ai);
+s64 archreader_get_pos(carchreader *ai);
+int archreader_seek(carchreader *ai, s64 pos);
+int archreader_goto(carchreader *ai, u32 vol, s64 pos);
+s64 archreader_find_volfooter(carchreader *ai);
 int archreader_read_data(carchreader *ai, void *data, u64 size);
-int archreader_read_dico(carchreader *ai, struct s_dico *d);
+int archreader_read_dico(carchreader *ai, struct s_dico *d, int sumalgo);
 int archreader_read_volheader(carchreader *ai);
 int archreader_read_header(carchreader *ai, char *magic, struct s_dico **d, bool allowseek, u16 *fsid);
-int archreader_read_block(carchreader *ai, struct s_dico *in_blkdico, int in_skipblock, int *out_sumok, struct s_blockinfo *out_blkinfo);
+int archreader_read_block(carchreader *ai, struct s_dico *in_blkdico, int in_skipblock, struct s_blockinfo *out_blkinfo);
 
 #endif // __ARCHREADER_H__
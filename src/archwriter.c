@@ -25,7 +25,9 @@
 #include <fcntl.h>
 #include <sys/statvfs.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <assert.h>
+#include <errno.h>
 
 #include "fsarchiver.h"
 #include "dico.h"
@@ -37,12 +39,18 @@
 #include "comp_gzip.h"
 #include "comp_bzip2.h"
 #include "error.h"
+#include "pipestats.h"
+#include "bufpool.h"
+#include "uring.h"
+#include "archindex.h"
 
 #define FSA_SMB_SUPER_MAGIC 0x517B
 #define FSA_CIFS_MAGIC_NUMBER 0xFF534D42
 
 int archwriter_init(carchwriter *ai)
 {
+    int i;
+    
     assert(ai);
     memset(ai, 0, sizeof(struct s_archwriter));
     strlist_init(&ai->vollist);
@@ -50,13 +58,46 @@ int archwriter_init(carchwriter *ai)
     ai->archfd=-1;
     ai->archid=0;
     ai->curvol=0;
+    ai->curpos=0;
+    ai->subpos=0;
+    ai->curreq=0;
+    ai->inflight=0;
+    ai->sumalgo=CHECKSUM_FLETCHER32;
+    ai->index=NULL;
+    ai->indexpos=-1;
+    if ((g_options.archindex==true) && ((ai->index=archindex_alloc())==NULL))
+    {   errprintf("archindex_alloc() failed\n");
+        return -1;
+    }
+    for (i=0; i < ARCHWRITER_MAXREQS; i++)
+    {
+        if ((ai->reqs[i].hdrbuf=writebuf_alloc())==NULL)
+        {   errprintf("writebuf_alloc() failed\n");
+            return -1;
+        }
+    }
+    // when io_uring is not available the requests are written with pwritev()
+    if (uring_init(&ai->uring, ARCHWRITER_MAXREQS)!=0)
+        msgprintf(MSG_DEBUG1, "io_uring is not available: the archive is written synchronously\n");
     return 0;
 }
 
 int archwriter_destroy(carchwriter *ai)
 {
+    int i;
+    
     assert(ai);
     strlist_destroy(&ai->vollist);
+    for (i=0; i < ARCHWRITER_MAXREQS; i++)
+    {
+        if (ai->reqs[i].hdrbuf!=NULL)
+        {   writebuf_destroy(ai->reqs[i].hdrbuf);
+            ai->reqs[i].hdrbuf=NULL;
+        }
+    }
+    uring_destroy(&ai->uring);
+    archindex_destroy(ai->index);
+    ai->index=NULL;
     return 0;
 }
 
@@ -117,6 +158,8 @@ int archwriter_create(carchwriter *ai)
         return -1;
     }
     ai->newarch=true;
+    ai->curpos=0;
+    ai->subpos=0;
     
     strlist_add(&ai->vollist, ai->volpath);
     
@@ -132,17 +175,25 @@ int archwriter_create(carchwriter *ai)
 
 int archwriter_close(carchwriter *ai)
 {
+    int res=0;
+    
     assert(ai);
     
     if (ai->archfd<0)
         return -1;
     
+    // the writes which are still in flight must complete before the volume is closed
+    if (archwriter_flush(ai)!=0 || archwriter_wait_all(ai)!=0)
+    {   msgprintf(MSG_STACK, "cannot complete the writes of volume %s\n", ai->volpath);
+        res=-1;
+    }
+    
     //res=lockf(ai->archfd, F_ULOCK, 0);
     fsync(ai->archfd); // just in case the user reboots after it exits
     close(ai->archfd);
     ai->archfd=-1;
     
-    return 0;
+    return res;
 }
 
 int archwriter_remove(carchwriter *ai)
@@ -175,30 +226,30 @@ int archwriter_remove(carchwriter *ai)
     return 0;
 }
 
+// the position is tracked in memory: it includes the data which has been queued with the headers
 s64 archwriter_get_currentpos(carchwriter *ai)
 {
     assert(ai);
-    return (s64)lseek64(ai->archfd, 0, SEEK_CUR);
+    return ai->curpos;
 }
 
-int archwriter_write_buffer(carchwriter *ai, struct s_writebuf *wb)
+// check the result of a write and release the buffers of the blocks which it has written
+static int archwriter_complete(carchwriter *ai, carchwriterreq *req, s64 lres)
 {
     struct statvfs64 statvfsbuf;
     char textbuf[128];
-    long lres;
-    
-    assert(ai);
-    assert(wb);
+    int i;
     
-    if (wb->size <=0)
-    {   errprintf("wb->size=%ld\n", (long)wb->size);
-        return -1;
-    }
+    for (i=0; i < req->segcount; i++)
+        if (req->segs[i].release==true)
+            bufpool_free(req->segs[i].data);
+    req->segcount=0;
+    req->inflight=false;
     
-    if ((lres=write(ai->archfd, (char*)wb->data, (long)wb->size))!=(long)wb->size)
+    if (lres!=(s64)req->size)
     {
-        errprintf("write(size=%ld) returned %ld\n", (long)wb->size, (long)lres);
-        if ((lres>0) && (lres < (long)wb->size)) // probably "no space left"
+        errprintf("write(size=%ld) returned %ld\n", (long)req->size, (long)lres);
+        if ((lres>0) && (lres < (s64)req->size)) // probably "no space left"
         {
             if (fstatvfs64(ai->archfd, &statvfsbuf)!=0)
             {   sysprintf("fstatvfs(fd=%d) failed\n", ai->archfd);
@@ -214,7 +265,8 @@ int archwriter_write_buffer(carchwriter *ai, struct s_writebuf *wb)
         }
         else // another error
         {
-            sysprintf("write(size=%ld) failed\n", (long)wb->size);
+            errno=(lres<0)?-lres:EIO;
+            sysprintf("write(size=%ld) failed\n", (long)req->size);
             return -1;
         }
     }
@@ -222,6 +274,209 @@ int archwriter_write_buffer(carchwriter *ai, struct s_writebuf *wb)
     return 0;
 }
 
+// wait for the completion of one of the writes which have been submitted to io_uring
+static int archwriter_wait_one(carchwriter *ai)
+{
+    u64 userdata;
+    u64 start;
+    s64 lres;
+    
+    start=pipestats_start();
+    if (uring_wait(&ai->uring, &userdata, &lres)!=0 || userdata>=ARCHWRITER_MAXREQS)
+    {   ai->inflight=0; // the buffers of the requests are not released as the kernel may still use them
+        msgprintf(MSG_STACK, "uring_wait() failed\n");
+        return -1;
+    }
+    pipestats_add(PIPESTATS_WRITE, start, max(lres, 0));
+    ai->inflight--;
+    
+    return archwriter_complete(ai, &ai->reqs[userdata], lres);
+}
+
+// wait until all the writes which have been submitted are completed
+int archwriter_wait_all(carchwriter *ai)
+{
+    int ret=0;
+    
+    assert(ai);
+    
+    while (ai->inflight>0)
+        if (archwriter_wait_one(ai)!=0)
+            ret=-1;
+    
+    return ret;
+}
+
+// write the current request: it is submitted to io_uring and the next request can be filled
+// while it is written, or it is written with pwritev() when io_uring is not available
+int archwriter_flush(carchwriter *ai)
+{
+    carchwriterreq *req;
+    carchwriterseg *seg;
+    u64 offset;
+    u64 start;
+    s64 lres;
+    int i;
+    
+    assert(ai);
+    
+    req=&ai->reqs[ai->curreq];
+    if (req->segcount==0)
+        return 0;
+    
+    // the ranges of hdrbuf are resolved now as hdrbuf may have been reallocated since they were added
+    for (i=0, req->size=0; i < req->segcount; i++)
+    {
+        seg=&req->segs[i];
+        req->iov[i].iov_base=(seg->data!=NULL)?seg->data:(req->hdrbuf->data+seg->offset);
+        req->iov[i].iov_len=seg->size;
+        req->size+=seg->size;
+    }
+    
+    // the position is tracked in memory so the requests can be written in any order
+    offset=ai->subpos;
+    ai->subpos+=req->size;
+    
+    if (uring_enabled(&ai->uring))
+    {
+        if (uring_writev(&ai->uring, ai->archfd, req->iov, req->segcount, offset, ai->curreq)!=0)
+        {   msgprintf(MSG_STACK, "uring_writev() failed\n");
+            return archwriter_complete(ai, req, -EIO);
+        }
+        req->inflight=true;
+        ai->inflight++;
+        
+        // the next request must have completed before it can receive new items
+        ai->curreq=(ai->curreq+1) % ARCHWRITER_MAXREQS;
+        while (ai->reqs[ai->curreq].inflight==true)
+            if (archwriter_wait_one(ai)!=0)
+                return -1;
+        return 0;
+    }
+    else
+    {
+        start=pipestats_start();
+        lres=pwritev(ai->archfd, req->iov, req->segcount, offset);
+        pipestats_add(PIPESTATS_WRITE, start, max(lres, 0));
+        return archwriter_complete(ai, req, (lres<0)?-errno:lres);
+    }
+}
+
+// add a buffer to the current request
+static void archwriter_add_seg(carchwriter *ai, char *data, u64 offset, u64 size, bool release)
+{
+    carchwriterreq *req;
+    carchwriterseg *last;
+    
+    // consecutive headers are written from a single range of hdrbuf
+    req=&ai->reqs[ai->curreq];
+    last=(req->segcount>0)?&req->segs[req->segcount-1]:NULL;
+    if ((data==NULL) && (last!=NULL) && (last->data==NULL) && (last->offset+last->size==offset))
+    {
+        last->size+=size;
+    }
+    else
+    {
+        req->segs[req->segcount].data=data;
+        req->segs[req->segcount].offset=offset;
+        req->segs[req->segcount].size=size;
+        req->segs[req->segcount].release=release;
+        req->segcount++;
+    }
+    ai->curpos+=size;
+}
+
+// prepare the current request to receive an item which requires up to segcount buffers
+static int archwriter_prepare_item(carchwriter *ai, int segcount)
+{
+    carchwriterreq *req;
+    
+    if ((ai->reqs[ai->curreq].segcount+segcount > ARCHWRITER_MAXSEGS) && (archwriter_flush(ai)!=0))
+    {   msgprintf(MSG_STACK, "archwriter_flush() failed\n");
+        return -1;
+    }
+    
+    // nothing refers to the headers which have been serialized before
+    req=&ai->reqs[ai->curreq];
+    if (req->segcount==0)
+        writebuf_reset(req->hdrbuf);
+    
+    return 0;
+}
+
+// the item which has just been serialized at the end of hdrbuf is added to the current request
+// data is the buffer of a block which is released by the archwriter once it has been written
+static int archwriter_add_item(carchwriter *ai, u64 offset, char *data, u64 datasize)
+{
+    carchwriterreq *req;
+    char *header;
+    u64 size;
+    int res;
+    
+    req=&ai->reqs[ai->curreq];
+    size=req->hdrbuf->size-offset;
+    
+    if (archwriter_split_check(ai, size+datasize)==true)
+    {
+        // the header is moved to the request which receives the first items of the next volume
+        if ((header=malloc(size))==NULL)
+        {   errprintf("malloc(%ld) failed: out of memory\n", (long)size);
+            return -1;
+        }
+        memcpy(header, req->hdrbuf->data+offset, size);
+        req->hdrbuf->size=offset;
+        
+        if ((res=archwriter_newvolume(ai))==0 && (res=archwriter_prepare_item(ai, 2))==0)
+        {
+            req=&ai->reqs[ai->curreq];
+            offset=req->hdrbuf->size;
+            res=writebuf_add_data(req->hdrbuf, header, size);
+        }
+        free(header);
+        if (res!=0)
+        {   msgprintf(MSG_STACK, "cannot create a new volume\n");
+            return -1;
+        }
+    }
+    
+    ai->itemvol=ai->curvol;
+    ai->itempos=ai->curpos;
+    archwriter_add_seg(ai, NULL, offset, size, false);
+    if (data!=NULL)
+        archwriter_add_seg(ai, data, 0, datasize, true);
+    return 0;
+}
+
+// the buffer is copied in the current request, this is used for the small volume headers
+int archwriter_write_buffer(carchwriter *ai, struct s_writebuf *wb)
+{
+    carchwriterreq *req;
+    u64 offset;
+    
+    assert(ai);
+    assert(wb);
+    
+    if (wb->size <=0)
+    {   errprintf("wb->size=%ld\n", (long)wb->size);
+        return -1;
+    }
+    
+    if (archwriter_prepare_item(ai, 1)!=0)
+    {   msgprintf(MSG_STACK, "archwriter_prepare_item() failed\n");
+        return -1;
+    }
+    
+    req=&ai->reqs[ai->curreq];
+    offset=req->hdrbuf->size;
+    if (writebuf_add_data(req->hdrbuf, wb->data, wb->size)!=0)
+    {   msgprintf(MSG_STACK, "writebuf_add_data() failed\n");
+        return -1;
+    }
+    archwriter_add_seg(ai, NULL, offset, wb->size, false);
+    
+    return archwriter_flush(ai);
+}
+
 int archwriter_volpath(carchwriter *ai)
 {
     int res;
@@ -267,7 +522,7 @@ int archwriter_write_volheader(carchwriter *ai)
     dico_add_string(voldico, 0, VOLUMEHEADKEY_PROGVERCREAT, FSA_VERSION);
     
     // write header to buffer
-    if (writebuf_add_header(wb, voldico, FSA_MAGIC_VOLH, ai->archid, FSA_FILESYSID_NULL)!=0)
+    if (writebuf_add_header(wb, voldico, FSA_MAGIC_VOLH, ai->archid, FSA_FILESYSID_NULL, ai->sumalgo)!=0)
     {   errprintf("archio_write_header() failed\n");
         return -1;
     }
@@ -305,9 +560,13 @@ int archwriter_write_volfooter(carchwriter *ai, bool lastvol)
     dico_add_u32(voldico, 0, VOLUMEFOOTKEY_VOLNUM, ai->curvol);
     dico_add_u32(voldico, 0, VOLUMEFOOTKEY_ARCHID, ai->archid);
     dico_add_u32(voldico, 0, VOLUMEFOOTKEY_LASTVOL, lastvol);
+    if ((lastvol==true) && (ai->indexpos>=0))
+    {   dico_add_u32(voldico, 0, VOLUMEFOOTKEY_INDEXVOL, ai->indexvol);
+        dico_add_u64(voldico, 0, VOLUMEFOOTKEY_INDEXOFFSET, ai->indexpos);
+    }
     
     // write header to buffer
-    if (writebuf_add_header(wb, voldico, FSA_MAGIC_VOLF, ai->archid, FSA_FILESYSID_NULL)!=0)
+    if (writebuf_add_header(wb, voldico, FSA_MAGIC_VOLF, ai->archid, FSA_FILESYSID_NULL, ai->sumalgo)!=0)
     {   msgprintf(MSG_STACK, "archio_write_header() failed\n");
         return -1;
     }
@@ -324,107 +583,141 @@ int archwriter_write_volfooter(carchwriter *ai, bool lastvol)
     return 0;
 }
 
-int archwriter_split_check(carchwriter *ai, struct s_writebuf *wb)
+int archwriter_split_check(carchwriter *ai, u64 size)
 {
     s64 cursize;
     
     assert(ai);
 
-    if (((cursize=archwriter_get_currentpos(ai))>=0) && (g_options.splitsize>0 && cursize+wb->size > g_options.splitsize))
+    if (((cursize=archwriter_get_currentpos(ai))>=0) && (g_options.splitsize>0 && cursize+size > g_options.splitsize))
     {
-        msgprintf(MSG_DEBUG4, "splitchk: YES --> cursize=%lld, g_options.splitsize=%lld, cursize+wb->size=%lld, wb->size=%lld\n",
-            (long long)cursize, (long long)g_options.splitsize, (long long)cursize+wb->size, (long long)wb->size);
+        msgprintf(MSG_DEBUG4, "splitchk: YES --> cursize=%lld, g_options.splitsize=%lld, cursize+size=%lld, size=%lld\n",
+            (long long)cursize, (long long)g_options.splitsize, (long long)cursize+size, (long long)size);
         return true;
     }
     else
     {
-        msgprintf(MSG_DEBUG4, "splitchk: NO --> cursize=%lld, g_options.splitsize=%lld, cursize+wb->size=%lld, wb->size=%lld\n",
-            (long long)cursize, (long long)g_options.splitsize, (long long)cursize+wb->size, (long long)wb->size);
+        msgprintf(MSG_DEBUG4, "splitchk: NO --> cursize=%lld, g_options.splitsize=%lld, cursize+size=%lld, size=%lld\n",
+            (long long)cursize, (long long)g_options.splitsize, (long long)cursize+size, (long long)size);
         return false;
     }
 }
 
-int archwriter_split_if_necessary(carchwriter *ai, struct s_writebuf *wb)
+// close the current volume and start the next one
+int archwriter_newvolume(carchwriter *ai)
 {
     assert(ai);
-
-    if (archwriter_split_check(ai, wb)==true)
-    {
-        if (archwriter_write_volfooter(ai, false)!=0)
-        {   msgprintf(MSG_STACK, "cannot write volume footer: archio_write_volfooter() failed\n");
-            return -1;
-        }
-        archwriter_close(ai);
-        archwriter_incvolume(ai, false);
-        msgprintf(MSG_VERB2, "Creating new volume: [%s]\n", ai->volpath);
-        if (archwriter_create(ai)!=0)
-        {   msgprintf(MSG_STACK, "archwriter_create() failed\n");
-            return -1;
-        }
-        if (archwriter_write_volheader(ai)!=0)
-        {   msgprintf(MSG_STACK, "cannot write volume header: archio_write_volheader() failed\n");
-            return -1;
-        }
+    
+    if (archwriter_write_volfooter(ai, false)!=0)
+    {   msgprintf(MSG_STACK, "cannot write volume footer: archio_write_volfooter() failed\n");
+        return -1;
+    }
+    if (archwriter_close(ai)!=0)
+    {   msgprintf(MSG_STACK, "archwriter_close() failed\n");
+        return -1;
+    }
+    archwriter_incvolume(ai, false);
+    msgprintf(MSG_VERB2, "Creating new volume: [%s]\n", ai->volpath);
+    if (archwriter_create(ai)!=0)
+    {   msgprintf(MSG_STACK, "archwriter_create() failed\n");
+        return -1;
+    }
+    if (archwriter_write_volheader(ai)!=0)
+    {   msgprintf(MSG_STACK, "cannot write volume header: archio_write_volheader() failed\n");
+        return -1;
     }
     return 0;
 }
 
+// serialize a header in the current request
+static int archwriter_write_dico(carchwriter *ai, cdico *d, char *magic, u16 fsid)
+{
+    u64 offset;
+    
+    if (archwriter_prepare_item(ai, 1)!=0)
+    {   msgprintf(MSG_STACK, "archwriter_prepare_item() failed\n");
+        return -1;
+    }
+    
+    offset=ai->reqs[ai->curreq].hdrbuf->size;
+    if (writebuf_add_header(ai->reqs[ai->curreq].hdrbuf, d, magic, ai->archid, fsid, ai->sumalgo)!=0)
+    {   msgprintf(MSG_STACK, "writebuf_add_header() failed\n");
+        return -1;
+    }
+    
+    return archwriter_add_item(ai, offset, NULL, 0);
+}
+
+// the header is serialized in the current request and the data is written from blkinfo->blkdata,
+// which belongs to the archwriter from now on: it is released when the write has completed
 int archwriter_dowrite_block(carchwriter *ai, struct s_blockinfo *blkinfo)
 {
-    struct s_writebuf *wb=NULL;
+    u64 offset;
     
     assert(ai);
-
-    if ((wb=writebuf_alloc())==NULL)
-    {   errprintf("writebuf_alloc() failed\n");
+    
+    if (archwriter_prepare_item(ai, 2)!=0)
+    {   msgprintf(MSG_STACK, "archwriter_prepare_item() failed\n");
         return -1;
     }
     
-    if (writebuf_add_block(wb, blkinfo, ai->archid, blkinfo->blkfsid)!=0)
-    {   msgprintf(MSG_STACK, "archio_write_block() failed\n");
+    offset=ai->reqs[ai->curreq].hdrbuf->size;
+    if (writebuf_add_blockhead(ai->reqs[ai->curreq].hdrbuf, blkinfo, ai->archid, blkinfo->blkfsid, ai->sumalgo)!=0)
+    {   msgprintf(MSG_STACK, "writebuf_add_blockhead() failed\n");
         return -1;
     }
     
-    if (archwriter_split_if_necessary(ai, wb)!=0)
-    {   msgprintf(MSG_STACK, "archwriter_split_if_necessary() failed\n");
+    if (archwriter_add_item(ai, offset, blkinfo->blkdata, blkinfo->blkarsize)!=0)
         return -1;
-    }
     
-    if (archwriter_write_buffer(ai, wb)!=0)
-    {   msgprintf(MSG_STACK, "archwriter_write_buffer() failed\n");
+    if ((ai->index!=NULL) && (archindex_add_block(ai->index, ai->itemvol, ai->itempos)!=0))
+    {   msgprintf(MSG_STACK, "archindex_add_block() failed\n");
         return -1;
     }
-
-    writebuf_destroy(wb);
+    
     return 0;
 }
 
 int archwriter_dowrite_header(carchwriter *ai, struct s_headinfo *headinfo)
 {
-    struct s_writebuf *wb=NULL;
-    
     assert(ai);
-
-    if ((wb=writebuf_alloc())==NULL)
-    {   errprintf("writebuf_alloc() failed\n");
-        return -1;
-    }
     
-    if (writebuf_add_header(wb, headinfo->dico, headinfo->magic, ai->archid, headinfo->fsid)!=0)
-    {   msgprintf(MSG_STACK, "archio_write_block() failed\n");
+    if (archwriter_write_dico(ai, headinfo->dico, headinfo->magic, headinfo->fsid)!=0)
         return -1;
-    }
     
-    if (archwriter_split_if_necessary(ai, wb)!=0)
-    {   msgprintf(MSG_STACK, "archwriter_split_if_necessary() failed\n");
+    if ((ai->index!=NULL) && (archindex_add_header(ai->index, headinfo->magic, headinfo->dico, headinfo->fsid, ai->itemvol, ai->itempos)!=0))
+    {   msgprintf(MSG_STACK, "archindex_add_header() failed\n");
         return -1;
     }
     
-    if (archwriter_write_buffer(ai, wb)!=0)
-    {   msgprintf(MSG_STACK, "archwriter_write_buffer() failed\n");
-        return -1;
+    return 0;
+}
+
+// the index is written after the contents of the archive, the last volume footer says where it starts
+int archwriter_write_index(carchwriter *ai)
+{
+    u64 cursor=0;
+    cdico *d;
+    int res;
+    
+    assert(ai);
+    
+    if (ai->index==NULL)
+        return 0;
+    
+    while ((res=archindex_get_dico(ai->index, &cursor, &d))==0)
+    {
+        res=archwriter_write_dico(ai, d, FSA_MAGIC_INDX, FSA_FILESYSID_NULL);
+        dico_destroy(d);
+        if (res!=0)
+        {   msgprintf(MSG_STACK, "cannot write the index\n");
+            return -1;
+        }
+        if (ai->indexpos<0)
+        {   ai->indexvol=ai->itemvol;
+            ai->indexpos=ai->itempos;
+        }
     }
     
-    writebuf_destroy(wb);
-    return 0;
+    return (res==1)?0:-1;
 }
@@ -19,20 +19,62 @@
 #define __ARCHWRITER_H__
 
 #include <limits.h>
+#include <sys/uio.h>
 #include "strlist.h"
+#include "uring.h"
 
 struct s_writebuf;
 struct s_blockinfo;
 struct s_headinfo;
 struct s_strlist;
+struct s_archindex;
+
+#define ARCHWRITER_MAXSEGS    64 // maximum number of buffers written with a single writev()
+#define ARCHWRITER_MAXREQS    4 // maximum number of writes in flight when io_uring is used
+#define ARCHWRITER_MAXITEMS   32 // maximum number of queue items dequeued together by the writer thread
+#define ARCHWRITER_MAXBATCH   (4LL*1024LL*1024LL) // the writer thread stops dequeuing items when they use that memory
+
+struct s_archwriterseg;
+typedef struct s_archwriterseg carchwriterseg;
+
+struct s_archwriterreq;
+typedef struct s_archwriterreq carchwriterreq;
 
 struct s_archwriter;
 typedef struct s_archwriter carchwriter;
 
+struct s_archwriterseg
+{   char   *data; // data written from its own buffer (block data), or NULL when it is a range of hdrbuf
+    u64    offset; // offset of the range in hdrbuf when data is NULL
+    u64    size; // number of bytes to write
+    bool   release; // true when data is a block buffer which is released when the write has completed
+};
+
+struct s_archwriterreq
+{   struct s_writebuf *hdrbuf; // scratch area where the headers of this write are serialized
+    carchwriterseg segs[ARCHWRITER_MAXSEGS]; // buffers written by this request
+    struct iovec iov[ARCHWRITER_MAXSEGS]; // the buffers as they are given to the kernel (valid until completion)
+    int    segcount; // number of buffers used in segs
+    u64    size; // number of bytes written by the request
+    bool   inflight; // true when the write has been submitted to io_uring and is not yet completed
+};
+
 struct s_archwriter
 {   int    archfd; // file descriptor of the current volume (set to -1 when closed)
+    s64    curpos; // size of the current volume including the data which has not yet been written
+    u64    subpos; // offset in the current volume where the next request will be written
+    carchwriterreq reqs[ARCHWRITER_MAXREQS]; // requests being filled, or written in the background
+    int    curreq; // index of the request which receives the next items
+    int    inflight; // number of requests which have been submitted to io_uring and are not completed
+    curing uring; // keeps several writes in flight when io_uring is available
+    u32    itemvol; // volume and offset where the last header or block has been written
+    s64    itempos;
+    struct s_archindex *index; // table of contents written at the end of the archive (NULL without --index)
+    u32    indexvol; // volume and offset of the first header of the index once it has been written
+    s64    indexpos;
     u32    archid; // 32bit archive id for checking (random number generated at creation)
     u32    curvol; // current volume number, starts at 0, incremented when we change the volume
+    u16    sumalgo; // checksum of the headers (except the volume and main headers which always use fletcher32)
     bool   newarch; // true when the archive has been created by then current process
     char   filefmt[FSA_MAX_FILEFMTLEN]; // file format of that archive
     char   creatver[FSA_MAX_PROGVERLEN]; // fsa version used to create archive
@@ -55,9 +97,12 @@ int archwriter_incvolume(carchwriter *ai, bool waitkeypress);
 int archwriter_volpath(carchwriter *ai);
 int archwriter_write_volheader(carchwriter *ai);
 int archwriter_write_volfooter(carchwriter *ai, bool lastvol);
-int archwriter_split_check(carchwriter *ai, struct s_writebuf *wb);
-int archwriter_split_if_necessary(carchwriter *ai, struct s_writebuf *wb);
+int archwriter_flush(carchwriter *ai);
+int archwriter_wait_all(carchwriter *ai);
+int archwriter_split_check(carchwriter *ai, u64 size);
+int archwriter_newvolume(carchwriter *ai);
 int archwriter_dowrite_block(carchwriter *ai, struct s_blockinfo *blkinfo);
 int archwriter_dowrite_header(carchwriter *ai, struct s_headinfo *headinfo);
+int archwriter_write_index(carchwriter *ai);
 
 #endif // __ARCHWRITER_H__
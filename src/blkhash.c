@@ -0,0 +1,240 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <gcrypt.h>
+
+#include "fsarchiver.h"
+#include "blkhash.h"
+#include "common.h"
+#include "dico.h"
+#include "queue.h"
+#include "pipestats.h"
+#include "error.h"
+
+// with --block-hashes each block header has the sha256 of the contents of the block, and the
+// footer of the file has the sha256 of the list of these hashes (instead of the md5 of the file)
+// so the expensive part is done by the compression threads in parallel. The hashes of the blocks
+// are added to the list in the order of the blocks even if the threads complete them in any order
+
+struct s_blkhashslot
+{   u8                   hash[FSA_BLKHASH_SIZE];
+    bool                 ready; // set when the compression thread has computed the hash
+};
+
+struct s_blkhashlist
+{   pthread_mutex_t      mutex;
+    gcry_md_hd_t         ctx; // sha256 of the hashes of the blocks [0, first)
+    struct s_blkhashslot *slot; // hashes of the blocks [first, count) which are not in ctx yet
+    u64                  slotalloc;
+    u64                  first; // index of the next block to add to ctx
+    u64                  count; // number of blocks of the file
+    int                  refs; // owner of the list + blocks which have not been hashed
+    struct s_queue       *q; // footer waiting for the hash of the hashes (set by blkhashlist_add_header)
+    s64                  itemnum;
+    struct s_dico        *dico;
+    u8                   section;
+    u16                  key;
+};
+
+int blkhash_compute(u8 *hash, char *data, u64 len)
+{
+    u64 start;
+    
+    start=pipestats_start();
+    gcry_md_hash_buffer(GCRY_MD_SHA256, hash, data, len);
+    pipestats_add(PIPESTATS_BLKHASH, start, len);
+    
+    return 0;
+}
+
+cblkhashlist *blkhashlist_alloc()
+{
+    cblkhashlist *hl;
+    
+    if ((hl=calloc(1, sizeof(cblkhashlist)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)sizeof(cblkhashlist));
+        return NULL;
+    }
+    
+    if (gcry_md_open(&hl->ctx, GCRY_MD_SHA256, 0) != GPG_ERR_NO_ERROR)
+    {   errprintf("gcry_md_open() failed\n");
+        free(hl);
+        return NULL;
+    }
+    
+    assert(pthread_mutex_init(&hl->mutex, NULL)==0);
+    hl->refs=1;
+    
+    return hl;
+}
+
+static void blkhashlist_destroy(cblkhashlist *hl)
+{
+    gcry_md_close(hl->ctx);
+    pthread_mutex_destroy(&hl->mutex);
+    free(hl->slot);
+    free(hl);
+}
+
+// drop a reference: the last one writes the hash of the hashes in the footer and releases the list
+static void blkhashlist_unref(cblkhashlist *hl)
+{
+    bool last;
+    
+    assert(pthread_mutex_lock(&hl->mutex)==0);
+    last=(--hl->refs==0);
+    assert(pthread_mutex_unlock(&hl->mutex)==0);
+    
+    if (last==false)
+        return;
+    
+    if (hl->q!=NULL)
+    {   assert(hl->first==hl->count);
+        dico_add_data(hl->dico, hl->section, hl->key, gcry_md_read(hl->ctx, GCRY_MD_SHA256), FSA_BLKHASH_SIZE);
+        queue_set_header_ready(hl->q, hl->itemnum);
+    }
+    blkhashlist_destroy(hl);
+}
+
+// reserve the next position in the list for a block which will be hashed by a compression thread
+int blkhashlist_add_block(cblkhashlist *hl, struct s_blockinfo *blkinfo)
+{
+    struct s_blkhashslot *newslot;
+    u64 newalloc;
+    
+    assert(hl);
+    
+    assert(pthread_mutex_lock(&hl->mutex)==0);
+    if (hl->count-hl->first >= hl->slotalloc)
+    {   newalloc=max(hl->slotalloc*2, 64);
+        if ((newslot=realloc(hl->slot, newalloc*sizeof(struct s_blkhashslot)))==NULL)
+        {   errprintf("realloc(%ld) failed: out of memory\n", (long)(newalloc*sizeof(struct s_blkhashslot)));
+            assert(pthread_mutex_unlock(&hl->mutex)==0);
+            return -1;
+        }
+        hl->slot=newslot;
+        hl->slotalloc=newalloc;
+    }
+    hl->slot[hl->count-hl->first].ready=false;
+    blkinfo->blkhashlist=hl;
+    blkinfo->blkhashidx=hl->count++;
+    hl->refs++;
+    assert(pthread_mutex_unlock(&hl->mutex)==0);
+    
+    return 0;
+}
+
+// called by the compression threads once blkinfo->blkhash has been computed
+int blkhashlist_set_block(struct s_blockinfo *blkinfo)
+{
+    cblkhashlist *hl;
+    u64 done;
+    
+    assert(blkinfo && blkinfo->blkhashlist);
+    hl=blkinfo->blkhashlist;
+    blkinfo->blkhashlist=NULL;
+    
+    assert(pthread_mutex_lock(&hl->mutex)==0);
+    memcpy(hl->slot[blkinfo->blkhashidx-hl->first].hash, blkinfo->blkhash, FSA_BLKHASH_SIZE);
+    hl->slot[blkinfo->blkhashidx-hl->first].ready=true;
+    
+    // add the hashes which are now contiguous and keep the others for later
+    for (done=0; (hl->first+done < hl->count) && (hl->slot[done].ready==true); done++)
+        gcry_md_write(hl->ctx, hl->slot[done].hash, FSA_BLKHASH_SIZE);
+    if (done>0)
+    {   memmove(hl->slot, hl->slot+done, (hl->count-hl->first-done)*sizeof(struct s_blkhashslot));
+        hl->first+=done;
+    }
+    assert(pthread_mutex_unlock(&hl->mutex)==0);
+    
+    blkhashlist_unref(hl);
+    return 0;
+}
+
+// add the footer of the file to the queue: the hash of the hashes is written in the data item section/key
+// once all the blocks have been hashed, then the list is released so hl must not be used after this call
+s64 blkhashlist_add_header(cblkhashlist *hl, cqueue *q, cdico *d, char *magic, u16 fsid, u8 section, u16 key)
+{
+    s64 itemnum;
+    
+    assert(hl);
+    
+    if ((itemnum=queue_add_header_pending(q, d, magic, fsid))<=0)
+    {   blkhashlist_unref(hl);
+        return itemnum;
+    }
+    
+    assert(pthread_mutex_lock(&hl->mutex)==0);
+    hl->q=q;
+    hl->itemnum=itemnum;
+    hl->dico=d;
+    hl->section=section;
+    hl->key=key;
+    assert(pthread_mutex_unlock(&hl->mutex)==0);
+    
+    blkhashlist_unref(hl);
+    return FSAERR_SUCCESS;
+}
+
+// release the list without writing a footer (the blocks which are still in the queue keep it alive)
+void blkhashlist_release(cblkhashlist *hl)
+{
+    assert(hl);
+    blkhashlist_unref(hl);
+}
+
+// restore: the blocks are received in order so their hashes are added directly
+int blkhashlist_append(cblkhashlist *hl, u8 *hash)
+{
+    assert(hl && (hl->first==hl->count));
+    
+    gcry_md_write(hl->ctx, hash, FSA_BLKHASH_SIZE);
+    hl->first++;
+    hl->count++;
+    
+    return 0;
+}
+
+// copy the hash of the hashes and release the list (no block must be pending)
+int blkhashlist_final(cblkhashlist *hl, u8 *hash, int hashsize)
+{
+    int ret=0;
+    
+    assert(hl && (hl->first==hl->count) && (hl->refs==1));
+    
+    if (hash!=NULL)
+    {
+        if (hashsize < FSA_BLKHASH_SIZE)
+        {   errprintf("Buffer too small for the hash of the blocks\n");
+            ret=-1;
+        }
+        else
+        {   memcpy(hash, gcry_md_read(hl->ctx, GCRY_MD_SHA256), FSA_BLKHASH_SIZE);
+        }
+    }
+    
+    blkhashlist_destroy(hl);
+    return ret;
+}
@@ -0,0 +1,38 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+
+#ifndef __BLKHASH_H__
+#define __BLKHASH_H__
+
+struct s_dico;
+struct s_queue;
+struct s_blockinfo;
+
+struct s_blkhashlist;
+typedef struct s_blkhashlist cblkhashlist;
+
+int          blkhash_compute(u8 *hash, char *data, u64 len);
+cblkhashlist *blkhashlist_alloc();
+int          blkhashlist_add_block(cblkhashlist *hl, struct s_blockinfo *blkinfo);
+int          blkhashlist_set_block(struct s_blockinfo *blkinfo);
+s64          blkhashlist_add_header(cblkhashlist *hl, struct s_queue *q, struct s_dico *d, char *magic, u16 fsid, u8 section, u16 key);
+void         blkhashlist_release(cblkhashlist *hl);
+int          blkhashlist_append(cblkhashlist *hl, u8 *hash);
+int          blkhashlist_final(cblkhashlist *hl, u8 *hash, int hashsize);
+
+#endif // __BLKHASH_H__
@@ -0,0 +1,343 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "fsarchiver.h"
+#include "bufpool.h"
+#include "common.h"
+#include "error.h"
+
+#define BUFPOOL_MAGIC      0x4C4F4F50 // "POOL"
+#define BUFPOOL_NOCLASS    -1 // buffer allocated with malloc() (too big for the pool)
+#define BUFPOOL_SLICE      -2 // part of another buffer (see bufpool_slice)
+
+// header stored before each buffer: 64 bytes so that the data is aligned on a cache line
+struct s_bufhead;
+typedef struct s_bufhead cbufhead;
+
+struct s_bufhead
+{   u32              magic;
+    s32              bufclass; // size class of the buffer or BUFPOOL_NOCLASS
+    u64              bufsize; // how many bytes can be stored in the buffer
+    cbufhead         *next; // next free buffer of the same free list, or the parent buffer of a slice
+    u32              refcount; // the buffer goes back to the pool when the last reference is released
+    u8               padding[36];
+};
+
+struct s_bufshard
+{   pthread_mutex_t  mutex;
+    cbufhead         *first; // free buffers
+};
+
+struct s_bufslab;
+typedef struct s_bufslab cbufslab;
+
+struct s_bufslab
+{   void             *addr; // memory returned by mmap()
+    u64              size;
+    cbufslab         *next;
+};
+
+struct s_bufpool
+{   struct s_bufshard shard[BUFPOOL_CLASSES][BUFPOOL_SHARDS];
+    pthread_mutex_t  slabmutex; // protects the list of slabs
+    cbufslab         *slabs; // all the memory allocated by the pool (released by bufpool_destroy)
+    u64              slabbytes;
+    bool             hugepages; // try to use huge pages for the slabs
+    bool             ready;
+};
+
+typedef struct s_bufpool cbufpool;
+
+cbufpool g_bufpool={.ready=false};
+
+// size of the buffers of a class: 4K, 5K, 6K, 7K, 8K, 10K, 12K, 14K, 16K, ... 1M
+static u64 bufpool_class_size(int bufclass)
+{
+    int shift=BUFPOOL_MINSHIFT+bufclass/BUFPOOL_STEPS;
+    return (1LL<<shift)+(bufclass%BUFPOOL_STEPS)*(1LL<<(shift-2));
+}
+
+// smallest class which can store size bytes or BUFPOOL_NOCLASS if the buffer is too big
+static int bufpool_size_class(u64 size)
+{
+    u64 step;
+    int shift;
+    
+    if (size <= (1LL<<BUFPOOL_MINSHIFT))
+        return 0;
+    if (size > (1LL<<BUFPOOL_MAXSHIFT))
+        return BUFPOOL_NOCLASS;
+    for (shift=BUFPOOL_MINSHIFT; (1LL<<(shift+1)) < size; shift++);
+    step=(size-(1LL<<shift)+(1LL<<(shift-2))-1) >> (shift-2);
+    return (shift-BUFPOOL_MINSHIFT)*BUFPOOL_STEPS+step;
+}
+
+// each thread uses its own free list first
+static int bufpool_thread_shard()
+{
+    return (int)((((u64)pthread_self())*0x9E3779B97F4A7C15ULL) >> 60) % BUFPOOL_SHARDS;
+}
+
+int bufpool_init(bool hugepages)
+{
+    cbufpool *p=&g_bufpool;
+    int i, j;
+    
+    memset(p, 0, sizeof(cbufpool));
+    for (i=0; i < BUFPOOL_CLASSES; i++)
+        for (j=0; j < BUFPOOL_SHARDS; j++)
+            assert(pthread_mutex_init(&p->shard[i][j].mutex, NULL)==0);
+    assert(pthread_mutex_init(&p->slabmutex, NULL)==0);
+    p->hugepages=hugepages;
+    p->ready=true;
+    
+    return 0;
+}
+
+// release all the memory: the buffers must not be used any more
+int bufpool_destroy()
+{
+    cbufpool *p=&g_bufpool;
+    cbufslab *slab;
+    char sizetext[64];
+    int i, j;
+    
+    if (p->ready==false)
+        return 0;
+    
+    msgprintf(MSG_DEBUG1, "block buffer pool: %s allocated in slabs\n", format_size(p->slabbytes, sizetext, sizeof(sizetext), 'h'));
+    while ((slab=p->slabs)!=NULL)
+    {   p->slabs=slab->next;
+        munmap(slab->addr, slab->size);
+        free(slab);
+    }
+    
+    for (i=0; i < BUFPOOL_CLASSES; i++)
+        for (j=0; j < BUFPOOL_SHARDS; j++)
+            assert(pthread_mutex_destroy(&p->shard[i][j].mutex)==0);
+    assert(pthread_mutex_destroy(&p->slabmutex)==0);
+    p->ready=false;
+    
+    return 0;
+}
+
+// map the memory of a slab: try explicit huge pages first, then transparent huge pages
+static void *bufpool_map_slab(cbufpool *p, u64 size)
+{
+    void *addr;
+    
+#ifdef MAP_HUGETLB
+    if (p->hugepages && (addr=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0))!=MAP_FAILED)
+        return addr;
+#endif // MAP_HUGETLB
+    
+    if ((addr=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0))==MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (p->hugepages)
+        madvise(addr, size, MADV_HUGEPAGE);
+#endif // MADV_HUGEPAGE
+    return addr;
+}
+
+// allocate a new slab for a size class: the first buffer is returned and the others go to a free list
+static cbufhead *bufpool_grow(cbufpool *p, int bufclass, struct s_bufshard *shard)
+{
+    cbufhead *first=NULL;
+    cbufhead *last=NULL;
+    cbufhead *head;
+    cbufslab *slab;
+    u64 slotsize;
+    u64 count;
+    u64 i;
+    
+    slotsize=sizeof(cbufhead)+bufpool_class_size(bufclass);
+    if ((slab=malloc(sizeof(cbufslab)))==NULL)
+        return NULL;
+    // at least four buffers per slab, the size is rounded so that huge pages can be used
+    slab->size=((max(4*slotsize, BUFPOOL_SLABSIZE)+BUFPOOL_SLABSIZE-1)/BUFPOOL_SLABSIZE)*BUFPOOL_SLABSIZE;
+    if ((slab->addr=bufpool_map_slab(p, slab->size))==NULL)
+    {   sysprintf("mmap(%lld) failed: cannot allocate memory for the block buffers\n", (long long)slab->size);
+        free(slab);
+        return NULL;
+    }
+    
+    count=slab->size/slotsize;
+    for (i=0; i < count; i++)
+    {   head=(cbufhead*)(((u8*)slab->addr)+i*slotsize);
+        head->magic=BUFPOOL_MAGIC;
+        head->bufclass=bufclass;
+        head->bufsize=bufpool_class_size(bufclass);
+        head->next=first;
+        first=head;
+        if (last==NULL)
+            last=head;
+    }
+    
+    assert(pthread_mutex_lock(&p->slabmutex)==0);
+    slab->next=p->slabs;
+    p->slabs=slab;
+    p->slabbytes+=slab->size;
+    assert(pthread_mutex_unlock(&p->slabmutex)==0);
+    
+    // the first buffer is returned, the other ones are added to the free list
+    if (first->next!=NULL)
+    {   assert(pthread_mutex_lock(&shard->mutex)==0);
+        last->next=shard->first;
+        shard->first=first->next;
+        assert(pthread_mutex_unlock(&shard->mutex)==0);
+    }
+    
+    return first;
+}
+
+// buffer which can store at least size bytes: it must be released with bufpool_free()
+void *bufpool_alloc(u64 size)
+{
+    struct s_bufshard *shard;
+    cbufpool *p=&g_bufpool;
+    cbufhead *head=NULL;
+    int bufclass;
+    int first;
+    int i;
+    
+    bufclass=(p->ready)?bufpool_size_class(size):BUFPOOL_NOCLASS;
+    if (bufclass==BUFPOOL_NOCLASS)
+    {   if ((head=malloc(sizeof(cbufhead)+size))==NULL)
+            return NULL;
+        head->magic=BUFPOOL_MAGIC;
+        head->bufclass=BUFPOOL_NOCLASS;
+        head->bufsize=size;
+        head->refcount=1;
+        return head+1;
+    }
+    
+    // try the free list of the current thread, then the other ones
+    first=bufpool_thread_shard();
+    for (i=0; (i < BUFPOOL_SHARDS) && (head==NULL); i++)
+    {   shard=&p->shard[bufclass][(first+i)%BUFPOOL_SHARDS];
+        assert(pthread_mutex_lock(&shard->mutex)==0);
+        if ((head=shard->first)!=NULL)
+            shard->first=head->next;
+        assert(pthread_mutex_unlock(&shard->mutex)==0);
+    }
+    
+    if ((head==NULL) && ((head=bufpool_grow(p, bufclass, &p->shard[bufclass][first]))==NULL))
+        return NULL;
+    
+    head->next=NULL;
+    head->refcount=1;
+    return head+1;
+}
+
+// the header of a slice is in the middle of another buffer so it may not be aligned: it is copied
+// and the references of a slice are counted on its parent, which is the buffer which holds the data
+static cbufhead *bufpool_get_head(void *buf)
+{
+    cbufhead *head;
+    cbufhead copy;
+    
+    head=((cbufhead*)buf)-1;
+    memcpy(&copy, head, sizeof(copy));
+    assert(copy.magic==BUFPOOL_MAGIC);
+    return (copy.bufclass==BUFPOOL_SLICE)?copy.next:head;
+}
+
+// hand out size bytes at offset of buf as a buffer which is released with bufpool_free(): the data is
+// not copied, the header of the slice overwrites the sizeof(cbufhead) bytes of buf which precede it
+// returns NULL when the header would be stored before minoffset, because these bytes may belong to
+// another slice, or before the beginning of buf (the caller has to copy the data)
+void *bufpool_slice(void *buf, u64 offset, u64 size, u64 minoffset)
+{
+    cbufhead *parent;
+    cbufhead slice;
+    
+    if ((offset < sizeof(cbufhead)) || (offset-sizeof(cbufhead) < minoffset))
+        return NULL;
+    
+    parent=bufpool_get_head(buf);
+    memset(&slice, 0, sizeof(slice));
+    slice.magic=BUFPOOL_MAGIC;
+    slice.bufclass=BUFPOOL_SLICE;
+    slice.bufsize=size;
+    slice.next=parent;
+    memcpy(((u8*)buf)+offset-sizeof(cbufhead), &slice, sizeof(slice));
+    (void)__sync_add_and_fetch(&parent->refcount, 1);
+    
+    return ((u8*)buf)+offset;
+}
+
+// number of references on the buffer which holds the data (slices included)
+u32 bufpool_refcount(void *buf)
+{
+    return __atomic_load_n(&bufpool_get_head(buf)->refcount, __ATOMIC_ACQUIRE);
+}
+
+// another thread keeps using the buffer: each reference is released with bufpool_free()
+void bufpool_ref(void *buf)
+{
+    cbufhead *head;
+    
+    head=bufpool_get_head(buf);
+    (void)__sync_add_and_fetch(&head->refcount, 1);
+}
+
+void bufpool_free(void *buf)
+{
+    struct s_bufshard *shard;
+    cbufpool *p=&g_bufpool;
+    cbufhead *head;
+    
+    if (buf==NULL)
+        return;
+    
+    head=bufpool_get_head(buf);
+    if (__sync_sub_and_fetch(&head->refcount, 1)>0)
+        return;
+    if (head->bufclass==BUFPOOL_NOCLASS)
+    {   free(head);
+        return;
+    }
+    
+    shard=&p->shard[head->bufclass][bufpool_thread_shard()];
+    assert(pthread_mutex_lock(&shard->mutex)==0);
+    head->next=shard->first;
+    shard->first=head;
+    assert(pthread_mutex_unlock(&shard->mutex)==0);
+}
+
+// how many bytes the buffer can store (memory really used by a block)
+u64 bufpool_bufsize(void *buf)
+{
+    cbufhead head;
+    
+    if (buf==NULL)
+        return 0;
+    memcpy(&head, ((cbufhead*)buf)-1, sizeof(head));
+    return head.bufsize;
+}
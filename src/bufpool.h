@@ -0,0 +1,38 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+// the pool provides the buffers of the data blocks: blocks of similar sizes share the same size class
+#define BUFPOOL_MINSHIFT   12 // smallest buffer: 4K
+#define BUFPOOL_MAXSHIFT   20 // biggest buffer: 1M (FSA_MAX_BLKSIZE plus the compression overhead)
+#define BUFPOOL_STEPS      4 // size classes between two powers of two (at most 25% of a buffer is wasted)
+#define BUFPOOL_CLASSES    ((BUFPOOL_MAXSHIFT-BUFPOOL_MINSHIFT)*BUFPOOL_STEPS+1)
+#define BUFPOOL_SHARDS     16 // free lists per size class: threads use different free lists to avoid contention
+#define BUFPOOL_SLABSIZE   (2LL*1024LL*1024LL) // buffers are carved from slabs which are a multiple of this size
+
+int   bufpool_init(bool hugepages);
+int   bufpool_destroy();
+void *bufpool_alloc(u64 size);
+void *bufpool_slice(void *buf, u64 offset, u64 size, u64 minoffset);
+u32   bufpool_refcount(void *buf);
+void  bufpool_ref(void *buf);
+void  bufpool_free(void *buf);
+u64   bufpool_bufsize(void *buf);
+
+#endif // __BUFPOOL_H__
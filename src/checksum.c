@@ -0,0 +1,415 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
+#if defined(__aarch64__)
+#  include <arm_acle.h>
+#  include <sys/auxv.h>
+#  include <asm/hwcap.h>
+#endif
+#ifdef OPTION_XXHASH_SUPPORT
+#  include <xxhash.h>
+#endif
+
+#include "fsarchiver.h"
+#include "checksum.h"
+
+// The checksum of the archive blocks and headers is computed by fletcher32_generic(). Its
+// sums are folded every 360 bytes and once more at the end: the folding keeps them congruent
+// modulo 65535 and the final values are always in [1,65535]. So the result only depends on
+// the exact sums modulo 65535 (0 is written 65535), and the vector versions can compute them
+// in any order and reduce them much less often while producing the same checksums.
+
+u32 fletcher32_generic(u8 *data, u32 len)
+{
+    u32 sum1 = 0xffff, sum2 = 0xffff;
+    
+    while (len)
+    {
+        unsigned tlen = len > 360 ? 360 : len;
+        len -= tlen;
+        do {
+            sum1 += *data++;
+            sum2 += sum1;
+        } while (--tlen);
+        sum1 = (sum1 & 0xffff) + (sum1 >> 16);
+        sum2 = (sum2 & 0xffff) + (sum2 >> 16);
+    }
+    // Second reduction step to reduce sums to 16 bits
+    sum1 = (sum1 & 0xffff) + (sum1 >> 16);
+    sum2 = (sum2 & 0xffff) + (sum2 >> 16);
+    return sum2 << 16 | sum1;
+}
+
+// add the bytes which are not part of a whole vector and build the checksum from the sums modulo 65535
+static u32 fletcher32_finish(u8 *data, u32 len, u64 sum1, u64 sum2)
+{
+    while (len--)
+    {   sum1 += *data++;
+        sum2 += sum1;
+    }
+    sum1 %= 65535;
+    sum2 %= 65535;
+    return ((sum2==0)?65535:sum2) << 16 | ((sum1==0)?65535:sum1);
+}
+
+#if defined(__SSE2__)
+// for each span: sum2 += n*sum1 + sum((n-i)*data[i]) and sum1 += sum(data[i]) where the
+// weights are 16*(number of vectors after the current one) + (16 - position in the vector)
+static u32 fletcher32_sse2(u8 *data, u32 len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weightlo = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+    const __m128i weighthi = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+    __m128i vsum, vprev, vcollo, vcolhi, v;
+    u32 tmp[4];
+    u64 sum1 = 0, sum2 = 0;
+    u64 bytes, prev, cols;
+    u32 blocks, n;
+    
+    while (len >= 16)
+    {
+        blocks = min(len, FLETCHER_SPAN) / 16;
+        n = blocks * 16;
+        vsum = vprev = vcollo = vcolhi = zero;
+        for (; blocks > 0; blocks--, data += 16)
+        {   v = _mm_loadu_si128((__m128i *)data);
+            vprev = _mm_add_epi32(vprev, vsum);
+            vsum = _mm_add_epi32(vsum, _mm_sad_epu8(v, zero));
+            vcollo = _mm_add_epi16(vcollo, _mm_unpacklo_epi8(v, zero));
+            vcolhi = _mm_add_epi16(vcolhi, _mm_unpackhi_epi8(v, zero));
+        }
+        _mm_storeu_si128((__m128i *)tmp, vsum);
+        bytes = (u64)tmp[0] + tmp[2];
+        _mm_storeu_si128((__m128i *)tmp, vprev);
+        prev = (u64)tmp[0] + tmp[2];
+        _mm_storeu_si128((__m128i *)tmp, _mm_add_epi32(_mm_madd_epi16(vcollo, weightlo), _mm_madd_epi16(vcolhi, weighthi)));
+        cols = (u64)tmp[0] + tmp[1] + tmp[2] + tmp[3];
+        sum2 = (sum2 + n * sum1 + 16 * prev + cols) % 65535;
+        sum1 = (sum1 + bytes) % 65535;
+        len -= n;
+    }
+    
+    return fletcher32_finish(data, len, sum1, sum2);
+}
+#endif // __SSE2__
+
+#if defined(__x86_64__) || defined(__i386__)
+// same as fletcher32_sse2() with 32 bytes per vector, only used when the cpu supports avx2:
+// two vectors are processed per iteration and the data are prefetched to keep up with the memory
+__attribute__((target("avx2")))
+static u32 fletcher32_avx2(u8 *data, u32 len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i weight = _mm256_set_epi8(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+        17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32);
+    __m256i vsum, vprev, vcols, vcols2, v, v2;
+    u32 tmp[8];
+    u64 sum1 = 0, sum2 = 0;
+    u64 bytes, prev, cols;
+    u32 blocks, n;
+    int i;
+    
+    while (len >= 32)
+    {
+        blocks = min(len, FLETCHER_SPAN) / 32;
+        n = blocks * 32;
+        vsum = vprev = vcols = vcols2 = zero;
+        for (; blocks >= 2; blocks-=2, data += 64)
+        {   v = _mm256_loadu_si256((__m256i *)data);
+            v2 = _mm256_loadu_si256((__m256i *)(data+32));
+            _mm_prefetch((char*)data+1024, _MM_HINT_T0);
+            vprev = _mm256_add_epi32(vprev, _mm256_add_epi32(vsum, vsum)); // vsum is added before each vector
+            vprev = _mm256_add_epi32(vprev, _mm256_sad_epu8(v, zero));
+            vsum = _mm256_add_epi32(vsum, _mm256_add_epi32(_mm256_sad_epu8(v, zero), _mm256_sad_epu8(v2, zero)));
+            vcols = _mm256_add_epi32(vcols, _mm256_madd_epi16(_mm256_maddubs_epi16(v, weight), ones));
+            vcols2 = _mm256_add_epi32(vcols2, _mm256_madd_epi16(_mm256_maddubs_epi16(v2, weight), ones));
+        }
+        for (; blocks > 0; blocks--, data += 32)
+        {   v = _mm256_loadu_si256((__m256i *)data);
+            vprev = _mm256_add_epi32(vprev, vsum);
+            vsum = _mm256_add_epi32(vsum, _mm256_sad_epu8(v, zero));
+            vcols = _mm256_add_epi32(vcols, _mm256_madd_epi16(_mm256_maddubs_epi16(v, weight), ones));
+        }
+        vcols = _mm256_add_epi32(vcols, vcols2);
+        bytes = prev = cols = 0;
+        _mm256_storeu_si256((__m256i *)tmp, vsum);
+        for (i=0; i < 8; i+=2)
+            bytes += tmp[i];
+        _mm256_storeu_si256((__m256i *)tmp, vprev);
+        for (i=0; i < 8; i+=2)
+            prev += tmp[i];
+        _mm256_storeu_si256((__m256i *)tmp, vcols);
+        for (i=0; i < 8; i++)
+            cols += tmp[i];
+        sum2 = (sum2 + n * sum1 + 32 * prev + cols) % 65535;
+        sum1 = (sum1 + bytes) % 65535;
+        len -= n;
+    }
+    
+    return fletcher32_finish(data, len, sum1, sum2);
+}
+#endif // __x86_64__ || __i386__
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+static u32 fletcher32_neon(u8 *data, u32 len)
+{
+    static const u16 weightlo[8] = {16, 15, 14, 13, 12, 11, 10, 9};
+    static const u16 weighthi[8] = {8, 7, 6, 5, 4, 3, 2, 1};
+    uint32x4_t vsum, vprev, vcols;
+    uint16x8_t vcollo, vcolhi;
+    uint8x16_t v;
+    u64 sum1 = 0, sum2 = 0;
+    u64 bytes, prev, cols;
+    u32 blocks, n;
+    
+    while (len >= 16)
+    {
+        blocks = min(len, FLETCHER_SPAN) / 16;
+        n = blocks * 16;
+        vsum = vprev = vdupq_n_u32(0);
+        vcollo = vcolhi = vdupq_n_u16(0);
+        for (; blocks > 0; blocks--, data += 16)
+        {   v = vld1q_u8(data);
+            vprev = vaddq_u32(vprev, vsum);
+            vsum = vpadalq_u16(vsum, vpaddlq_u8(v));
+            vcollo = vaddw_u8(vcollo, vget_low_u8(v));
+            vcolhi = vaddw_u8(vcolhi, vget_high_u8(v));
+        }
+        vcols = vmull_u16(vget_low_u16(vcollo), vget_low_u16(vld1q_u16(weightlo)));
+        vcols = vmlal_u16(vcols, vget_high_u16(vcollo), vget_high_u16(vld1q_u16(weightlo)));
+        vcols = vmlal_u16(vcols, vget_low_u16(vcolhi), vget_low_u16(vld1q_u16(weighthi)));
+        vcols = vmlal_u16(vcols, vget_high_u16(vcolhi), vget_high_u16(vld1q_u16(weighthi)));
+        bytes = vaddlvq_u32(vsum);
+        prev = vaddlvq_u32(vprev);
+        cols = vaddlvq_u32(vcols);
+        sum2 = (sum2 + n * sum1 + 16 * prev + cols) % 65535;
+        sum1 = (sum1 + bytes) % 65535;
+        len -= n;
+    }
+    
+    return fletcher32_finish(data, len, sum1, sum2);
+}
+#endif // __aarch64__ && __ARM_NEON
+
+// checksum of the blocks and headers of the archives: uses the fastest implementation for the cpu
+u32 fletcher32(u8 *data, u32 len)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return fletcher32_avx2(data, len);
+#endif
+#if defined(__SSE2__)
+    return fletcher32_sse2(data, len);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    return fletcher32_neon(data, len);
+#else
+    return fletcher32_generic(data, len);
+#endif
+}
+
+// crc32c tables for the cpus which don't have a crc32c instruction (slicing by 8 bytes)
+static u32 g_crc32ctable[8][256];
+// g_crc32cshift advances a crc over CRC32C_STRIPE zero bytes to combine interleaved streams
+static u32 g_crc32cshift[4][256];
+static pthread_once_t g_crc32conce=PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table()
+{
+    u32 bits[32];
+    u32 crc;
+    int i, j;
+    
+    for (i=0; i < 256; i++)
+    {   crc=i;
+        for (j=0; j < 8; j++)
+            crc=(crc & 1)?((crc >> 1) ^ 0x82f63b78):(crc >> 1); // reflected castagnoli polynomial
+        g_crc32ctable[0][i]=crc;
+    }
+    for (i=0; i < 256; i++)
+        for (j=1; j < 8; j++)
+            g_crc32ctable[j][i]=(g_crc32ctable[j-1][i] >> 8) ^ g_crc32ctable[0][g_crc32ctable[j-1][i] & 0xff];
+    
+    // the crc update is linear: shift each bit once and combine the bits of every byte value
+    for (i=0; i < 32; i++)
+    {   crc=(u32)1 << i;
+        for (j=0; j < CRC32C_STRIPE; j++)
+            crc=(crc >> 8) ^ g_crc32ctable[0][crc & 0xff];
+        bits[i]=crc;
+    }
+    for (i=0; i < 256; i++)
+        for (j=0; j < 32; j++)
+            if (i & (1 << (j%8)))
+                g_crc32cshift[j/8][i]^=bits[j];
+}
+
+static inline u32 crc32c_shift(u32 crc)
+{
+    return g_crc32cshift[0][crc & 0xff] ^ g_crc32cshift[1][(crc >> 8) & 0xff] ^
+        g_crc32cshift[2][(crc >> 16) & 0xff] ^ g_crc32cshift[3][crc >> 24];
+}
+
+static u32 crc32c_generic(u32 crc, u8 *data, u32 len)
+{
+    u32 lo, hi;
+    
+    pthread_once(&g_crc32conce, crc32c_init_table);
+    for (; len >= 8; len-=8, data+=8)
+    {   lo=crc ^ ((u32)data[0] | ((u32)data[1] << 8) | ((u32)data[2] << 16) | ((u32)data[3] << 24));
+        hi=((u32)data[4] | ((u32)data[5] << 8) | ((u32)data[6] << 16) | ((u32)data[7] << 24));
+        crc=g_crc32ctable[7][lo & 0xff] ^ g_crc32ctable[6][(lo >> 8) & 0xff] ^
+            g_crc32ctable[5][(lo >> 16) & 0xff] ^ g_crc32ctable[4][lo >> 24] ^
+            g_crc32ctable[3][hi & 0xff] ^ g_crc32ctable[2][(hi >> 8) & 0xff] ^
+            g_crc32ctable[1][(hi >> 16) & 0xff] ^ g_crc32ctable[0][hi >> 24];
+    }
+    while (len--)
+        crc=(crc >> 8) ^ g_crc32ctable[0][(crc ^ *data++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+// crc32 instruction of sse4.2 (it uses the castagnoli polynomial)
+// the instruction has a latency of three cycles, so large buffers are processed as
+// three independent streams and the partial crcs are merged with crc32c_shift()
+__attribute__((target("sse4.2")))
+static u32 crc32c_sse42(u32 crc, u8 *data, u32 len)
+{
+    u64 crc0, crc1, crc2;
+    u64 value0, value1, value2;
+    u64 crc64;
+    u64 value;
+    u32 i;
+    
+    if (len >= 3*CRC32C_STRIPE)
+        pthread_once(&g_crc32conce, crc32c_init_table);
+    for (; len >= 3*CRC32C_STRIPE; len-=3*CRC32C_STRIPE, data+=3*CRC32C_STRIPE)
+    {   crc0=crc;
+        crc1=0;
+        crc2=0;
+        for (i=0; i < CRC32C_STRIPE; i+=8)
+        {   memcpy(&value0, data+i, sizeof(value0));
+            memcpy(&value1, data+CRC32C_STRIPE+i, sizeof(value1));
+            memcpy(&value2, data+2*CRC32C_STRIPE+i, sizeof(value2));
+            crc0=_mm_crc32_u64(crc0, value0);
+            crc1=_mm_crc32_u64(crc1, value1);
+            crc2=_mm_crc32_u64(crc2, value2);
+        }
+        crc=crc32c_shift(crc32c_shift((u32)crc0) ^ (u32)crc1) ^ (u32)crc2;
+    }
+    
+    crc64=crc;
+    for (; len >= 8; len-=8, data+=8)
+    {   memcpy(&value, data, sizeof(value));
+        crc64=_mm_crc32_u64(crc64, value);
+    }
+    crc=(u32)crc64;
+    while (len--)
+        crc=_mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif // __x86_64__
+
+#if defined(__aarch64__)
+// crc32c instructions of armv8 (optional in armv8.0)
+__attribute__((target("+crc")))
+static u32 crc32c_armv8(u32 crc, u8 *data, u32 len)
+{
+    u64 value;
+    
+    for (; len >= 8; len-=8, data+=8)
+    {   memcpy(&value, data, sizeof(value));
+        crc=__crc32cd(crc, value);
+    }
+    while (len--)
+        crc=__crc32cb(crc, *data++);
+    return crc;
+}
+#endif // __aarch64__
+
+u32 crc32c(u8 *data, u32 len)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        return ~crc32c_sse42(0xffffffff, data, len);
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        return ~crc32c_armv8(0xffffffff, data, len);
+#endif
+    return ~crc32c_generic(0xffffffff, data, len);
+}
+
+// checksum of a data block or of a header with one of the CHECKSUM_xxx algorithms
+u64 checksum_compute(int algo, u8 *data, u32 len)
+{
+    switch (algo)
+    {
+        case CHECKSUM_CRC32C:
+            return crc32c(data, len);
+#ifdef OPTION_XXHASH_SUPPORT
+        case CHECKSUM_XXH3:
+            return XXH3_64bits(data, len);
+#endif // OPTION_XXHASH_SUPPORT
+        default: // CHECKSUM_FLETCHER32
+            return fletcher32(data, len);
+    }
+}
+
+// how many bytes the checksum takes after a header
+int checksum_size(int algo)
+{
+    return (algo==CHECKSUM_XXH3)?8:4;
+}
+
+// the volume header and the main header are read before the checksum of the archive is known
+int checksum_header_algo(char *magic, int archalgo)
+{
+    if ((memcmp(magic, FSA_MAGIC_VOLH, FSA_SIZEOF_MAGIC)==0) || (memcmp(magic, FSA_MAGIC_MAIN, FSA_SIZEOF_MAGIC)==0))
+        return CHECKSUM_FLETCHER32;
+    return archalgo;
+}
+
+bool checksum_supported(int algo)
+{
+    switch (algo)
+    {
+        case CHECKSUM_FLETCHER32:
+        case CHECKSUM_CRC32C:
+            return true;
+#ifdef OPTION_XXHASH_SUPPORT
+        case CHECKSUM_XXH3:
+            return true;
+#endif // OPTION_XXHASH_SUPPORT
+        default:
+            return false;
+    }
+}
@@ -0,0 +1,37 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __CHECKSUM_H__
+#define __CHECKSUM_H__
+
+// the vector implementations of fletcher32 reduce their sums modulo 65535 once per span
+#define FLETCHER_SPAN  2048 // the 16bit column sums of a span cannot overflow (2048/16*255 < 32768)
+
+// crc32c processes large buffers as three interleaved streams of this size
+#define CRC32C_STRIPE  4096
+
+#define CHECKSUM_MAXSIZE  8 // size of the biggest checksum written after a header
+
+u32  fletcher32(u8 *data, u32 len);
+u32  fletcher32_generic(u8 *data, u32 len);
+u32  crc32c(u8 *data, u32 len);
+u64  checksum_compute(int algo, u8 *data, u32 len);
+int  checksum_size(int algo);
+int  checksum_header_algo(char *magic, int archalgo);
+bool checksum_supported(int algo);
+
+#endif // __CHECKSUM_H__
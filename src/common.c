@@ -33,6 +33,7 @@
 #include <wordexp.h>
 #include <fnmatch.h>
 #include <time.h>
+#include <limits.h>
 
 #include "fsarchiver.h"
 #include "syncthread.h"
@@ -96,6 +97,42 @@ char *format_size(u64 size, char *text, int max, char units)
     return text;
 }
 
+// convert a size such as "512M" into bytes (suffixes K, M, G and T are powers of 1024)
+int parse_size(char *text, u64 *size)
+{
+    unsigned long long value;
+    int shift=0;
+    char *end;
+    
+    if (!text || !size || text[0]<'0' || text[0]>'9')
+        return -1;
+    
+    errno=0;
+    value=strtoull(text, &end, 10);
+    if (errno!=0)
+        return -1;
+    
+    switch (*end)
+    {
+        case 't': case 'T': shift+=10; // fall through
+        case 'g': case 'G': shift+=10; // fall through
+        case 'm': case 'M': shift+=10; // fall through
+        case 'k': case 'K': shift+=10;
+            end++;
+            break;
+    }
+    
+    if (*end!=0)
+        return -1;
+    
+    // the size must still fit in 64 bits once multiplied by the suffix
+    if (value > (ULLONG_MAX >> shift))
+        return -1;
+    
+    *size=(u64)(value << shift);
+    return 0;
+}
+
 int mkdir_recursive(char *path)
 {
     char buffer[PATH_MAX];
@@ -203,6 +240,24 @@ int is_dir_empty(char *path)
     return 0;
 }
 
+// monotonic clock in microseconds (used to measure durations only)
+u64 get_time_usec(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec)*1000000LL + ((u64)ts.tv_nsec)/1000LL;
+}
+
+// cpu time used by the calling thread in microseconds (does not count the time it was not running)
+u64 get_thread_cputime_usec(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ((u64)ts.tv_sec)*1000000LL + ((u64)ts.tv_nsec)/1000LL;
+}
+
 // generate a non-null random u32
 u32 generate_random_u32_id(void)
 {
@@ -217,27 +272,6 @@ u32 generate_random_u32_id(void)
     return archid;
 }
 
-u32 fletcher32(u8 *data, u32 len)
-{
-    u32 sum1 = 0xffff, sum2 = 0xffff;
-    
-    while (len)
-    {
-        unsigned tlen = len > 360 ? 360 : len;
-        len -= tlen;
-        do {
-            sum1 += *data++;
-            sum2 += sum1;
-        } while (--tlen);
-        sum1 = (sum1 & 0xffff) + (sum1 >> 16);
-        sum2 = (sum2 & 0xffff) + (sum2 >> 16);
-    }
-    // Second reduction step to reduce sums to 16 bits
-    sum1 = (sum1 & 0xffff) + (sum1 >> 16);
-    sum2 = (sum2 & 0xffff) + (sum2 >> 16);
-    return sum2 << 16 | sum1;
-}
-
 int regfile_exists(char *filepath)
 {
     struct stat64 st;
@@ -585,6 +619,29 @@ int exclude_check(cstrlist *patlist, char *string)
     return false;
 }
 
+// returns true if the path, one of its parent directories or one of their names matches a pattern
+int pathlist_check(cstrlist *patlist, char *relpath)
+{
+    char dirpath[PATH_MAX];
+    char basename[PATH_MAX];
+    int pos;
+    
+    snprintf(dirpath, sizeof(dirpath), "%s", relpath);
+    for (pos=strlen(dirpath); pos>0; )
+    {
+        extract_basename(dirpath, basename, sizeof(basename));
+        if ((exclude_check(patlist, dirpath)==true) || ((basename[0]!=0) && (exclude_check(patlist, basename)==true)))
+            return true;
+        
+        // dirpath=parent_directory(dirpath)
+        while ((pos>0) && (dirpath[pos]!='/'))
+            dirpath[pos--]=0;
+        dirpath[pos]=0;
+    }
+    
+    return false;
+}
+
 int get_path_to_volume(char *newvolbuf, int bufsize, char *basepath, long curvol)
 {
     char prefix[PATH_MAX];
@@ -19,6 +19,9 @@
 #  include "config.h"
 #endif
 
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include <zlib.h>
 
 #include "fsarchiver.h"
@@ -26,43 +29,142 @@
 #include "comp_gzip.h"
 #include "error.h"
 
+// each thread keeps its zlib streams: a reset is much cheaper than an init for the small blocks
+struct s_gzipctx
+{   z_stream    def; // deflate stream used to compress
+    bool        definit; // true when def has been initialized
+    int         deflevel; // compression level used by def
+    z_stream    inf; // inflate stream used to decompress
+    bool        infinit; // true when inf has been initialized
+};
+
+typedef struct s_gzipctx cgzipctx;
+
+static pthread_key_t g_gzipkey;
+static pthread_once_t g_gziponce=PTHREAD_ONCE_INIT;
+
+// called when a thread which used gzip terminates
+static void gzip_free_context(void *data)
+{
+    cgzipctx *ctx=(cgzipctx *)data;
+    
+    if (ctx->definit)
+        deflateEnd(&ctx->def);
+    if (ctx->infinit)
+        inflateEnd(&ctx->inf);
+    free(ctx);
+}
+
+static void gzip_create_key()
+{
+    if (pthread_key_create(&g_gzipkey, gzip_free_context)!=0)
+        errprintf("pthread_key_create() failed\n");
+}
+
+static cgzipctx *gzip_get_context()
+{
+    cgzipctx *ctx;
+    
+    pthread_once(&g_gziponce, gzip_create_key);
+    if ((ctx=pthread_getspecific(g_gzipkey))!=NULL)
+        return ctx;
+    
+    if ((ctx=calloc(1, sizeof(cgzipctx)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)sizeof(cgzipctx));
+        return NULL;
+    }
+    if (pthread_setspecific(g_gzipkey, ctx)!=0)
+    {   errprintf("pthread_setspecific() failed\n");
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// same result as compress2() but the deflate state is only reset between blocks
 int compress_block_gzip(u64 origsize, u64 *compsize, u8 *origbuf, u8 *compbuf, u64 compbufsize, int level)
 {
-    uLong gzsize;
-    Bytef *gzbuffer;
+    cgzipctx *ctx;
+    int res;
+    
+    if ((ctx=gzip_get_context())==NULL)
+        return FSAERR_ENOMEM;
+    
+    if (ctx->definit && ctx->deflevel!=level)
+    {   deflateEnd(&ctx->def);
+        ctx->definit=false;
+    }
+    if (ctx->definit==false)
+    {   memset(&ctx->def, 0, sizeof(ctx->def));
+        switch (deflateInit(&ctx->def, level))
+        {
+            case Z_OK:
+                break;
+            case Z_MEM_ERROR:
+                return FSAERR_ENOMEM;
+            default:
+                return FSAERR_UNKNOWN;
+        }
+        ctx->definit=true;
+        ctx->deflevel=level;
+    }
+    else if (deflateReset(&ctx->def)!=Z_OK)
+    {   errprintf("deflateReset() failed\n");
+        return FSAERR_UNKNOWN;
+    }
     
-    gzsize=(uLong)compbufsize;
-    gzbuffer=(Bytef *)compbuf;
+    ctx->def.next_in=(Bytef *)origbuf;
+    ctx->def.avail_in=(uInt)origsize;
+    ctx->def.next_out=(Bytef *)compbuf;
+    ctx->def.avail_out=(uInt)compbufsize;
     
-    switch (compress2(gzbuffer, &gzsize, (const Bytef*)origbuf, (uLong)origsize, level))
+    switch ((res=deflate(&ctx->def, Z_FINISH)))
     {
-        case Z_OK:
-            *compsize=(u64)gzsize;
+        case Z_STREAM_END:
+            *compsize=(u64)ctx->def.total_out;
             return FSAERR_SUCCESS;
         case Z_MEM_ERROR:
             return FSAERR_ENOMEM;
-        default:
+        default: // Z_OK or Z_BUF_ERROR: the output buffer is too small
             return FSAERR_UNKNOWN;
     }
-    
-    return FSAERR_UNKNOWN;
 }
 
 int uncompress_block_gzip(u64 compsize, u64 *origsize, u8 *origbuf, u64 origbufsize, u8 *compbuf)
 {
-    uLong gzsize=(uLong)origbufsize;
-    Bytef *gzbuffer=(Bytef *)origbuf;
+    cgzipctx *ctx;
     int res;
     
-    switch ((res=uncompress(gzbuffer, &gzsize, (const Bytef*)compbuf, (uLong)compsize)))
+    if ((ctx=gzip_get_context())==NULL)
+        return FSAERR_ENOMEM;
+    
+    if (ctx->infinit==false)
+    {   memset(&ctx->inf, 0, sizeof(ctx->inf));
+        if ((res=inflateInit(&ctx->inf))!=Z_OK)
+        {   errprintf("inflateInit() failed, res=%d\n", res);
+            return (res==Z_MEM_ERROR)?FSAERR_ENOMEM:FSAERR_UNKNOWN;
+        }
+        ctx->infinit=true;
+    }
+    else if (inflateReset(&ctx->inf)!=Z_OK)
+    {   errprintf("inflateReset() failed\n");
+        return FSAERR_UNKNOWN;
+    }
+    
+    ctx->inf.next_in=(Bytef *)compbuf;
+    ctx->inf.avail_in=(uInt)compsize;
+    ctx->inf.next_out=(Bytef *)origbuf;
+    ctx->inf.avail_out=(uInt)origbufsize;
+    
+    switch ((res=inflate(&ctx->inf, Z_FINISH)))
     {
-        case Z_OK:
-            *origsize=(u64)gzsize;
+        case Z_STREAM_END:
+            *origsize=(u64)ctx->inf.total_out;
             return FSAERR_SUCCESS;
         case Z_MEM_ERROR:
             return FSAERR_ENOMEM;
         default:
-            errprintf("uncompress() failed, res=%d\n", res);
+            errprintf("inflate() failed, res=%d\n", res);
             return FSAERR_UNKNOWN;
     }
 }
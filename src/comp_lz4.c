@@ -0,0 +1,130 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "fsarchiver.h"
+#include "common.h"
+#include "comp_lz4.h"
+#include "error.h"
+
+#ifdef OPTION_LZ4_SUPPORT
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <lz4.h>
+#include <lz4hc.h>
+
+// memory used by the lz4 and lz4-hc compressors: allocated once per compression thread
+struct s_lz4ctx
+{   void    *state;
+    void    *statehc;
+};
+
+typedef struct s_lz4ctx clz4ctx;
+
+static pthread_key_t g_lz4key;
+static pthread_once_t g_lz4once=PTHREAD_ONCE_INIT;
+
+// called when a thread which used lz4 terminates
+static void lz4_free_context(void *data)
+{
+    clz4ctx *ctx=(clz4ctx *)data;
+    
+    free(ctx->state);
+    free(ctx->statehc);
+    free(ctx);
+}
+
+static void lz4_create_key()
+{
+    if (pthread_key_create(&g_lz4key, lz4_free_context)!=0)
+        errprintf("pthread_key_create() failed\n");
+}
+
+static clz4ctx *lz4_get_context()
+{
+    clz4ctx *ctx;
+    
+    pthread_once(&g_lz4once, lz4_create_key);
+    if ((ctx=pthread_getspecific(g_lz4key))!=NULL)
+        return ctx;
+    
+    if ((ctx=calloc(1, sizeof(clz4ctx)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)sizeof(clz4ctx));
+        return NULL;
+    }
+    if (pthread_setspecific(g_lz4key, ctx)!=0)
+    {   errprintf("pthread_setspecific() failed\n");
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+int compress_block_lz4(u64 origsize, u64 *compsize, u8 *origbuf, u8 *compbuf, u64 compbufsize, int level)
+{
+    clz4ctx *ctx;
+    int res;
+    
+    if ((ctx=lz4_get_context())==NULL)
+        return FSAERR_ENOMEM;
+    
+    if (level < 3) // fast compressor: the acceleration of level 1 trades ratio for speed, level 2 has none
+    {
+        if ((ctx->state==NULL) && ((ctx->state=malloc(LZ4_sizeofState()))==NULL))
+        {   errprintf("malloc(%d) failed: out of memory\n", LZ4_sizeofState());
+            return FSAERR_ENOMEM;
+        }
+        res=LZ4_compress_fast_extState(ctx->state, (char*)origbuf, (char*)compbuf, (int)origsize, (int)compbufsize, (level==1)?LZ4_LEVEL1_ACCEL:1);
+    }
+    else // high compression: slower to compress, as fast to decompress
+    {
+        if ((ctx->statehc==NULL) && ((ctx->statehc=malloc(LZ4_sizeofStateHC()))==NULL))
+        {   errprintf("malloc(%d) failed: out of memory\n", LZ4_sizeofStateHC());
+            return FSAERR_ENOMEM;
+        }
+        res=LZ4_compress_HC_extStateHC(ctx->statehc, (char*)origbuf, (char*)compbuf, (int)origsize, (int)compbufsize, level);
+    }
+    
+    if (res<=0) // the output buffer is too small: data not compressible, the block will be stored uncompressed
+    {   *compsize=origsize;
+        return FSAERR_SUCCESS;
+    }
+    
+    *compsize=(u64)res;
+    return FSAERR_SUCCESS;
+}
+
+int uncompress_block_lz4(u64 compsize, u64 *origsize, u8 *origbuf, u64 origbufsize, u8 *compbuf)
+{
+    int res;
+    
+    // the decoder has no state: it checks that it does not read or write outside the buffers
+    if ((res=LZ4_decompress_safe((char*)compbuf, (char*)origbuf, (int)compsize, (int)origbufsize))<0)
+    {   errprintf("LZ4_decompress_safe() failed with res=%d\n", res);
+        *origsize=0;
+        return FSAERR_UNKNOWN;
+    }
+    
+    *origsize=(u64)res;
+    return FSAERR_SUCCESS;
+}
+
+#endif // OPTION_LZ4_SUPPORT
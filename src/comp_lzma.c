@@ -26,92 +26,148 @@
 
 #ifdef OPTION_LZMA_SUPPORT
 
+#include <stdlib.h>
+#include <pthread.h>
 #include <lzma.h>
 
+#define LZMA_DEF_MEMLIMIT  (96ULL*1024ULL*1024ULL) // initial memory limit of the decoder
+#define LZMA_MAX_MEMLIMIT  (3ULL*1024ULL*1024ULL*1024ULL)
+
+// each thread keeps its lzma streams: liblzma reuses the memory of a stream when it is initialized again
+// with the same settings, so the match finder of the high levels is not allocated for each block
+struct s_lzmactx
+{   lzma_stream enc; // stream used to compress
+    lzma_stream dec; // stream used to decompress
+    u64         memlimit; // memory limit of the decoder (raised when an archive requires more)
+};
+
+typedef struct s_lzmactx clzmactx;
+
+static pthread_key_t g_lzmakey;
+static pthread_once_t g_lzmaonce=PTHREAD_ONCE_INIT;
+
+// called when a thread which used lzma terminates
+static void lzma_free_context(void *data)
+{
+    clzmactx *ctx=(clzmactx *)data;
+    
+    lzma_end(&ctx->enc);
+    lzma_end(&ctx->dec);
+    free(ctx);
+}
+
+static void lzma_create_key()
+{
+    if (pthread_key_create(&g_lzmakey, lzma_free_context)!=0)
+        errprintf("pthread_key_create() failed\n");
+}
+
+static clzmactx *lzma_get_context()
+{
+    lzma_stream init = LZMA_STREAM_INIT;
+    clzmactx *ctx;
+    
+    pthread_once(&g_lzmaonce, lzma_create_key);
+    if ((ctx=pthread_getspecific(g_lzmakey))!=NULL)
+        return ctx;
+    
+    if ((ctx=malloc(sizeof(clzmactx)))==NULL)
+    {   errprintf("malloc(%ld) failed: out of memory\n", (long)sizeof(clzmactx));
+        return NULL;
+    }
+    ctx->enc=init;
+    ctx->dec=init;
+    ctx->memlimit=LZMA_DEF_MEMLIMIT;
+    if (pthread_setspecific(g_lzmakey, ctx)!=0)
+    {   errprintf("pthread_setspecific() failed\n");
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
 int compress_block_lzma(u64 origsize, u64 *compsize, u8 *origbuf, u8 *compbuf, u64 compbufsize, int level)
 {
-    lzma_stream lzma = LZMA_STREAM_INIT;
+    clzmactx *ctx;
     int res;
     
-    // init lzma structures
-    lzma.next_in = origbuf;
-    lzma.avail_in = origsize;
-    lzma.next_out = compbuf;
-    lzma.avail_out = compbufsize;
+    if ((ctx=lzma_get_context())==NULL)
+        return FSAERR_ENOMEM;
     
-    // Initialize a coder to the lzma_stream
-    if ((res=lzma_easy_encoder(&lzma, level, LZMA_CHECK_CRC32))!=LZMA_OK)
-    {   switch (res)
+    // initialize the coder again: the memory allocated for the previous block is reused
+    if ((res=lzma_easy_encoder(&ctx->enc, level, LZMA_CHECK_CRC32))!=LZMA_OK)
+    {   lzma_end(&ctx->enc); // release the memory before the block is compressed with another algorithm
+        switch (res)
         {
             case LZMA_MEM_ERROR:
                 errprintf("lzma_easy_encoder(%d): LZMA compression failed "
                     "with an out of memory error.\nYou should use a lower "
                     "compression level to reduce the memory requirement.\n", level);
-                lzma_end(&lzma);
                 return FSAERR_ENOMEM;
             default:
                 errprintf("lzma_easy_encoder(%d) failed with res=%d\n", level, res);
-                lzma_end(&lzma);
                 return FSAERR_UNKNOWN;
         }
     }
     
-    if ((res=lzma_code(&lzma, LZMA_RUN))!=LZMA_OK)
+    // init lzma structures
+    ctx->enc.next_in = origbuf;
+    ctx->enc.avail_in = origsize;
+    ctx->enc.next_out = compbuf;
+    ctx->enc.avail_out = compbufsize;
+    
+    if ((res=lzma_code(&ctx->enc, LZMA_RUN))!=LZMA_OK)
     {   errprintf("lzma_code(LZMA_RUN) failed with res=%d\n", res);
-        lzma_end(&lzma);
         return FSAERR_UNKNOWN;
     }
     
-    if ((res=lzma_code(&lzma, LZMA_FINISH))!=LZMA_STREAM_END && res!=LZMA_OK)
+    if ((res=lzma_code(&ctx->enc, LZMA_FINISH))!=LZMA_STREAM_END && res!=LZMA_OK)
     {   errprintf("lzma_code(LZMA_FINISH) failed with res=%d\n", res);
-        lzma_end(&lzma);
         return FSAERR_UNKNOWN;
     }
     
-    *compsize=(u64)(lzma.total_out);
-    lzma_end(&lzma);
+    *compsize=(u64)(ctx->enc.total_out);
     return FSAERR_SUCCESS;
 }
 
 int uncompress_block_lzma(u64 compsize, u64 *origsize, u8 *origbuf, u64 origbufsize, u8 *compbuf)
 {
-    lzma_stream lzma = LZMA_STREAM_INIT;
-    u64 maxmemlimit=3ULL*1024ULL*1024ULL*1024ULL;
-    u64 memlimit=96*1024*1024;
+    clzmactx *ctx;
     int res;
     
-    // init lzma structures
-    lzma.next_in = compbuf;
-    lzma.avail_in = compsize;
-    lzma.next_out = origbuf;
-    lzma.avail_out = origbufsize;
+    if ((ctx=lzma_get_context())==NULL)
+        return FSAERR_ENOMEM;
     
-    // Initialize a coder to the lzma_stream
-    if ((res=lzma_auto_decoder(&lzma, memlimit, 0))!=LZMA_OK)
+    // initialize the decoder again with the memory limit which was reached by the previous blocks
+    if ((res=lzma_auto_decoder(&ctx->dec, ctx->memlimit, 0))!=LZMA_OK)
     {   errprintf("lzma_auto_decoder() failed with res=%d\n", res);
-        lzma_end(&lzma);
+        lzma_end(&ctx->dec);
         return FSAERR_UNKNOWN;
     }
     
+    // init lzma structures
+    ctx->dec.next_in = compbuf;
+    ctx->dec.avail_in = compsize;
+    ctx->dec.next_out = origbuf;
+    ctx->dec.avail_out = origbufsize;
+    
     do // retry if lzma_code() returns LZMA_MEMLIMIT_ERROR (increase the memory limit)
     {   
-        if ((res=lzma_code(&lzma, LZMA_RUN)) != LZMA_STREAM_END) // if error
+        if ((res=lzma_code(&ctx->dec, LZMA_RUN)) != LZMA_STREAM_END) // if error
         {
             if (res == LZMA_MEMLIMIT_ERROR) // we have to raise the memory limit
-            {   memlimit+=64*1024*1024;
-                lzma_memlimit_set(&lzma, memlimit);
-                msgprintf(MSG_VERB2, "lzma_memlimit_set(%lld)\n", (long long)memlimit);
+            {   ctx->memlimit+=64*1024*1024;
+                lzma_memlimit_set(&ctx->dec, ctx->memlimit);
+                msgprintf(MSG_VERB2, "lzma_memlimit_set(%lld)\n", (long long)ctx->memlimit);
             }
             else // another error
             {   errprintf("lzma_code(LZMA_RUN) failed with res=%d\n", res);
-                lzma_end(&lzma);
                 return FSAERR_UNKNOWN;
             }
         }
-    } while ((res == LZMA_MEMLIMIT_ERROR) && (memlimit < maxmemlimit));
+    } while ((res == LZMA_MEMLIMIT_ERROR) && (ctx->memlimit < LZMA_MAX_MEMLIMIT));
     
-    *origsize=(u64)(lzma.total_out);
-    lzma_end(&lzma);
+    *origsize=(u64)(ctx->dec.total_out);
     
     switch (res)
     {
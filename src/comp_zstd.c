@@ -0,0 +1,155 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include "fsarchiver.h"
+#include "common.h"
+#include "comp_zstd.h"
+#include "error.h"
+
+#ifdef OPTION_ZSTD_SUPPORT
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <zstd.h>
+#include <zstd_errors.h>
+
+// each compression thread keeps its own contexts: allocating them for every block costs more than small blocks
+struct s_zstdctx
+{   ZSTD_CCtx   *cctx;
+    ZSTD_DCtx   *dctx;
+};
+
+typedef struct s_zstdctx czstdctx;
+
+static pthread_key_t g_zstdkey;
+static pthread_once_t g_zstdonce=PTHREAD_ONCE_INIT;
+
+// called when a thread which used zstd terminates
+static void zstd_free_context(void *data)
+{
+    czstdctx *ctx=(czstdctx *)data;
+    
+    ZSTD_freeCCtx(ctx->cctx);
+    ZSTD_freeDCtx(ctx->dctx);
+    free(ctx);
+}
+
+static void zstd_create_key()
+{
+    if (pthread_key_create(&g_zstdkey, zstd_free_context)!=0)
+        errprintf("pthread_key_create() failed\n");
+}
+
+static czstdctx *zstd_get_context()
+{
+    czstdctx *ctx;
+    
+    pthread_once(&g_zstdonce, zstd_create_key);
+    if ((ctx=pthread_getspecific(g_zstdkey))!=NULL)
+        return ctx;
+    
+    if ((ctx=calloc(1, sizeof(czstdctx)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)sizeof(czstdctx));
+        return NULL;
+    }
+    if (pthread_setspecific(g_zstdkey, ctx)!=0)
+    {   errprintf("pthread_setspecific() failed\n");
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+int zstd_min_level()
+{
+    return ZSTD_minCLevel();
+}
+
+int zstd_max_level()
+{
+    return ZSTD_maxCLevel();
+}
+
+int compress_block_zstd(u64 origsize, u64 *compsize, u8 *origbuf, u8 *compbuf, u64 compbufsize, int level)
+{
+    czstdctx *ctx;
+    size_t res;
+    
+    if ((ctx=zstd_get_context())==NULL)
+        return FSAERR_ENOMEM;
+    if ((ctx->cctx==NULL) && ((ctx->cctx=ZSTD_createCCtx())==NULL))
+    {   errprintf("ZSTD_createCCtx() failed: out of memory\n");
+        return FSAERR_ENOMEM;
+    }
+    
+    // the context keeps its tables between blocks, only the parameters are reset
+    ZSTD_CCtx_reset(ctx->cctx, ZSTD_reset_session_and_parameters);
+    if (ZSTD_isError(res=ZSTD_CCtx_setParameter(ctx->cctx, ZSTD_c_compressionLevel, level)))
+    {   errprintf("ZSTD_CCtx_setParameter(%d) failed: %s\n", level, ZSTD_getErrorName(res));
+        return FSAERR_UNKNOWN;
+    }
+    
+    // the size of the block is known so zstd reduces the window to what is useful
+    res=ZSTD_compress2(ctx->cctx, compbuf, compbufsize, origbuf, origsize);
+    if (ZSTD_isError(res))
+    {   switch (ZSTD_getErrorCode(res))
+        {
+            case ZSTD_error_dstSize_tooSmall: // data not compressible: the block will be stored uncompressed
+                *compsize=origsize;
+                return FSAERR_SUCCESS;
+            case ZSTD_error_memory_allocation:
+                errprintf("ZSTD_compress2(%d): zstd compression failed with an out of memory error.\n"
+                    "You should use a lower compression level to reduce the memory requirement.\n", level);
+                return FSAERR_ENOMEM;
+            default:
+                errprintf("ZSTD_compress2(%d) failed: %s\n", level, ZSTD_getErrorName(res));
+                return FSAERR_UNKNOWN;
+        }
+    }
+    
+    *compsize=(u64)res;
+    return FSAERR_SUCCESS;
+}
+
+int uncompress_block_zstd(u64 compsize, u64 *origsize, u8 *origbuf, u64 origbufsize, u8 *compbuf)
+{
+    czstdctx *ctx;
+    size_t res;
+    
+    if ((ctx=zstd_get_context())==NULL)
+        return FSAERR_ENOMEM;
+    if ((ctx->dctx==NULL) && ((ctx->dctx=ZSTD_createDCtx())==NULL))
+    {   errprintf("ZSTD_createDCtx() failed: out of memory\n");
+        return FSAERR_ENOMEM;
+    }
+    
+    res=ZSTD_decompressDCtx(ctx->dctx, origbuf, origbufsize, compbuf, compsize);
+    if (ZSTD_isError(res))
+    {   errprintf("ZSTD_decompressDCtx() failed: %s\n", ZSTD_getErrorName(res));
+        *origsize=0;
+        return FSAERR_UNKNOWN;
+    }
+    
+    *origsize=(u64)res;
+    return FSAERR_SUCCESS;
+}
+
+#endif // OPTION_ZSTD_SUPPORT
@@ -0,0 +1,206 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "fsarchiver.h"
+#include "cpuinfo.h"
+#include "error.h"
+
+// a physical core is kept for the archive io threads only when there are at least that many cpus
+#define CPUINFO_MIN_CPUS_RESERVE 8
+
+// "-j" accepts up to that many compression threads per cpu
+#define CPUINFO_MAX_JOBS_PER_CPU 4
+
+// cpus used by the compression threads and by the archive io threads when "-j auto" is used
+cpu_set_t g_cpuset_comp;
+cpu_set_t g_cpuset_io;
+pthread_attr_t g_attr_comp; // attributes of the new threads: they start on their cpus
+pthread_attr_t g_attr_io;
+bool g_cpuset_enabled=false;
+
+// read the first line of a small file from /proc or /sys
+int cpuinfo_read_line(char *path, char *buf, int bufsize)
+{
+    FILE *f;
+    int len;
+    
+    if ((f=fopen(path, "r"))==NULL)
+        return -1;
+    if (fgets(buf, bufsize, f)==NULL)
+    {   fclose(f);
+        return -1;
+    }
+    fclose(f);
+    
+    len=strlen(buf);
+    while (len>0 && (buf[len-1]=='\n' || buf[len-1]=='\r'))
+        buf[--len]=0;
+    return 0;
+}
+
+// parse a list of cpus such as "0-3,8,10-11" (format used in sysfs)
+int cpuinfo_parse_list(char *text, cpu_set_t *set)
+{
+    char *saveptr=NULL;
+    char *range;
+    long first, last;
+    char *end;
+    
+    CPU_ZERO(set);
+    for (range=strtok_r(text, ",", &saveptr); range!=NULL; range=strtok_r(NULL, ",", &saveptr))
+    {
+        first=strtol(range, &end, 10);
+        last=(*end=='-')?strtol(end+1, &end, 10):first;
+        if (first<0 || last<first || last>=CPU_SETSIZE)
+            return -1;
+        for (; first <= last; first++)
+            CPU_SET(first, set);
+    }
+    
+    return 0;
+}
+
+// number of cpus that the cgroup cpu quota allows to use (0 means no limit)
+int cpuinfo_cgroup_quota()
+{
+    char cgpath[PATH_MAX];
+    char path[PATH_MAX+64]; // room for the cgroup path plus the prefix and suffix
+    char buf[PATH_MAX];
+    long long quota=-1;
+    long long period=0;
+    char maxtxt[64];
+    FILE *f;
+    
+    // cgroup v2: the path of our cgroup is on the line which starts with "0::"
+    snprintf(cgpath, sizeof(cgpath), "/");
+    if ((f=fopen("/proc/self/cgroup", "r"))!=NULL)
+    {   while (fgets(buf, sizeof(buf), f)!=NULL)
+        {   if (strncmp(buf, "0::", 3)==0)
+            {   buf[strcspn(buf, "\n")]=0;
+                snprintf(cgpath, sizeof(cgpath), "%s", buf+3);
+            }
+        }
+        fclose(f);
+    }
+    snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cgpath);
+    if (cpuinfo_read_line(path, buf, sizeof(buf))==0 || cpuinfo_read_line("/sys/fs/cgroup/cpu.max", buf, sizeof(buf))==0)
+    {   if (sscanf(buf, "%63s %lld", maxtxt, &period)==2 && strcmp(maxtxt, "max")!=0)
+            quota=atoll(maxtxt);
+    }
+    // cgroup v1: quota and period are in two files
+    else if (cpuinfo_read_line("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", buf, sizeof(buf))==0 ||
+        cpuinfo_read_line("/sys/fs/cgroup/cpu,cpuacct/cpu.cfs_quota_us", buf, sizeof(buf))==0)
+    {   quota=atoll(buf);
+        if (cpuinfo_read_line("/sys/fs/cgroup/cpu/cpu.cfs_period_us", buf, sizeof(buf))==0 ||
+            cpuinfo_read_line("/sys/fs/cgroup/cpu,cpuacct/cpu.cfs_period_us", buf, sizeof(buf))==0)
+            period=atoll(buf);
+    }
+    
+    if (quota<=0 || period<=0)
+        return 0;
+    msgprintf(MSG_DEBUG1, "cgroup cpu quota: quota=%lld period=%lld\n", quota, period);
+    return (int)((quota+period-1)/period);
+}
+
+// find how many compression threads to use for "-j auto" and which cpus they can run on
+int cpuinfo_auto_jobs()
+{
+    cpu_set_t allowed;
+    cpu_set_t siblings;
+    char path[PATH_MAX];
+    char buf[1024];
+    int first=-1;
+    int quota;
+    int jobs;
+    int i;
+    
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)!=0)
+    {   sysprintf("sched_getaffinity() failed: using one compression thread\n");
+        return 1;
+    }
+    
+    g_cpuset_comp=allowed;
+    g_cpuset_io=allowed;
+    
+    // keep the first physical core (all its hardware threads) for the threads which read/write the archive
+    if (CPU_COUNT(&allowed) >= CPUINFO_MIN_CPUS_RESERVE)
+    {
+        for (i=0; (i < CPU_SETSIZE) && (first < 0); i++)
+            if (CPU_ISSET(i, &allowed))
+                first=i;
+        
+        CPU_ZERO(&g_cpuset_io);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", first);
+        if (cpuinfo_read_line(path, buf, sizeof(buf))==0 && cpuinfo_parse_list(buf, &siblings)==0)
+            CPU_AND(&g_cpuset_io, &siblings, &allowed);
+        if (CPU_COUNT(&g_cpuset_io)==0)
+            CPU_SET(first, &g_cpuset_io);
+        
+        CPU_XOR(&g_cpuset_comp, &allowed, &g_cpuset_io); // g_cpuset_io is a subset of allowed
+    }
+    
+    jobs=CPU_COUNT(&g_cpuset_comp);
+    if ((quota=cpuinfo_cgroup_quota())>0 && quota < jobs)
+        jobs=quota;
+    jobs=max(jobs, 1);
+    
+    // the threads are created on their cpus: they never run on the other ones
+    pthread_attr_init(&g_attr_comp);
+    pthread_attr_init(&g_attr_io);
+    if ((pthread_attr_setaffinity_np(&g_attr_comp, sizeof(cpu_set_t), &g_cpuset_comp)==0) &&
+        (pthread_attr_setaffinity_np(&g_attr_io, sizeof(cpu_set_t), &g_cpuset_io)==0))
+        g_cpuset_enabled=true;
+    else
+        msgprintf(MSG_DEBUG1, "pthread_attr_setaffinity_np() failed: the threads will not be pinned\n");
+    msgprintf(MSG_VERB1, "Using %d compression threads: %d cpus available, %d reserved for the archive io\n",
+        jobs, (int)CPU_COUNT(&allowed), (CPU_EQUAL(&g_cpuset_io, &allowed))?0:(int)CPU_COUNT(&g_cpuset_io));
+    return jobs;
+}
+
+// attributes which start a new thread on the cpus selected by cpuinfo_auto_jobs() (NULL if "-j auto" is not used)
+pthread_attr_t *cpuinfo_thread_attr(int cpuset)
+{
+    if (g_cpuset_enabled==false)
+        return NULL;
+    return (cpuset==CPUINFO_SET_IO)?&g_attr_io:&g_attr_comp;
+}
+
+// maximum number of compression threads for "-j <count>": more threads only compete for the same cpus
+int cpuinfo_max_jobs()
+{
+    cpu_set_t allowed;
+    int cpus;
+    
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)==0)
+        cpus=CPU_COUNT(&allowed);
+    else
+        cpus=(int)sysconf(_SC_NPROCESSORS_ONLN);
+    
+    return CPUINFO_MAX_JOBS_PER_CPU*max(cpus, 1);
+}
@@ -0,0 +1,29 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __CPUINFO_H__
+#define __CPUINFO_H__
+
+#include <pthread.h>
+
+enum {CPUINFO_SET_COMP=0, CPUINFO_SET_IO=1};
+
+int cpuinfo_auto_jobs();
+pthread_attr_t *cpuinfo_thread_attr(int cpuset);
+int cpuinfo_max_jobs();
+
+#endif // __CPUINFO_H__
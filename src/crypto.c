@@ -22,6 +22,11 @@
 #include <pthread.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#if defined(__aarch64__)
+#  include <sys/auxv.h>
+#  include <asm/hwcap.h>
+#endif
 
 #include "fsarchiver.h"
 #include "common.h"
@@ -110,6 +115,196 @@ int crypto_blowfish(u64 insize, u64 *outsize, u8 *inbuf, u8 *outbuf, u8 *passwor
     return (res==0)?(0):(-1);
 }
 
+// ---- authenticated encryption (aes256-gcm and chacha20-poly1305)
+// the key is derived from the password once, then each thread keeps its own cipher handle and
+// only sets a new nonce for each block. An encrypted block is stored as: nonce, data, tag
+
+struct s_cryptoctx
+{   gcry_cipher_hd_t     hd;
+    int                  algo; // ENCRYPT_xxx algorithm of hd
+    bool                 open; // true when hd has been opened and has the key
+};
+
+typedef struct s_cryptoctx ccryptoctx;
+
+static u8 g_cryptokey[CRYPTO_KEYSIZE]; // set by crypto_setkey() before the threads use it
+static int g_cryptoalgo=ENCRYPT_NULL;
+static pthread_key_t g_cryptokeyctx;
+static pthread_once_t g_cryptoonce=PTHREAD_ONCE_INIT;
+
+bool crypto_supported(int algo)
+{
+    switch (algo)
+    {
+        case ENCRYPT_NONE:
+        case ENCRYPT_BLOWFISH:
+            return true;
+#if GCRYPT_VERSION_NUMBER >= 0x010600
+        case ENCRYPT_AES256GCM:
+            return true;
+#endif
+#if GCRYPT_VERSION_NUMBER >= 0x010700
+        case ENCRYPT_CHACHA20:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+// aes256-gcm when the cpu has aes instructions, chacha20-poly1305 is faster in software
+int crypto_auto_algo()
+{
+    bool aes=false;
+    
+#if defined(__x86_64__) || defined(__i386__)
+    aes=__builtin_cpu_supports("aes");
+#elif defined(__aarch64__)
+    aes=((getauxval(AT_HWCAP) & HWCAP_AES)!=0);
+#endif
+    
+    if ((aes==false) && (crypto_supported(ENCRYPT_CHACHA20)==true))
+        return ENCRYPT_CHACHA20;
+    return ENCRYPT_AES256GCM;
+}
+
+// derive the key of the authenticated algorithms from the password (pbkdf2 with the salt of the archive)
+int crypto_setkey(int algo, u8 *password, int passlen, u8 *salt, int saltlen, u32 iterations)
+{
+    if ((password==NULL) || (passlen==0) || (crypto_supported(algo)==false))
+        return -1;
+    
+    if (gcry_kdf_derive(password, passlen, GCRY_KDF_PBKDF2, GCRY_MD_SHA256, salt, saltlen, 
+        iterations, CRYPTO_KEYSIZE, g_cryptokey)!=GPG_ERR_NO_ERROR)
+    {   errprintf("gcry_kdf_derive() failed\n");
+        return -1;
+    }
+    g_cryptoalgo=algo;
+    
+    return 0;
+}
+
+// called when a thread which used the authenticated encryption terminates
+static void crypto_free_context(void *data)
+{
+    ccryptoctx *ctx=(ccryptoctx *)data;
+    
+    if (ctx->open)
+        gcry_cipher_close(ctx->hd);
+    free(ctx);
+}
+
+static void crypto_create_key()
+{
+    if (pthread_key_create(&g_cryptokeyctx, crypto_free_context)!=0)
+        errprintf("pthread_key_create() failed\n");
+}
+
+static ccryptoctx *crypto_get_context(int algo)
+{
+    ccryptoctx *ctx;
+    int cipher=0;
+    int mode=0;
+    
+    pthread_once(&g_cryptoonce, crypto_create_key);
+    if ((ctx=pthread_getspecific(g_cryptokeyctx))==NULL)
+    {
+        if ((ctx=calloc(1, sizeof(ccryptoctx)))==NULL)
+        {   errprintf("calloc(%ld) failed: out of memory\n", (long)sizeof(ccryptoctx));
+            return NULL;
+        }
+        if (pthread_setspecific(g_cryptokeyctx, ctx)!=0)
+        {   errprintf("pthread_setspecific() failed\n");
+            free(ctx);
+            return NULL;
+        }
+    }
+    
+    if (ctx->open && ctx->algo==algo)
+        return ctx;
+    
+    if (ctx->open)
+    {   gcry_cipher_close(ctx->hd);
+        ctx->open=false;
+    }
+    
+    if (algo!=g_cryptoalgo)
+    {   errprintf("no key has been derived for the encryption algorithm %d\n", algo);
+        return NULL;
+    }
+    
+    switch (algo)
+    {
+#if GCRYPT_VERSION_NUMBER >= 0x010600
+        case ENCRYPT_AES256GCM:
+            cipher=GCRY_CIPHER_AES256;
+            mode=GCRY_CIPHER_MODE_GCM;
+            break;
+#endif
+#if GCRYPT_VERSION_NUMBER >= 0x010700
+        case ENCRYPT_CHACHA20:
+            cipher=GCRY_CIPHER_CHACHA20;
+            mode=GCRY_CIPHER_MODE_POLY1305;
+            break;
+#endif
+        default:
+            errprintf("encryption algorithm %d is not supported\n", algo);
+            return NULL;
+    }
+    
+    if (gcry_cipher_open(&ctx->hd, cipher, mode, 0)!=GPG_ERR_NO_ERROR)
+    {   errprintf("gcry_cipher_open() failed\n");
+        return NULL;
+    }
+    if (gcry_cipher_setkey(ctx->hd, g_cryptokey, CRYPTO_KEYSIZE)!=GPG_ERR_NO_ERROR)
+    {   errprintf("gcry_cipher_setkey() failed\n");
+        gcry_cipher_close(ctx->hd);
+        return NULL;
+    }
+    ctx->algo=algo;
+    ctx->open=true;
+    
+    return ctx;
+}
+
+// enc=1: outbuf must have CRYPTO_AEAD_OVERHEAD more bytes than insize
+// enc=0: fails if the block has been modified or if the key is not the one used to encrypt it
+int crypto_aead(int algo, u64 insize, u64 *outsize, u8 *inbuf, u8 *outbuf, int enc)
+{
+    ccryptoctx *ctx;
+    u64 datasize;
+    
+    if ((ctx=crypto_get_context(algo))==NULL)
+        return -1;
+    
+    if (enc==1)
+    {
+        gcry_create_nonce(outbuf, CRYPTO_AEAD_NONCESIZE);
+        if ((gcry_cipher_setiv(ctx->hd, outbuf, CRYPTO_AEAD_NONCESIZE)!=GPG_ERR_NO_ERROR) ||
+            (gcry_cipher_final(ctx->hd)!=GPG_ERR_NO_ERROR) ||
+            (gcry_cipher_encrypt(ctx->hd, outbuf+CRYPTO_AEAD_NONCESIZE, insize, inbuf, insize)!=GPG_ERR_NO_ERROR) ||
+            (gcry_cipher_gettag(ctx->hd, outbuf+CRYPTO_AEAD_NONCESIZE+insize, CRYPTO_AEAD_TAGSIZE)!=GPG_ERR_NO_ERROR))
+        {   errprintf("cannot encrypt block with algorithm %d\n", algo);
+            return -1;
+        }
+        *outsize=insize+CRYPTO_AEAD_OVERHEAD;
+    }
+    else
+    {
+        if (insize < CRYPTO_AEAD_OVERHEAD)
+            return -1;
+        datasize=insize-CRYPTO_AEAD_OVERHEAD;
+        if ((gcry_cipher_setiv(ctx->hd, inbuf, CRYPTO_AEAD_NONCESIZE)!=GPG_ERR_NO_ERROR) ||
+            (gcry_cipher_final(ctx->hd)!=GPG_ERR_NO_ERROR) ||
+            (gcry_cipher_decrypt(ctx->hd, outbuf, datasize, inbuf+CRYPTO_AEAD_NONCESIZE, datasize)!=GPG_ERR_NO_ERROR) ||
+            (gcry_cipher_checktag(ctx->hd, inbuf+CRYPTO_AEAD_NONCESIZE+datasize, CRYPTO_AEAD_TAGSIZE)!=GPG_ERR_NO_ERROR))
+            return -1;
+        *outsize=datasize;
+    }
+    
+    return 0;
+}
+
 int crypto_random(u8 *buf, int bufsize)
 {
     memset(buf, 0, bufsize);
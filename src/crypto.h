@@ -20,9 +20,20 @@
 
 #include "types.h"
 
-int crypto_init();
-int crypto_blowfish(u64 insize, u64 *outsize, u8 *inbuf, u8 *outbuf, u8 *password, int passlen, int enc);
-int crypto_random(u8 *buf, int bufsize);
-int crypto_cleanup();
+#define CRYPTO_KEYSIZE           32 // aes256 and chacha20 keys
+#define CRYPTO_AEAD_NONCESIZE    12
+#define CRYPTO_AEAD_TAGSIZE      16
+#define CRYPTO_AEAD_OVERHEAD     (CRYPTO_AEAD_NONCESIZE+CRYPTO_AEAD_TAGSIZE) // bytes added to each block by crypto_aead()
+#define CRYPTO_KDF_SALTSIZE      16
+#define CRYPTO_KDF_ITERATIONS    400000 // pbkdf2-sha256: takes about 0.1 second
+
+int  crypto_init();
+bool crypto_supported(int algo);
+int  crypto_auto_algo();
+int  crypto_setkey(int algo, u8 *password, int passlen, u8 *salt, int saltlen, u32 iterations);
+int  crypto_blowfish(u64 insize, u64 *outsize, u8 *inbuf, u8 *outbuf, u8 *password, int passlen, int enc);
+int  crypto_aead(int algo, u64 insize, u64 *outsize, u8 *inbuf, u8 *outbuf, int enc);
+int  crypto_random(u8 *buf, int bufsize);
+int  crypto_cleanup();
 
 #endif // __CRYPTO_H__
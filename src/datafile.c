@@ -26,12 +26,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <gcrypt.h>
 
 #include "fsarchiver.h"
 #include "datafile.h"
 #include "common.h"
 #include "error.h"
+#include "pipestats.h"
+#include "thread_hash.h"
 
 struct s_datafile 
 {   int  fd; // file descriptor
@@ -39,7 +40,7 @@ struct s_datafile
     bool open; // true when file is open even if simulation
     bool sparse; // true if that's a sparse file
     char path[PATH_MAX]; // path to file
-    gcry_md_hd_t md5ctx; // struct for md5
+    cfilehash *filehash; // md5 of the data computed by the md5 thread
 };
 
 cdatafile *datafile_alloc()
@@ -52,6 +53,7 @@ cdatafile *datafile_alloc()
     f->simul=false;
     f->open=false;
     f->sparse=false;
+    f->filehash=NULL;
     return f;
 }
 
@@ -66,7 +68,8 @@ int datafile_destroy(cdatafile *f)
     return 0;
 }
 
-int datafile_open_write(cdatafile *f, char *path, bool simul, bool sparse)
+// md5 is false when the contents of the file are verified with the hashes of the blocks
+int datafile_open_write(cdatafile *f, char *path, bool simul, bool sparse, bool md5)
 {
     assert(f);
     
@@ -90,8 +93,9 @@ int datafile_open_write(cdatafile *f, char *path, bool simul, bool sparse)
         }
     }
     
-    if (gcry_md_open(&f->md5ctx, GCRY_MD_MD5, 0) != GPG_ERR_NO_ERROR)
-    {   errprintf("gcry_md_open() failed\n");
+    f->filehash=NULL;
+    if ((md5==true) && ((f->filehash=filehash_alloc())==NULL))
+    {   errprintf("filehash_alloc() failed\n");
         return -1;
     }
     
@@ -114,8 +118,10 @@ int datafile_is_block_zero(cdatafile *f, char *data, u64 len)
     return zero;
 }
 
-int datafile_write(cdatafile *f, char *data, u64 len)
+// pooled means that data is a buffer from the pool: the md5 thread keeps a reference on it instead of a copy
+int datafile_write(cdatafile *f, char *data, u64 len, bool pooled)
 {
+    u64 start;
     s64 lres;
     
     assert(f);
@@ -137,7 +143,10 @@ int datafile_write(cdatafile *f, char *data, u64 len)
         else
         {
             errno=0;
-            if ((lres=write(f->fd, data, len))!=len) // error
+            start=pipestats_start();
+            lres=write(f->fd, data, len);
+            pipestats_add(PIPESTATS_WRITE, start, max(lres, 0));
+            if (lres!=len) // error
             {
                 if ((errno==ENOSPC) || ((lres>0) && (lres < len)))
                 {   sysprintf("Can't write file [%s]: no space left on device\n", f->path);
@@ -151,15 +160,18 @@ int datafile_write(cdatafile *f, char *data, u64 len)
         }
     }
     
-    gcry_md_write(f->md5ctx, data, len);
+    if ((f->filehash!=NULL) && filehash_write(f->filehash, (pooled==true)?data:NULL, data, len)!=0)
+    {   errprintf("filehash_write() failed\n");
+        return FSAERR_ENOMEM;
+    }
     
     return FSAERR_SUCCESS;
 }
 
 int datafile_close(cdatafile *f, u8 *md5bufdat, int md5bufsize)
 {
-    char md5store[16];
-    u8 *md5tmp;
+    cfilehash *filehash;
+    u8 md5store[16];
     int res=0;
     
     assert(f);
@@ -169,14 +181,16 @@ int datafile_close(cdatafile *f, u8 *md5bufdat, int md5bufsize)
         return -1;
     }
     
-    if ((md5tmp=gcry_md_read(f->md5ctx, GCRY_MD_MD5))==NULL)
-    {   errprintf("gcry_md_read() failed\n");
-        return -1;
+    // wait for the md5 thread to hash the last blocks of the file
+    if ((filehash=f->filehash)!=NULL)
+    {   f->filehash=NULL;
+        if (filehash_final(filehash, md5store, sizeof(md5store))!=0)
+        {   errprintf("filehash_final() failed\n");
+            return -1;
+        }
     }
-    memcpy(md5store, md5tmp, 16);
-    gcry_md_close(f->md5ctx);
     
-    if (md5bufdat!=NULL)
+    if ((md5bufdat!=NULL) && (filehash!=NULL))
     {
         if (md5bufsize < 16)
         {   errprintf("Buffer too small for md5 checksum\n");
@@ -25,8 +25,8 @@ typedef struct s_datafile cdatafile;
 
 cdatafile *datafile_alloc();
 int       datafile_destroy(cdatafile *f);
-int       datafile_open_write(cdatafile *f, char *path, bool simul, bool sparse);
-int       datafile_write(cdatafile *f, char *data, u64 len);
+int       datafile_open_write(cdatafile *f, char *path, bool simul, bool sparse, bool md5);
+int       datafile_write(cdatafile *f, char *data, u64 len, bool pooled);
 int       datafile_close(cdatafile *f, u8 *md5bufdat, int md5bufsize);
 
 #endif // __DATAFILE_H__
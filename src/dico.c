@@ -196,6 +196,21 @@ int dico_count_all_sections(cdico *d)
     return count;
 }
 
+// memory used by the dico (structures and data) in bytes
+u64 dico_get_memsize(cdico *d)
+{
+    cdicoitem *item;
+    u64 size;
+    
+    assert(d);
+    
+    size=sizeof(cdico);
+    for (item=d->head; item!=NULL; item=item->next)
+        size+=sizeof(cdicoitem)+item->size;
+    
+    return size;
+}
+
 int dico_add_u16(cdico *d, u8 section, u16 key, u16 data)
 {
     u16 ledata;
@@ -48,6 +48,7 @@ int   dico_destroy(cdico *d);
 int   dico_show(cdico *d, u8 section, char *debugtxt);
 int   dico_count_all_sections(cdico *d);
 int   dico_count_one_section(cdico *d, u8 section);
+u64   dico_get_memsize(cdico *d);
 int   dico_add_data(cdico *d, u8 section, u16 key, const void *data, u16 size);
 int   dico_add_generic(cdico *d, u8 section, u16 key, const void *data, u16 size, u8 type);
 int   dico_get_generic(cdico *d, u8 section, u16 key, void *data, u16 maxsize, u16 *size);
@@ -0,0 +1,144 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <string.h>
+
+#include "fsarchiver.h"
+#include "entropy.h"
+#include "options.h"
+#include "pipestats.h"
+#include "error.h"
+
+// signatures of file formats which are already compressed
+struct s_magic
+{   int    offset; // position of the signature in the file
+    int    len;
+    char   *bytes;
+};
+
+static struct s_magic entropy_magics[]=
+{
+    {0, 2, "\x1f\x8b"},                         // gzip
+    {0, 3, "BZh"},                              // bzip2
+    {0, 6, "\xfd" "7zXZ\x00"},                  // xz
+    {0, 4, "\x28\xb5\x2f\xfd"},                 // zstd
+    {0, 4, "\x04\x22\x4d\x18"},                 // lz4
+    {0, 4, "PK\x03\x04"},                       // zip, jar, office documents
+    {0, 6, "7z\xbc\xaf\x27\x1c"},               // 7-zip
+    {0, 6, "Rar!\x1a\x07"},                     // rar
+    {0, 4, "hsqs"},                             // squashfs
+    {0, 3, "\xff\xd8\xff"},                     // jpeg
+    {0, 8, "\x89PNG\r\n\x1a\n"},                // png
+    {8, 4, "WEBP"},                             // webp
+    {4, 4, "ftyp"},                             // mp4, mov, m4a, heic
+    {0, 4, "\x1a\x45\xdf\xa3"},                 // matroska, webm
+    {0, 4, "OggS"},                             // ogg
+    {0, 4, "fLaC"},                             // flac
+    {0, 3, "ID3"},                              // mp3
+    {0, 0, NULL}
+};
+
+// estimate whether a block is worth compressing from the distribution of the bytes in a sample:
+// a block where all the byte values are almost equally frequent cannot be compressed much
+bool entropy_block_incompressible(u8 *data, u32 size)
+{
+    u32 count[256];
+    u64 sumsq=0;
+    u64 sample=0;
+    u32 nchunks;
+    u32 stride;
+    u64 start;
+    u32 i, j;
+    u8 *chunk;
+    
+    if (size < ENTROPY_MINSIZE)
+        return false;
+    
+    start=pipestats_start();
+    memset(count, 0, sizeof(count));
+    nchunks=min(size/ENTROPY_CHUNKSIZE, ENTROPY_MAXCHUNKS);
+    stride=size/nchunks;
+    for (i=0; i < nchunks; i++)
+    {   chunk=data+((u64)i)*stride;
+        for (j=0; j < ENTROPY_CHUNKSIZE; j++)
+            count[chunk[j]]++;
+        sample+=ENTROPY_CHUNKSIZE;
+    }
+    
+    // sum(c*(c-1)) estimates sample*(sample-1)*sum(p^2) without the bias of small samples
+    for (i=0; i < 256; i++)
+        sumsq+=((u64)count[i])*((u64)count[i]);
+    pipestats_add_probe(start);
+    
+    return ((sumsq-sample)*256*1000 < ((u64)ENTROPY_MAXRATIO)*sample*(sample-1));
+}
+
+// recognize the formats which are already compressed from the first bytes of a file
+bool entropy_format_compressed(u8 *data, u32 size)
+{
+    int i;
+    
+    for (i=0; entropy_magics[i].bytes!=NULL; i++)
+    {
+        if ((entropy_magics[i].offset+entropy_magics[i].len <= size) && 
+            (memcmp(data+entropy_magics[i].offset, entropy_magics[i].bytes, entropy_magics[i].len)==0))
+        {   msgprintf(MSG_DEBUG2, "file format recognized as compressed (signature #%d)\n", i);
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+int entropy_file_init(centropyfile *ef)
+{
+    memset(ef, 0, sizeof(centropyfile));
+    return 0;
+}
+
+// called for each block of a file in the order of the file: returns the BLKHINT_xxx of the block
+int entropy_file_hint(centropyfile *ef, u8 *data, u32 size)
+{
+    int hint;
+    
+    if (g_options.detectincomp==INCOMP_DETECT_OFF)
+        return BLKHINT_UNKNOWN;
+    
+    if ((ef->blocks==0) && (g_options.detectincomp==INCOMP_DETECT_FILES) && (entropy_format_compressed(data, size)==true))
+    {   ef->incompblocks=ENTROPY_STOPAFTER; // the next blocks are handled as if the first ones were incompressible
+        pipestats_add_compressed_file();
+        hint=BLKHINT_STORE;
+    }
+    else if ((ef->incompblocks >= ENTROPY_STOPAFTER) && ((ef->blocks % ENTROPY_RECHECK)!=0))
+    {   hint=BLKHINT_STORE;
+    }
+    else if (entropy_block_incompressible(data, size)==true)
+    {   ef->incompblocks++;
+        hint=BLKHINT_STORE;
+    }
+    else // compressible: analyse the next blocks again
+    {   ef->incompblocks=0;
+        hint=BLKHINT_COMPRESS;
+    }
+    ef->blocks++;
+    
+    return hint;
+}
@@ -0,0 +1,48 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __ENTROPY_H__
+#define __ENTROPY_H__
+
+#define ENTROPY_MINSIZE     1024 // smaller blocks are always given to the compression algorithm
+#define ENTROPY_CHUNKSIZE   64 // the sample is made of chunks of consecutive bytes spread over the block
+#define ENTROPY_MAXCHUNKS   64 // at most 4K of data are analysed per block
+#define ENTROPY_MAXRATIO    1414 // incompressible if 1000*sum(p^2) is below that many 256th (more than 7.5 bits per byte)
+#define ENTROPY_STOPAFTER   4 // stop analysing the blocks of a file after that many consecutive incompressible blocks
+#define ENTROPY_RECHECK     16 // ... but still analyse one block out of that many in case the contents changes
+
+// what --detect-incompressible does
+enum {INCOMP_DETECT_OFF=0, INCOMP_DETECT_BLOCKS, INCOMP_DETECT_FILES};
+
+// what is already known about a block when it is given to the compression threads
+enum {BLKHINT_UNKNOWN=0, BLKHINT_COMPRESS, BLKHINT_STORE};
+
+struct s_entropyfile;
+typedef struct s_entropyfile centropyfile;
+
+// state of the detection for the file which is being read
+struct s_entropyfile
+{   u64    blocks; // how many blocks of the file have been seen
+    u32    incompblocks; // how many consecutive blocks have been found incompressible
+};
+
+bool entropy_block_incompressible(u8 *data, u32 size);
+bool entropy_format_compressed(u8 *data, u32 size);
+int  entropy_file_init(centropyfile *ef);
+int  entropy_file_hint(centropyfile *ef, u8 *data, u32 size);
+
+#endif // __ENTROPY_H__
@@ -24,6 +24,7 @@
 #include <signal.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <fcntl.h>
 
 #include "fsarchiver.h"
 #include "dico.h"
@@ -39,14 +40,19 @@
 #include "logfile.h"
 #include "error.h"
 #include "queue.h"
+#include "cpuinfo.h"
+#include "bufpool.h"
+#include "entropy.h"
+#include "archinfo.h"
+#include "checksum.h"
 
 char *valid_magic[]={FSA_MAGIC_MAIN, FSA_MAGIC_VOLH, FSA_MAGIC_VOLF, 
     FSA_MAGIC_FSIN, FSA_MAGIC_FSYB, FSA_MAGIC_DATF, FSA_MAGIC_OBJT, 
-    FSA_MAGIC_BLKH, FSA_MAGIC_FILF, FSA_MAGIC_DIRS, NULL};
+    FSA_MAGIC_BLKH, FSA_MAGIC_FILF, FSA_MAGIC_DIRS, FSA_MAGIC_INDX, NULL};
 
 void usage(char *progname, bool examples)
 {
-    int lzo=false, lzma=false;
+    int lzo=false, lzma=false, zstd=false, lz4=false, xxhash=false;
     
 #ifdef OPTION_LZO_SUPPORT
     lzo=true;
@@ -54,6 +60,15 @@ void usage(char *progname, bool examples)
 #ifdef OPTION_LZMA_SUPPORT
     lzma=true;
 #endif // OPTION_LZMA_SUPPORT
+#ifdef OPTION_ZSTD_SUPPORT
+    zstd=true;
+#endif // OPTION_ZSTD_SUPPORT
+#ifdef OPTION_LZ4_SUPPORT
+    lz4=true;
+#endif // OPTION_LZ4_SUPPORT
+#ifdef OPTION_XXHASH_SUPPORT
+    xxhash=true;
+#endif // OPTION_XXHASH_SUPPORT
     
     msgprintf(MSG_FORCE, "====> fsarchiver version %s (%s) - http://www.fsarchiver.org <====\n", FSA_VERSION, FSA_RELDATE);
     msgprintf(MSG_FORCE, "Distributed under the GPL v2 license (GNU General Public License v2).\n");
@@ -72,15 +87,29 @@ void usage(char *progname, bool examples)
     msgprintf(MSG_FORCE, " -A: allow to save a filesystem which is mounted in read-write (live backup)\n");
     msgprintf(MSG_FORCE, " -a: allow running savefs when partition mounted without the acl/xattr options\n");
     msgprintf(MSG_FORCE, " -e <pattern>: exclude files and directories that match that pattern\n");
+    msgprintf(MSG_FORCE, " --only=<pattern>: restore only the files and directories that match that pattern\n");
     msgprintf(MSG_FORCE, " -L <label>: set the label of the archive (comment about the contents)\n");
     msgprintf(MSG_FORCE, " -z <level>: compression level from 1 (very fast)  to  9 (very good) default=3\n");
+    msgprintf(MSG_FORCE, " -Z <level>: use zstd compression instead, from -7 (fastest) to 22 (best), eg: -Z 3\n");
+    msgprintf(MSG_FORCE, " --lz4[=<level>]: use lz4 compression instead, 1-2 (fastest, 1 is faster than 2) or lz4-hc 3-12, default=2\n");
     msgprintf(MSG_FORCE, " -s <mbsize>: split the archive into several files of <mbsize> megabytes each\n");
     msgprintf(MSG_FORCE, " -j <count>: create more than one compression thread. useful on multi-core cpu\n");
+    msgprintf(MSG_FORCE, " -j auto: one compression thread per available cpu (affinity mask and cgroup quota)\n");
     msgprintf(MSG_FORCE, " -c <password>: encrypt/decrypt data in archive, \"-c -\" for interactive password\n");
+    msgprintf(MSG_FORCE, " --cipher=<algo>: encryption used with -c: blowfish (default), aes256-gcm, chacha20-poly1305, auto\n");
+    msgprintf(MSG_FORCE, " --checksum=<algo>: checksum of the blocks and headers: fletcher32 (default), crc32c, xxh3\n");
+    msgprintf(MSG_FORCE, " --block-hashes: verify the files with a sha256 per block (computed by the -j threads) instead of an md5\n");
+    msgprintf(MSG_FORCE, " --index: write an index of the filesystems and files at the end of the archive\n");
+    msgprintf(MSG_FORCE, " --queue-mem=<size>: memory used by the data waiting to be processed (eg: 512M)\n");
+    msgprintf(MSG_FORCE, " --hugepages: allocate the buffers of the data blocks in huge pages when possible\n");
+    msgprintf(MSG_FORCE, " --detect-incompressible=<mode>: don't compress data which looks incompressible: off, blocks, files\n");
+    msgprintf(MSG_FORCE, " --metrics-fd=<fd>: write progress metrics (one json record per second) to a file descriptor\n");
+    msgprintf(MSG_FORCE, " --metrics-json=<file>: write progress metrics (one json record per second) to a file\n");
     msgprintf(MSG_FORCE, " -h: show help and information about how to use fsarchiver with examples\n");
     msgprintf(MSG_FORCE, " -V: show program version and exit\n");
     msgprintf(MSG_FORCE, "<information>\n");
-    msgprintf(MSG_FORCE, " * Support included for: lzo=%s, lzma=%s\n", (lzo==true)?"yes":"no", (lzma==true)?"yes":"no");
+    msgprintf(MSG_FORCE, " * Support included for: lzo=%s, lzma=%s, zstd=%s, lz4=%s, xxhash=%s\n", (lzo==true)?"yes":"no", (lzma==true)?"yes":"no", 
+        (zstd==true)?"yes":"no", (lz4==true)?"yes":"no", (xxhash==true)?"yes":"no");
     msgprintf(MSG_FORCE, " * support for ntfs filesystems is unstable: don't use it for production.\n");
     
     if (examples==true)
@@ -114,11 +143,16 @@ void usage(char *progname, bool examples)
         msgprintf(MSG_FORCE, "   fsarchiver savefs -c - /data/myarchive1.fsa /dev/sda1\n");
         msgprintf(MSG_FORCE, " * \e[1mextract an archive made of simple files to /tmp/extract:\e[0m\n");
         msgprintf(MSG_FORCE, "   fsarchiver restdir /data/linux-sources.fsa /tmp/extract\n");
+        msgprintf(MSG_FORCE, " * \e[1mrestore only /etc/fstab and the contents of /etc/ssh (faster when the archive has an index):\e[0m\n");
+        msgprintf(MSG_FORCE, "   fsarchiver restdir /data/myarchive.fsa /tmp/extract --only=/etc/fstab --only=/etc/ssh\n");
         msgprintf(MSG_FORCE, " * \e[1mshow information about an archive and its file systems:\e[0m\n");
         msgprintf(MSG_FORCE, "   fsarchiver archinfo /data/myarchive2.fsa\n");
     }
 }
 
+// options which only exist in the long form
+enum {LONGOPT_QUEUEMEM=256, LONGOPT_METRICSFD, LONGOPT_METRICSJSON, LONGOPT_LZ4, LONGOPT_HUGEPAGES, LONGOPT_DETECTINCOMP, LONGOPT_CHECKSUM, LONGOPT_BLKHASHES, LONGOPT_CIPHER, LONGOPT_INDEX, LONGOPT_ONLY};
+
 static struct option const long_options[] =
 {
     {"overwrite", no_argument, NULL, 'o'},
@@ -127,6 +161,8 @@ static struct option const long_options[] =
     {"verbose", no_argument, NULL, 'v'},
     {"debug", no_argument, NULL, 'd'},
     {"compress", required_argument, NULL, 'z'},
+    {"zstd", required_argument, NULL, 'Z'},
+    {"lz4", optional_argument, NULL, LONGOPT_LZ4},
     {"jobs", required_argument, NULL, 'j'},
     {"help", no_argument, NULL, 'h'},
     {"version", no_argument, NULL, 'V'},
@@ -134,6 +170,16 @@ static struct option const long_options[] =
     {"cryptpass", required_argument, NULL, 'c'},
     {"label", required_argument, NULL, 'L'},
     {"exclude", required_argument, NULL, 'e'},
+    {"queue-mem", required_argument, NULL, LONGOPT_QUEUEMEM},
+    {"hugepages", no_argument, NULL, LONGOPT_HUGEPAGES},
+    {"detect-incompressible", required_argument, NULL, LONGOPT_DETECTINCOMP},
+    {"checksum", required_argument, NULL, LONGOPT_CHECKSUM},
+    {"block-hashes", no_argument, NULL, LONGOPT_BLKHASHES},
+    {"index", no_argument, NULL, LONGOPT_INDEX},
+    {"only", required_argument, NULL, LONGOPT_ONLY},
+    {"cipher", required_argument, NULL, LONGOPT_CIPHER},
+    {"metrics-fd", required_argument, NULL, LONGOPT_METRICSFD},
+    {"metrics-json", required_argument, NULL, LONGOPT_METRICSJSON},
     {NULL, 0, NULL, 0}
 };
 
@@ -148,7 +194,10 @@ int process_cmdline(int argc, char **argv)
     char *archive=NULL;
     char tempbuf[1024];
     char *progname;
+    char *endptr;
+    long codeclevel;
     int fscount;
+    int cipher=ENCRYPT_NULL;
     int argcok;
     int ret=0;
     int cmd;
@@ -165,15 +214,24 @@ int process_cmdline(int argc, char **argv)
     g_options.verboselevel=0;
     g_options.debuglevel=0;
     g_options.compressjobs=1;
+    g_options.autojobs=false;
     g_options.fsacomplevel=3; // fsa level 3 = "gzip -6"
     g_options.compressalgo=FSA_DEF_COMPRESS_ALGO;
     g_options.compresslevel=FSA_DEF_COMPRESS_LEVEL; // default level for gzip
     g_options.datablocksize=FSA_DEF_BLKSIZE;
     g_options.encryptalgo=ENCRYPT_NONE;
+    g_options.queuemem=FSA_DEF_QUEUEMEM;
+    g_options.hugepages=false;
+    g_options.detectincomp=INCOMP_DETECT_BLOCKS;
+    g_options.checksumalgo=CHECKSUM_FLETCHER32;
+    g_options.blkhashes=false;
+    g_options.archindex=false;
+    g_options.metricsfd=-1;
+    g_options.metricspath[0]=0;
     snprintf(g_options.archlabel, sizeof(g_options.archlabel), "<none>");
     g_options.encryptpass[0]=0;
     
-    while ((c = getopt_long(argc, argv, "oaAvdz:j:hVs:c:L:e:", long_options, NULL)) != EOF)
+    while ((c = getopt_long(argc, argv, "oaAvdz:Z:j:hVs:c:L:e:", long_options, NULL)) != EOF)
     {
         switch (c)
         {
@@ -196,13 +254,22 @@ int process_cmdline(int argc, char **argv)
                 g_options.debuglevel++;
                 break;
             case 'j': // compression jobs
-                g_options.compressjobs=atoi(optarg);
-                if (g_options.compressjobs<1 || g_options.compressjobs>FSA_MAX_COMPJOBS)
+                g_options.autojobs=(strcmp(optarg, "auto")==0);
+                if (g_options.autojobs==true)
+                    g_options.compressjobs=cpuinfo_auto_jobs();
+                else
+                    g_options.compressjobs=atoi(optarg);
+                if (g_options.compressjobs<1)
                 {
-                    errprintf("[%s] is not a valid number of jobs. Must be between 1 and %d\n", optarg, FSA_MAX_COMPJOBS);
+                    errprintf("[%s] is not a valid number of jobs. Must be \"auto\" or a number greater than 0\n", optarg);
                     usage(progname, false);
                     return 1;
                 }
+                if (g_options.compressjobs > cpuinfo_max_jobs())
+                {   msgprintf(MSG_FORCE, "%d jobs is too many: using %d compression threads (four per cpu)\n",
+                        g_options.compressjobs, cpuinfo_max_jobs());
+                    g_options.compressjobs=cpuinfo_max_jobs();
+                }
                 break;
             case 'e': // exclude files/directories
                 strlist_add(&g_options.exclude, optarg);
@@ -234,6 +301,26 @@ int process_cmdline(int argc, char **argv)
                     msgprintf(MSG_FORCE, "Compression levels >= 8 may require a huge amount of memory\n"
                         "Please read the man page or \"http://www.fsarchiver.org/Compression\" for more details.\n");
                 break;
+            case 'Z': // zstd compression level
+                codeclevel=strtol(optarg, &endptr, 10);
+                if (*optarg==0 || *endptr!=0)
+                {   errprintf("[%s] is not a valid zstd compression level, it must be an integer.\n", optarg);
+                    usage(progname, false);
+                    return -1;
+                }
+                if (options_select_zstd_level((int)codeclevel)<0)
+                    return -1;
+                break;
+            case LONGOPT_LZ4: // lz4 compression level (fast lz4 by default)
+                codeclevel=(optarg!=NULL)?strtol(optarg, &endptr, 10):2;
+                if ((optarg!=NULL) && (*optarg==0 || *endptr!=0))
+                {   errprintf("[%s] is not a valid lz4 compression level, it must be an integer.\n", optarg);
+                    usage(progname, false);
+                    return -1;
+                }
+                if (options_select_lz4_level((int)codeclevel)<0)
+                    return -1;
+                break;
             case 'c': // encryption
                 g_options.encryptalgo=ENCRYPT_BLOWFISH;
                 if ((strlen(optarg)<FSA_MIN_PASSLEN || strlen(optarg)>FSA_MAX_PASSLEN) && strcmp(optarg, "-")!=0)
@@ -243,6 +330,78 @@ int process_cmdline(int argc, char **argv)
                 }
                 snprintf((char*)g_options.encryptpass, FSA_MAX_PASSLEN, "%s", optarg);
                 break;
+            case LONGOPT_QUEUEMEM: // memory budget of the queue
+                if (parse_size(optarg, &g_options.queuemem)!=0 || g_options.queuemem<FSA_MIN_QUEUEMEM)
+                {   errprintf("argument of option --queue-mem is invalid (%s). It must be a size such as 512M, at least %s\n",
+                        optarg, format_size(FSA_MIN_QUEUEMEM, tempbuf, sizeof(tempbuf), 'h'));
+                    usage(progname, false);
+                    return -1;
+                }
+                break;
+            case LONGOPT_HUGEPAGES: // use huge pages for the buffers of the data blocks
+                g_options.hugepages=true;
+                break;
+            case LONGOPT_DETECTINCOMP: // how to find the data which is not worth compressing
+                if (strcmp(optarg, "off")==0)
+                    g_options.detectincomp=INCOMP_DETECT_OFF;
+                else if (strcmp(optarg, "blocks")==0)
+                    g_options.detectincomp=INCOMP_DETECT_BLOCKS;
+                else if (strcmp(optarg, "files")==0)
+                    g_options.detectincomp=INCOMP_DETECT_FILES;
+                else
+                {   errprintf("argument of option --detect-incompressible is invalid (%s). It must be off, blocks or files\n", optarg);
+                    usage(progname, false);
+                    return -1;
+                }
+                break;
+            case LONGOPT_METRICSFD: // write metrics to a file descriptor opened by the caller
+                g_options.metricsfd=atoi(optarg);
+                if ((g_options.metricsfd<0) || (strspn(optarg, "0123456789")!=strlen(optarg)) || (fcntl(g_options.metricsfd, F_GETFD)<0))
+                {   errprintf("argument of option --metrics-fd is invalid (%s). It must be an open file descriptor\n", optarg);
+                    usage(progname, false);
+                    return -1;
+                }
+                break;
+            case LONGOPT_METRICSJSON: // write metrics to a file
+                snprintf(g_options.metricspath, sizeof(g_options.metricspath), "%s", optarg);
+                break;
+            case LONGOPT_CHECKSUM: // checksum of the blocks and headers of the archive
+                for (g_options.checksumalgo=CHECKSUM_FLETCHER32; (g_options.checksumalgo<=CHECKSUM_XXH3) &&
+                    (strcmp(optarg, sumalgostr(g_options.checksumalgo))!=0); g_options.checksumalgo++);
+                if (g_options.checksumalgo>CHECKSUM_XXH3)
+                {   errprintf("argument of option --checksum is invalid (%s). It must be fletcher32, crc32c or xxh3\n", optarg);
+                    usage(progname, false);
+                    return -1;
+                }
+                if (checksum_supported(g_options.checksumalgo)==false)
+                {   errprintf("the support for %s checksums has not been enabled at compilation time\n", optarg);
+                    return -1;
+                }
+                break;
+            case LONGOPT_CIPHER: // encryption algorithm used when a password is given
+                if (strcmp(optarg, "auto")==0)
+                    cipher=crypto_auto_algo();
+                else
+                    for (cipher=ENCRYPT_BLOWFISH; (cipher<=ENCRYPT_CHACHA20) && (strcmp(optarg, cryptalgostr(cipher))!=0); cipher++);
+                if (cipher>ENCRYPT_CHACHA20)
+                {   errprintf("argument of option --cipher is invalid (%s). It must be blowfish, aes256-gcm, chacha20-poly1305 or auto\n", optarg);
+                    usage(progname, false);
+                    return -1;
+                }
+                if (crypto_supported(cipher)==false)
+                {   errprintf("the version of libgcrypt used by fsarchiver does not support %s\n", cryptalgostr(cipher));
+                    return -1;
+                }
+                break;
+            case LONGOPT_BLKHASHES: // hash the blocks in the compression threads instead of the md5 of each file
+                g_options.blkhashes=true;
+                break;
+            case LONGOPT_INDEX: // write the positions of the filesystems and of the files at the end of the archive
+                g_options.archindex=true;
+                break;
+            case LONGOPT_ONLY: // restore only the files/directories that match that pattern
+                strlist_add(&g_options.only, optarg);
+                break;
             case 'L': // archive label
                 snprintf(g_options.archlabel, sizeof(g_options.archlabel), "%s", optarg);
                 break;
@@ -255,6 +414,10 @@ int process_cmdline(int argc, char **argv)
         }
     }
     
+    // -c uses blowfish unless another algorithm has been selected
+    if ((g_options.encryptalgo!=ENCRYPT_NONE) && (cipher!=ENCRYPT_NULL))
+        g_options.encryptalgo=cipher;
+    
     argc -= optind;
     argv += optind;
     
@@ -269,6 +432,13 @@ int process_cmdline(int argc, char **argv)
         command=*argv++, argc--;
     }
     
+    // the blocks of data and the headers which wait in the queue must fit in that amount of memory
+    queue_set_memory_limit(&g_queue, g_options.queuemem);
+    msgprintf(MSG_DEBUG1, "Memory budget for the queue: %s\n", format_size(g_options.queuemem, tempbuf, sizeof(tempbuf), 'h'));
+    
+    // the buffers of the data blocks are recycled instead of being allocated for each block
+    bufpool_init(g_options.hugepages);
+    
     // calculate threshold for small files that are compressed together
     g_options.smallfilethresh=min(g_options.datablocksize/4, FSA_MAX_SMALLFILESIZE);
     msgprintf(MSG_DEBUG1, "Files smaller than %ld will be packed with other small files\n", (long)g_options.smallfilethresh);
@@ -317,6 +487,20 @@ int process_cmdline(int argc, char **argv)
         return -1;
     }
     
+    // the files can only be selected when they are restored
+    if ((strlist_count(&g_options.only)>0) && (cmd!=OPER_RESTFS) && (cmd!=OPER_RESTDIR))
+    {   errprintf("option --only can only be used with restfs and restdir.\n");
+        usage(progname, false);
+        return -1;
+    }
+    
+    // the metrics have a single destination
+    if ((g_options.metricsfd>=0) && (g_options.metricspath[0]))
+    {   errprintf("options --metrics-fd and --metrics-json cannot be used together.\n");
+        usage(progname, false);
+        return -1;
+    }
+    
     // check if must be run as root
     if (runasroot==true && geteuid()!=0)
     {   errprintf("\"fsarchiver %s\" must be run as root. cannot continue.\n", command);
@@ -436,13 +620,14 @@ int main(int argc, char **argv)
     
     // init
     options_init();
-    queue_init(&g_queue, FSA_MAX_QUEUESIZE);
+    queue_init(&g_queue, FSA_DEF_QUEUEMEM);
     
     // bulk of the program
     ret=process_cmdline(argc, argv);
 
     // cleanup
     queue_destroy(&g_queue);
+    bufpool_destroy();
     options_destroy();
     
     // cleanup libgcrypt
@@ -40,11 +40,12 @@ enum {ARCHTYPE_NULL=0, ARCHTYPE_FILESYSTEMS, ARCHTYPE_DIRECTORIES};
 
 // ----------------------------------- volume header and footer -------------------------------------
 enum {VOLUMEHEADKEY_VOLNUM, VOLUMEHEADKEY_ARCHID, VOLUMEHEADKEY_FILEFORMATVER, VOLUMEHEADKEY_PROGVERCREAT};
-enum {VOLUMEFOOTKEY_VOLNUM, VOLUMEFOOTKEY_ARCHID, VOLUMEFOOTKEY_LASTVOL};
+enum {VOLUMEFOOTKEY_VOLNUM, VOLUMEFOOTKEY_ARCHID, VOLUMEFOOTKEY_LASTVOL, VOLUMEFOOTKEY_INDEXVOL, VOLUMEFOOTKEY_INDEXOFFSET};
 
 // ----------------------------------- algorithms used to process data-------------------------------
-enum {COMPRESS_NULL=0, COMPRESS_NONE, COMPRESS_LZO, COMPRESS_GZIP, COMPRESS_BZIP2, COMPRESS_LZMA};
-enum {ENCRYPT_NULL=0, ENCRYPT_NONE, ENCRYPT_BLOWFISH};
+enum {COMPRESS_NULL=0, COMPRESS_NONE, COMPRESS_LZO, COMPRESS_GZIP, COMPRESS_BZIP2, COMPRESS_LZMA, COMPRESS_ZSTD, COMPRESS_LZ4};
+enum {ENCRYPT_NULL=0, ENCRYPT_NONE, ENCRYPT_BLOWFISH, ENCRYPT_AES256GCM, ENCRYPT_CHACHA20};
+enum {CHECKSUM_NULL=0, CHECKSUM_FLETCHER32, CHECKSUM_CRC32C, CHECKSUM_XXH3};
 
 // ----------------------------------- dico keys ----------------------------------------------------
 enum {OBJTYPE_NULL=0, OBJTYPE_DIR, OBJTYPE_SYMLINK, OBJTYPE_HARDLINK, OBJTYPE_CHARDEV, 
@@ -58,15 +59,17 @@ enum {DISKITEMKEY_NULL=0, DISKITEMKEY_OBJECTID, DISKITEMKEY_PATH, DISKITEMKEY_OB
 
 enum {BLOCKHEADITEMKEY_NULL=0, BLOCKHEADITEMKEY_REALSIZE, BLOCKHEADITEMKEY_BLOCKOFFSET, 
       BLOCKHEADITEMKEY_COMPRESSALGO, BLOCKHEADITEMKEY_ENCRYPTALGO, BLOCKHEADITEMKEY_ARSIZE, 
-      BLOCKHEADITEMKEY_COMPSIZE, BLOCKHEADITEMKEY_ARCSUM};
+      BLOCKHEADITEMKEY_COMPSIZE, BLOCKHEADITEMKEY_ARCSUM, BLOCKHEADITEMKEY_ARCSUMALGO,
+      BLOCKHEADITEMKEY_ARCSUM64, BLOCKHEADITEMKEY_BLKHASH};
 
-enum {BLOCKFOOTITEMKEY_NULL=0, BLOCKFOOTITEMKEY_MD5SUM};
+enum {BLOCKFOOTITEMKEY_NULL=0, BLOCKFOOTITEMKEY_MD5SUM, BLOCKFOOTITEMKEY_BLKHASHES};
 
 enum {MAINHEADKEY_NULL=0, MAINHEADKEY_FILEFORMATVER, MAINHEADKEY_PROGVERCREAT, MAINHEADKEY_ARCHIVEID, 
       MAINHEADKEY_CREATTIME, MAINHEADKEY_ARCHLABEL, MAINHEADKEY_ARCHTYPE, MAINHEADKEY_FSCOUNT, 
       MAINHEADKEY_COMPRESSALGO, MAINHEADKEY_COMPRESSLEVEL, MAINHEADKEY_ENCRYPTALGO, 
       MAINHEADKEY_BUFCHECKPASSCLEARMD5, MAINHEADKEY_BUFCHECKPASSCRYPTBUF, MAINHEADKEY_FSACOMPLEVEL,
-      MAINHEADKEY_MINFSAVERSION, MAINHEADKEY_HASDIRSINFOHEAD};
+      MAINHEADKEY_MINFSAVERSION, MAINHEADKEY_HASDIRSINFOHEAD, MAINHEADKEY_CHECKSUMALGO,
+      MAINHEADKEY_HASBLKHASHES, MAINHEADKEY_KDFSALT, MAINHEADKEY_KDFITERATIONS};
 
 enum {FSYSHEADKEY_NULL=0, FSYSHEADKEY_FILESYSTEM, FSYSHEADKEY_MNTPATH, FSYSHEADKEY_BYTESTOTAL, 
       FSYSHEADKEY_BYTESUSED, FSYSHEADKEY_FSLABEL, FSYSHEADKEY_FSUUID, FSYSHEADKEY_FSINODESIZE, 
@@ -82,6 +85,8 @@ enum {FSYSHEADKEY_NULL=0, FSYSHEADKEY_FILESYSTEM, FSYSHEADKEY_MNTPATH, FSYSHEADK
 
 enum {DIRSINFOKEY_NULL=0, DIRSINFOKEY_TOTALCOST};
 
+enum {INDEXKEY_NULL=0, INDEXKEY_FSPOS, INDEXKEY_ENTRYCOUNT, INDEXKEY_ENTRIES};
+
 // -------------------------------- fsarchiver errors ---------------------------------------------
 enum {FSAERR_SUCCESS=0,           // success
       FSAERR_UNKNOWN=-1,          // uknown error (default code that means error)
@@ -116,10 +121,12 @@ enum {OLDERR_FATAL=1,
 #define FSA_MAX_BLKDEVICES       256
 
 #define FSA_MAX_FSPERARCH        128
-#define FSA_MAX_COMPJOBS         32
-#define FSA_MAX_QUEUESIZE        32
+#define FSA_DEF_QUEUEMEM         (32LL*FSA_DEF_BLKSIZE) // default memory budget for the queue: what the 32 blocks of the old queue used
+#define FSA_MIN_QUEUEMEM         (4LL*1024LL*1024LL)
+#define FSA_MAX_COMPBATCH        4              // how many blocks a compression thread can claim from the queue at once
 #define FSA_MAX_BLKSIZE          921600
 #define FSA_DEF_BLKSIZE          262144
+#define FSA_BLKHASH_SIZE         32             // sha256 of the contents of a block (archives created with --block-hashes)
 #define FSA_DEF_COMPRESS_ALGO    COMPRESS_GZIP  // compress using gzip by default
 #define FSA_DEF_COMPRESS_LEVEL   6              // compress with "gzip -6" by default
 #define FSA_MAX_SMALLFILECOUNT   512            // there can be up to FSA_MAX_SMALLFILECOUNT files copied in a single data block 
@@ -147,6 +154,7 @@ enum {OLDERR_FATAL=1,
 #define FSA_MAGIC_BLKH           "BlKh" // datablk header (one per data block, each regfile may have [0-n])
 #define FSA_MAGIC_FILF           "FiLf" // filedat footer (one per regfile, after the list of data blocks)
 #define FSA_MAGIC_DATF           "DaEn" // data footer (one per file system, at the end of its contents, or after the contents of the flatfiles)
+#define FSA_MAGIC_INDX           "InDx" // archive index (optional, before the footer of the last volume which says where it starts)
 
 // ------------ global variables ---------------------------
 extern char *valid_magic[];
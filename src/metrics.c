@@ -0,0 +1,308 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include "fsarchiver.h"
+#include "metrics.h"
+#include "options.h"
+#include "common.h"
+#include "pipestats.h"
+#include "thread_comp.h"
+#include "queue.h"
+#include "syncthread.h"
+#include "error.h"
+
+// the metrics thread writes one json record per line so that it can be parsed while the program runs
+struct s_metrics
+{   pthread_t        thread;
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+    bool             stop; // set by metrics_stop(): write the final record and exit
+    int              fd; // where the records are written
+    bool             closefd; // true if the file has been opened by fsarchiver
+    char             *oper; // name of the operation (savefs, restdir, ...)
+    u64              *costcurrent; // progress of the operation (same unit as costglobal)
+    u64              *costglobal;
+    struct s_stats   *stats; // statistics of the current filesystem
+    u64              filesdone; // files of the filesystems which have already been processed
+    u32              *curvol; // current volume of the archive
+    int              poolsize; // how many compression threads there are
+    u64              *lastbusy; // cpu time used by each compression thread at the previous record
+    u64              *busy;
+    int              compcount; // compression threads in the last snapshot of their cpu time
+    int              compactive;
+    bool             compdone; // the compression threads are gone: the final record uses the last snapshot
+    u64              lasttime; // time of the previous record
+    u64              starttime;
+};
+
+typedef struct s_metrics cmetrics;
+
+cmetrics g_metrics={.thread=0, .mutex=PTHREAD_MUTEX_INITIALIZER, .cond=PTHREAD_COND_INITIALIZER, .fd=-1};
+
+// write the whole buffer (the descriptor can be a pipe)
+int metrics_write(int fd, char *buf, int len)
+{
+    int res;
+    
+    while (len > 0)
+    {
+        if ((res=write(fd, buf, len))<0)
+        {   if (errno==EINTR)
+                continue;
+            return -1;
+        }
+        buf+=res;
+        len-=res;
+    }
+    
+    return 0;
+}
+
+static u64 metrics_count_files(struct s_stats *stats)
+{
+    return stats->cnt_regfile+stats->cnt_dir+stats->cnt_symlink+stats->cnt_hardlink+stats->cnt_special;
+}
+
+// append text to the record being formatted
+#define METRICS_APPEND(...) pos+=snprintf(buf+pos, (pos<bufsize)?(bufsize-pos):0, __VA_ARGS__)
+
+int metrics_write_record(cmetrics *m, bool final)
+{
+    u64 uncompressed=0;
+    u64 compressed=0;
+    u64 now, elapsed, interval;
+    u64 costcurrent;
+    u64 costglobal;
+    u64 bytesread;
+    u64 files;
+    int bufsize;
+    int count;
+    int active;
+    int pos=0;
+    char *buf;
+    int res;
+    int i;
+    
+    now=get_time_usec();
+    elapsed=max(now-m->starttime, 1);
+    interval=max(now-m->lasttime, 1);
+    
+    // these counters are updated by other threads: a record can be slightly inconsistent
+    for (i=0; i < PIPESTATS_MAXCODECS; i++)
+    {   uncompressed+=g_pipestats.codec[i].realbytes;
+        compressed+=g_pipestats.codec[i].compbytes;
+    }
+    assert(pthread_mutex_lock(&m->mutex)==0);
+    files=m->filesdone+metrics_count_files(m->stats);
+    if (m->compdone==false)
+        m->compcount=thread_comp_get_busy(m->busy, m->poolsize, &m->compactive);
+    count=m->compcount;
+    active=m->compactive;
+    assert(pthread_mutex_unlock(&m->mutex)==0);
+    costcurrent=*m->costcurrent;
+    costglobal=*m->costglobal;
+    // when saving, the cost is counted when a file is read: don't count the data which is still in the queue
+    bytesread=g_pipestats.stage[PIPESTATS_READ].bytes;
+    if ((g_pipestats.restore==false) && (bytesread > uncompressed))
+        costcurrent-=min(bytesread-uncompressed, costcurrent);
+    
+    bufsize=1024+24*m->poolsize;
+    if ((buf=malloc(bufsize))==NULL)
+    {   errprintf("malloc(%d) failed: out of memory\n", bufsize);
+        return -1;
+    }
+    
+    METRICS_APPEND("{\"type\":\"%s\",\"oper\":\"%s\",\"elapsed\":%.3f", (final)?"final":"progress", m->oper, ((double)elapsed)/1000000.0);
+    METRICS_APPEND(",\"bytes_read\":%llu,\"bytes_written\":%llu", (unsigned long long)bytesread,
+        (unsigned long long)g_pipestats.stage[PIPESTATS_WRITE].bytes);
+    METRICS_APPEND(",\"bytes_uncompressed\":%llu,\"bytes_compressed\":%llu", (unsigned long long)uncompressed, (unsigned long long)compressed);
+    METRICS_APPEND(",\"files\":%llu,\"files_per_sec\":%.1f", (unsigned long long)files, ((double)files)*1000000.0/((double)elapsed));
+    METRICS_APPEND(",\"queue_items\":%lld,\"queue_todo\":%lld", (long long)queue_count(&g_queue), (long long)queue_count_items_todo(&g_queue));
+    METRICS_APPEND(",\"comp_threads\":%d,\"comp_active\":%d,\"comp_busy_pct\":[", count, active);
+    for (i=0; i < count; i++)
+    {   METRICS_APPEND("%s%.1f", (i>0)?",":"", ((double)(m->busy[i]-m->lastbusy[i]))*100.0/((double)interval));
+        m->lastbusy[i]=m->busy[i];
+    }
+    METRICS_APPEND("],\"volume\":%ld", (long)*m->curvol);
+    if ((costglobal>0) && (costcurrent>0) && (costcurrent<=costglobal))
+        METRICS_APPEND(",\"progress_pct\":%.1f,\"eta_sec\":%.1f", ((double)costcurrent)*100.0/((double)costglobal),
+            ((double)elapsed)/1000000.0*((double)(costglobal-costcurrent))/((double)costcurrent));
+    else // the total cost is not known yet
+        METRICS_APPEND(",\"progress_pct\":null,\"eta_sec\":null");
+    METRICS_APPEND("}\n");
+    m->lasttime=now;
+    
+    res=metrics_write(m->fd, buf, min(pos, bufsize-1));
+    free(buf);
+    return res;
+}
+
+void *thread_metrics_fct(void *args)
+{
+    struct timespec deadline;
+    struct timeval tv;
+    sigset_t mask;
+    cmetrics *m=(cmetrics *)args;
+    bool stop=false;
+    
+    // a closed pipe must not terminate the program: write() returns EPIPE instead
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    
+    while (stop==false)
+    {
+        gettimeofday(&tv, NULL);
+        deadline.tv_sec=tv.tv_sec + (tv.tv_usec/1000 + METRICS_INTERVAL_MSEC) / 1000;
+        deadline.tv_nsec=((tv.tv_usec/1000 + METRICS_INTERVAL_MSEC) % 1000) * 1000000;
+        assert(pthread_mutex_lock(&m->mutex)==0);
+        while ((m->stop==false) && (pthread_cond_timedwait(&m->cond, &m->mutex, &deadline)!=ETIMEDOUT));
+        stop=m->stop;
+        assert(pthread_mutex_unlock(&m->mutex)==0);
+        
+        if (metrics_write_record(m, stop)!=0)
+        {   sysprintf("cannot write metrics: the metrics will not be written any more\n");
+            break;
+        }
+    }
+    
+    return NULL;
+}
+
+// start writing metrics if it has been requested on the command line
+int metrics_start(char *oper, u64 *costcurrent, u64 *costglobal, struct s_stats *stats, u32 *curvol)
+{
+    cmetrics *m=&g_metrics;
+    
+    if (g_options.metricspath[0])
+    {   if ((m->fd=open64(g_options.metricspath, O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE, 0644))<0)
+        {   sysprintf("cannot open %s to write the metrics\n", g_options.metricspath);
+            return -1;
+        }
+        m->closefd=true;
+    }
+    else if (g_options.metricsfd>=0)
+    {   m->fd=g_options.metricsfd;
+        m->closefd=false;
+    }
+    else // metrics not requested
+    {   return 0;
+    }
+    
+    m->stop=false;
+    m->filesdone=0;
+    m->oper=oper;
+    m->costcurrent=costcurrent;
+    m->costglobal=costglobal;
+    m->stats=stats;
+    m->curvol=curvol;
+    m->poolsize=max(g_options.compressjobs, 1);
+    m->compcount=0;
+    m->compactive=0;
+    m->compdone=false;
+    m->lastbusy=calloc(m->poolsize, sizeof(u64));
+    m->busy=calloc(m->poolsize, sizeof(u64));
+    if (!m->lastbusy || !m->busy)
+    {   errprintf("calloc(%d) failed: out of memory\n", m->poolsize);
+        metrics_stop();
+        return -1;
+    }
+    m->starttime=get_time_usec();
+    m->lasttime=m->starttime;
+    
+    if (pthread_create(&m->thread, NULL, thread_metrics_fct, m) != 0)
+    {   errprintf("pthread_create(thread_metrics_fct) failed\n");
+        m->thread=0;
+        metrics_stop();
+        return -1;
+    }
+    
+    return 0;
+}
+
+// the statistics are shown for each filesystem: reset them but keep counting the files in the metrics
+int metrics_reset_stats(struct s_stats *stats)
+{
+    cmetrics *m=&g_metrics;
+    
+    assert(pthread_mutex_lock(&m->mutex)==0);
+    if (stats==m->stats)
+        m->filesdone+=metrics_count_files(stats);
+    memset(stats, 0, sizeof(struct s_stats));
+    assert(pthread_mutex_unlock(&m->mutex)==0);
+    
+    return 0;
+}
+
+// keep the cpu time of the compression threads for the final record: must be called before thread_comp_join()
+int metrics_comp_done()
+{
+    cmetrics *m=&g_metrics;
+    
+    if (m->thread)
+    {
+        assert(pthread_mutex_lock(&m->mutex)==0);
+        if (m->compdone==false)
+            m->compcount=thread_comp_get_busy(m->busy, m->poolsize, &m->compactive);
+        m->compdone=true;
+        assert(pthread_mutex_unlock(&m->mutex)==0);
+    }
+    
+    return 0;
+}
+
+// write the final record and stop the metrics thread
+int metrics_stop()
+{
+    cmetrics *m=&g_metrics;
+    
+    if (m->thread)
+    {
+        assert(pthread_mutex_lock(&m->mutex)==0);
+        m->stop=true;
+        pthread_cond_broadcast(&m->cond);
+        assert(pthread_mutex_unlock(&m->mutex)==0);
+        if (pthread_join(m->thread, NULL) != 0)
+            errprintf("pthread_join(thread_metrics) failed\n");
+        m->thread=0;
+    }
+    
+    if ((m->fd>=0) && (m->closefd==true))
+        close(m->fd);
+    m->fd=-1;
+    free(m->lastbusy);
+    free(m->busy);
+    m->lastbusy=NULL;
+    m->busy=NULL;
+    
+    return 0;
+}
@@ -0,0 +1,30 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#define METRICS_INTERVAL_MSEC  1000 // a record is written every second
+
+struct s_stats;
+
+int metrics_start(char *oper, u64 *costcurrent, u64 *costglobal, struct s_stats *stats, u32 *curvol);
+int metrics_stop();
+int metrics_comp_done();
+int metrics_reset_stats(struct s_stats *stats);
+
+#endif // __METRICS_H__
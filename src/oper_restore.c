@@ -46,13 +46,19 @@
 #include "fs_jfs.h"
 #include "fs_ntfs.h"
 #include "thread_comp.h"
+#include "thread_hash.h"
+#include "blkhash.h"
+#include "cpuinfo.h"
 #include "thread_archio.h"
 #include "syncthread.h"
 #include "regmulti.h"
 #include "crypto.h"
 #include "error.h"
+#include "pipestats.h"
+#include "metrics.h"
 #include "datafile.h"
 #include "queue.h"
+#include "bufpool.h"
 
 typedef struct s_extractar
 {   carchreader ai;
@@ -62,44 +68,28 @@ typedef struct s_extractar
     u64         cost_current;
 } cextractar;
 
-// returns true if this file of a parent directory has been excluded
-int is_filedir_excluded(char *relpath)
+// with --only everything which is not selected is left out of the restoration
+int is_filedir_unselected(char *relpath)
 {
-    char dirpath[PATH_MAX];
-    char basename[PATH_MAX];
-    int pos;
-    
-    // check if that particular file has been excluded
-    extract_basename(relpath, basename, sizeof(basename));
-    
-    if ((exclude_check(&g_options.exclude, basename)==true) // is filename excluded ?
-        || (exclude_check(&g_options.exclude, relpath)==true)) // is filepath excluded ?
+    if ((strlist_count(&g_options.only)>0) && (pathlist_check(&g_options.only, relpath)==false))
     {
-        msgprintf(MSG_VERB2, "file/dir=[%s] excluded because of its own name/path\n", relpath);
+        msgprintf(MSG_VERB2, "file/dir=[%s] excluded because it is not selected by --only\n", relpath);
         return true;
     }
+    return false;
+}
+
+// returns true if this file of a parent directory has been excluded
+int is_filedir_excluded(char *relpath)
+{
+    if (is_filedir_unselected(relpath)==true)
+        return true;
     
-    // check if that file belongs to a directory which has been excluded
-    snprintf(dirpath, sizeof(dirpath), "%s", relpath);
-    for (pos=0; dirpath[pos]; pos++); // go to the end of the string
-    while (pos>0)
+    // same rules as --only: the name or path of the file or of one of its parent directories
+    if (pathlist_check(&g_options.exclude, relpath)==true)
     {
-        // dirpath=parent_directory(dirpath)
-        while ((pos>=0) && (dirpath[pos]!='/'))
-            dirpath[pos--]=0;
-        if ((pos>0) && (dirpath[pos]=='/'))
-            dirpath[pos]=0;
-        extract_basename(dirpath, basename, sizeof(basename));
-        
-        if (strlen(dirpath)>1 && strlen(basename)>0)
-        {
-            if ((exclude_check(&g_options.exclude, basename)==true)
-                || (exclude_check(&g_options.exclude, dirpath)==true))
-            {
-                msgprintf(MSG_VERB2, "file/dir=[%s] excluded because of its parent=[%s]\n", relpath, dirpath);
-                return true; // a parent directory is excluded
-            }
-        }
+        msgprintf(MSG_VERB2, "file/dir=[%s] excluded because of its name/path or the name/path of a parent\n", relpath);
+        return true;
     }
     
     return false; // no exclusion found for that file
@@ -345,6 +335,12 @@ int extractar_restore_obj_symlink(cextractar *exar, char *fullpath, char *relpat
     // update cost statistics and progress bar
     exar->cost_current+=FSA_COST_PER_FILE; 
     
+    // the objects which are not selected by --only are not an error
+    if (is_filedir_unselected(relpath)==true)
+    {   dico_destroy(d);
+        return 0;
+    }
+    
     // check the list of excluded files/dirs
     if (is_filedir_excluded(relpath)==true)
         goto extractar_restore_obj_symlink_err;
@@ -433,6 +429,12 @@ int extractar_restore_obj_hardlink(cextractar *exar, char *fullpath, char *relpa
     // update cost statistics and progress bar
     exar->cost_current+=FSA_COST_PER_FILE; 
     
+    // the objects which are not selected by --only are not an error
+    if (is_filedir_unselected(relpath)==true)
+    {   dico_destroy(d);
+        return 0;
+    }
+    
     // check the list of excluded files/dirs
     if (is_filedir_excluded(relpath)==true)
         goto extractar_restore_obj_hardlink_err;
@@ -490,6 +492,12 @@ int extractar_restore_obj_devfile(cextractar *exar, char *fullpath, char *relpat
     // update cost statistics and progress bar
     exar->cost_current+=FSA_COST_PER_FILE; 
     
+    // the objects which are not selected by --only are not an error
+    if (is_filedir_unselected(relpath)==true)
+    {   dico_destroy(d);
+        return 0;
+    }
+    
     // check the list of excluded files/dirs
     if (is_filedir_excluded(relpath)==true)
         goto extractar_restore_obj_devfile_err;
@@ -541,6 +549,12 @@ int extractar_restore_obj_directory(cextractar *exar, char *fullpath, char *relp
     // update cost statistics and progress bar
     exar->cost_current+=FSA_COST_PER_FILE; 
     
+    // the objects which are not selected by --only are not an error
+    if (is_filedir_unselected(relpath)==true)
+    {   dico_destroy(d);
+        return 0;
+    }
+    
     // check the list of excluded files/dirs
     if (is_filedir_excluded(relpath)==true)
         goto extractar_restore_obj_directory_err;
@@ -644,7 +658,7 @@ int extractar_restore_obj_regfile_multi(cextractar *exar, char *destdir, cdico *
     {   errprintf("regmulti_rest_setdatablock() failed\n");
         return -1;
     }
-    free(blkinfo.blkdata); // free memory allocated by the thread_io_reader
+    bufpool_free(blkinfo.blkdata); // release the buffer of the block read by the thread_io_reader
     
     // ---- create the set of small files using the regmulti structure
     for (i=0; i < filescount; i++)
@@ -691,10 +705,10 @@ int extractar_restore_obj_regfile_multi(cextractar *exar, char *destdir, cdico *
                 goto extractar_restore_obj_regfile_multi_err;
             }
             
-            if (datafile_open_write(datafile, fullpath, false, false)<0)
+            if (datafile_open_write(datafile, fullpath, false, false, true)<0)
                 goto extractar_restore_obj_regfile_multi_err;
             
-            res=datafile_write(datafile, databuf, datsize);
+            res=datafile_write(datafile, databuf, datsize, false);
             
             datafile_close(datafile, md5sumcalc, sizeof(md5sumcalc));
             
@@ -747,6 +761,9 @@ int extractar_restore_obj_regfile_unique(cextractar *exar, char *fullpath, char
     bool minorerr=false; // error for current file only
     bool delfile=false;
     struct timeval tv[2];
+    cblkhashlist *blkhashlist=NULL;
+    u8 hashcalc[FSA_BLKHASH_SIZE];
+    u8 hashorig[FSA_BLKHASH_SIZE];
     u8 md5sumcalc[16];
     u8 md5sumorig[16];
     int excluded=false;
@@ -759,8 +776,15 @@ int extractar_restore_obj_regfile_unique(cextractar *exar, char *fullpath, char
     // init
     memset(&blkinfo, 0, sizeof(blkinfo));
     memset(magic, 0, sizeof(magic));
+    memset(hashcalc, 0, sizeof(hashcalc));
     datafile=datafile_alloc();
     
+    // the hashes of the blocks have been verified by the decompression threads: only the list has to be checked
+    if ((exar->ai.hasblkhashes==true) && ((blkhashlist=blkhashlist_alloc())==NULL))
+    {   errprintf("blkhashlist_alloc() failed\n");
+        minorerr=true;
+    }
+    
     if (dico_get_u64(d, DICO_OBJ_SECTION_STDATTR, DISKITEMKEY_SIZE, &filesize)!=0)
     {   errprintf("Cannot read filesize DISKITEMKEY_SIZE from archive for file=[%s]\n", relpath);
         minorerr=true;
@@ -790,7 +814,7 @@ int extractar_restore_obj_regfile_unique(cextractar *exar, char *fullpath, char
         extractar_listing_print_file(exar, objtype, relpath);
     }
     
-    if ((minorerr==false) && (datafile_open_write(datafile, fullpath, excluded, sparse)<0))
+    if ((minorerr==false) && (datafile_open_write(datafile, fullpath, excluded, sparse, (exar->ai.hasblkhashes==false))<0))
         minorerr=true;
     
     msgprintf(MSG_DEBUG2, "restore_obj_regfile_unique(file=%s, size=%lld)\n", relpath, (long long)filesize);
@@ -806,26 +830,34 @@ int extractar_restore_obj_regfile_unique(cextractar *exar, char *fullpath, char
         if (blkinfo.blkoffset!=filepos)
         {   errprintf("file offset do not match for file(%s) failed: filepos=%lld, blkinfo.blkoffset=%lld, blkinfo.blkrealsize=%lld\n", 
                 relpath, (long long)filepos, (long long)blkinfo.blkoffset, (long long)blkinfo.blkrealsize);
-            free(blkinfo.blkdata);
+            bufpool_free(blkinfo.blkdata);
             delfile=true;
             minorerr=true;
             break;
         }
         
-        if (datafile_write(datafile, blkinfo.blkdata, blkinfo.blkrealsize)!=FSAERR_SUCCESS)
-        {   free(blkinfo.blkdata);
+        if (blkhashlist!=NULL) // blocks without a hash have a zero blkhash which makes the file corrupt
+            blkhashlist_append(blkhashlist, blkinfo.blkhash);
+        
+        if (datafile_write(datafile, blkinfo.blkdata, blkinfo.blkrealsize, true)!=FSAERR_SUCCESS)
+        {   bufpool_free(blkinfo.blkdata);
             delfile=true;
             minorerr=true;
             fatalerr=true;
             break;
         }
         
-        free(blkinfo.blkdata);
+        bufpool_free(blkinfo.blkdata);
     }
     
     if ((minorerr==false) && (datafile_close(datafile, md5sumcalc, sizeof(md5sumcalc))!=0))
         minorerr=true;
     
+    if (blkhashlist!=NULL)
+    {   blkhashlist_final(blkhashlist, hashcalc, sizeof(hashcalc));
+        blkhashlist=NULL;
+    }
+    
     if ((minorerr==false) && (excluded==false))
     {
         if (extractar_restore_attr_everything(exar, objtype, fullpath, relpath, d)!=0)
@@ -857,13 +889,25 @@ int extractar_restore_obj_regfile_unique(cextractar *exar, char *fullpath, char
                 goto restore_obj_regfile_unique_end;
             }
             
-            if (dico_get_data(footerdico, 0, BLOCKFOOTITEMKEY_MD5SUM, md5sumorig, 16, NULL))
-            {   errprintf("cannot get md5sum from file footer for file=[%s]\n", relpath);
-                minorerr=true;
-                goto restore_obj_regfile_unique_end;
+            if (exar->ai.hasblkhashes==true)
+            {
+                if (dico_get_data(footerdico, 0, BLOCKFOOTITEMKEY_BLKHASHES, hashorig, FSA_BLKHASH_SIZE, NULL))
+                {   errprintf("cannot get the hash of the blocks from file footer for file=[%s]\n", relpath);
+                    minorerr=true;
+                    goto restore_obj_regfile_unique_end;
+                }
+            }
+            else
+            {
+                if (dico_get_data(footerdico, 0, BLOCKFOOTITEMKEY_MD5SUM, md5sumorig, 16, NULL))
+                {   errprintf("cannot get md5sum from file footer for file=[%s]\n", relpath);
+                    minorerr=true;
+                    goto restore_obj_regfile_unique_end;
+                }
             }
             
-            if (memcmp(md5sumcalc, md5sumorig, 16)!=0)
+            if (((exar->ai.hasblkhashes==true) && (memcmp(hashcalc, hashorig, FSA_BLKHASH_SIZE)!=0)) ||
+                ((exar->ai.hasblkhashes==false) && (memcmp(md5sumcalc, md5sumorig, 16)!=0)))
             {   errprintf("cannot restore file %s, file is corrupt\n", relpath);
                 delfile=true; // don't leave corrupt data in the file
                 minorerr=true;
@@ -889,6 +933,8 @@ restore_obj_regfile_unique_end:
     if (get_interrupted()==true)
         errprintf("operation has been interrupted\n");
 
+    if (blkhashlist!=NULL)
+        blkhashlist_final(blkhashlist, NULL, 0);
     dico_destroy(footerdico);
     dico_destroy(d);
     datafile_destroy(datafile);
@@ -1039,14 +1085,15 @@ int extractar_extract_read_objects(cextractar *exar, int *errors, char *destdir,
 
 int extractar_read_mainhead(cextractar *exar, cdico **dicomainhead)
 {
-    u8 bufcheckclear[FSA_CHECKPASSBUF_SIZE+8];
-    u8 bufcheckcrypt[FSA_CHECKPASSBUF_SIZE+8];
+    u8 bufcheckclear[FSA_CHECKPASSBUF_SIZE+CRYPTO_AEAD_OVERHEAD];
+    u8 bufcheckcrypt[FSA_CHECKPASSBUF_SIZE+CRYPTO_AEAD_OVERHEAD];
     char magic[FSA_SIZEOF_MAGIC+1];
     u16 cryptbufsize;
     u8 md5sumar[16];
     u8 md5sumnew[16];
     u64 clearsize;
     int passlen;
+    int res;
     u32 temp32;
     
     assert(exar);
@@ -1124,6 +1171,10 @@ int extractar_read_mainhead(cextractar *exar, cdico **dicomainhead)
     if (dico_get_u32(*dicomainhead, 0, MAINHEADKEY_HASDIRSINFOHEAD, &temp32)==0)
         exar->ai.hasdirsinfohead=temp32;
     
+    // MAINHEADKEY_HASBLKHASHES is only present when the archive has been created with --block-hashes
+    if (dico_get_u32(*dicomainhead, 0, MAINHEADKEY_HASBLKHASHES, &temp32)==0)
+        exar->ai.hasblkhashes=temp32;
+    
     // check the file format. New versions based on "FsArCh_002" also understand "FsArCh_001" which is very close (and "FsArCh_00Y"=="FsArCh_001")
     if (strcmp(exar->ai.filefmt, FSA_FILEFORMAT)!=0 && strcmp(exar->ai.filefmt, "FsArCh_00Y")!=0 && strcmp(exar->ai.filefmt, "FsArCh_001")!=0)
     {
@@ -1157,7 +1208,12 @@ int extractar_read_mainhead(cextractar *exar, cdico **dicomainhead)
             return -1;
         }
         
-        if (crypto_blowfish(cryptbufsize, &clearsize, bufcheckcrypt, bufcheckclear, g_options.encryptpass, strlen((char*)g_options.encryptpass), false)==0)
+        // the key of the authenticated ciphers has already been derived by the thread which reads the archive
+        if (exar->ai.cryptalgo==ENCRYPT_BLOWFISH)
+            res=crypto_blowfish(cryptbufsize, &clearsize, bufcheckcrypt, bufcheckclear, g_options.encryptpass, strlen((char*)g_options.encryptpass), false);
+        else
+            res=crypto_aead(exar->ai.cryptalgo, cryptbufsize, &clearsize, bufcheckcrypt, bufcheckclear, false);
+        if (res==0)
             gcry_md_hash_buffer(GCRY_MD_MD5, md5sumnew, bufcheckclear, clearsize);
         
         if (memcmp(md5sumar, md5sumnew, 16)!=0)
@@ -1325,7 +1381,6 @@ int oper_restore(char *archive, int argc, char **argv, int oper)
 {
     cdico *dicofsinfo[FSA_MAX_FSPERARCH];
     cstrdico *dicoargv[FSA_MAX_FSPERARCH];
-    pthread_t thread_decomp[FSA_MAX_COMPJOBS];
     char magic[FSA_SIZEOF_MAGIC+1];
     cdico *dicomainhead=NULL;
     cdico *dirsinfo=NULL;
@@ -1345,14 +1400,13 @@ int oper_restore(char *archive, int argc, char **argv, int oper)
     exar.cost_global=0;
     exar.cost_current=0;
     archreader_init(&exar.ai);
+    pipestats_init(true);
     
     // init misc data struct to zero
     for (i=0; i<FSA_MAX_FSPERARCH; i++)
         dicoargv[i]=NULL;
     for (i=0; i<FSA_MAX_FSPERARCH; i++)
         dicofsinfo[i]=NULL;
-    for (i=0; i<FSA_MAX_COMPJOBS; i++)
-        thread_decomp[i]=0;
     for (i=0; i<FSA_MAX_FSPERARCH; i++)
         g_fsbitmap[i]=0;
     thread_reader=0;
@@ -1380,20 +1434,26 @@ int oper_restore(char *archive, int argc, char **argv, int oper)
     }
 
     // create decompression threads
-    for (i=0; (i<g_options.compressjobs) && (i<FSA_MAX_COMPJOBS); i++)
-    {
-        if (pthread_create(&thread_decomp[i], NULL, thread_decomp_fct, NULL) != 0)
-        {   errprintf("pthread_create(thread_decomp_fct) failed\n");
-            goto do_extract_error;
-        }
+    if (thread_comp_start(COMPTHR_DECOMPRESS, g_options.compressjobs)!=0)
+    {   msgprintf(MSG_STACK, "thread_comp_start() failed\n");
+        goto do_extract_error;
+    }
+    
+    // create the thread which computes the md5 of the restored files
+    if (thread_hash_start()!=0)
+    {   msgprintf(MSG_STACK, "thread_hash_start() failed\n");
+        goto do_extract_error;
     }
     
     // create archive-reader thread
-    if (pthread_create(&thread_reader, NULL, thread_reader_fct, (void*)&exar.ai) != 0)
+    if (pthread_create(&thread_reader, cpuinfo_thread_attr(CPUINFO_SET_IO), thread_reader_fct, (void*)&exar.ai) != 0)
     {   errprintf("pthread_create(thread_reader_fct) failed\n");
         goto do_extract_error;
     }
     
+    if (oper!=OPER_ARCHINFO)
+        metrics_start((oper==OPER_RESTFS)?"restfs":"restdir", &exar.cost_current, &exar.cost_global, &exar.stats, &exar.ai.curvol);
+    
     // read archive main header
     if (extractar_read_mainhead(&exar, &dicomainhead)<0)
     {   msgprintf(MSG_STACK, "read_mainhead(%s) failed\n", archive);
@@ -1497,7 +1557,7 @@ int oper_restore(char *archive, int argc, char **argv, int oper)
     
     if ((oper==OPER_RESTFS) || (oper==OPER_RESTDIR))
     {
-        if ((exar.ai.cryptalgo!=ENCRYPT_NONE) && (g_options.encryptalgo!=ENCRYPT_BLOWFISH))
+        if ((exar.ai.cryptalgo!=ENCRYPT_NONE) && (g_options.encryptalgo==ENCRYPT_NONE))
         {   errprintf("this archive has been encrypted, you have to provide a password on the command line using option '-c'\n");
             goto do_extract_error;
         }
@@ -1510,7 +1570,7 @@ int oper_restore(char *archive, int argc, char **argv, int oper)
                 if (dicoargv[i]!=NULL) // that filesystem has been requested on the command line
                 {
                     exar.fsid=i;
-                    memset(&exar.stats, 0, sizeof(exar.stats)); // init stats to zero
+                    metrics_reset_stats(&exar.stats); // init stats to zero
                     msgprintf(MSG_VERB1, "============= extracting filesystem %d =============\n", i);
                     if (extractar_filesystem_extract(&exar, dicofsinfo[i], dicoargv[i])!=0)
                     {   msgprintf(MSG_STACK, "extract_filesystem(%d) failed\n", i);
@@ -1574,10 +1634,7 @@ do_extract_success:
     msgprintf(MSG_DEBUG1, "THREAD-MAIN2: exit\n");
     set_stopfillqueue(); // ask thread-archio to terminate
     msgprintf(MSG_DEBUG2, "queue_count_items_todo(&g_queue)=%d\n", (int)queue_count_items_todo(&g_queue));
-    while (queue_count_items_todo(&g_queue)>0) // let thread_compress process all the pending blocks
-    {   msgprintf(MSG_DEBUG2, "queue_count_items_todo(): %ld\n", (long)queue_count_items_todo(&g_queue));
-        usleep(10000);
-    }
+    queue_wait_no_items_todo(&g_queue); // let thread_compress process all the pending blocks
     msgprintf(MSG_DEBUG2, "queue_count_items_todo(&g_queue)=%d\n", (int)queue_count_items_todo(&g_queue));
     // now we are sure that thread_compress is not working on an item in the queue so we can empty the queue
     while (get_secthreads()>0 && queue_get_end_of_queue(&g_queue)==false)
@@ -1585,13 +1642,17 @@ do_extract_success:
     msgprintf(MSG_DEBUG1, "THREAD-MAIN2: queue is now empty\n");
     // the queue is empty, so thread_compress should now exit
     
-    for (i=0; (i<g_options.compressjobs) && (i<FSA_MAX_COMPJOBS); i++)
-        if (thread_decomp[i] && pthread_join(thread_decomp[i], NULL) != 0)
-            errprintf("pthread_join(thread_decomp) failed\n");
+    metrics_comp_done();
+    thread_comp_join();
+    thread_hash_join();
     
     if (thread_reader && pthread_join(thread_reader, NULL) != 0)
         errprintf("pthread_join(thread_reader) failed\n");
     
+    metrics_stop();
+    if (oper!=OPER_ARCHINFO)
+        pipestats_show();
+    
     for (i=0; i<FSA_MAX_FSPERARCH; i++)
         if (dicoargv[i]!=NULL)
             strdico_destroy(dicoargv[i]);
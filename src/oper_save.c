@@ -50,12 +50,19 @@
 #include "fs_btrfs.h"
 #include "fs_ntfs.h"
 #include "thread_comp.h"
+#include "thread_hash.h"
+#include "blkhash.h"
+#include "cpuinfo.h"
 #include "thread_archio.h"
 #include "syncthread.h"
 #include "regmulti.h"
 #include "crypto.h"
 #include "error.h"
+#include "pipestats.h"
+#include "metrics.h"
 #include "queue.h"
+#include "bufpool.h"
+#include "entropy.h"
 
 typedef struct s_savear
 {   carchwriter ai;
@@ -79,12 +86,12 @@ typedef struct s_devinfo
 int createar_obj_regfile_multi(csavear *save, cdico *header, char *relpath, char *fullpath, u64 filesize)
 {
     char databuf[FSA_MAX_SMALLFILESIZE];
-    u8 md5sum[16];
+    u64 start;
     int ret=0;
     int res;
     int fd;
     
-    // The checksum will be in the obj-header not in a file footer
+    // The checksum will be in the obj-header not in a file footer (it's added by regmulti_save_enqueue)
     if ((fd=open64(fullpath, O_RDONLY|O_LARGEFILE))<0)
     {   sysprintf("Cannot open small file %s for reading\n", relpath);
         return -1;
@@ -92,7 +99,9 @@ int createar_obj_regfile_multi(csavear *save, cdico *header, char *relpath, char
     
     msgprintf(MSG_DEBUG1, "backup_obj_regfile_multi(file=%s, size=%lld)\n", relpath, (long long)filesize);
     
+    start=pipestats_start();
     res=read(fd, databuf, (long)filesize);
+    pipestats_add(PIPESTATS_READ, start, max(res, 0));
     close(fd);
     if (res!=filesize)
     {   
@@ -108,9 +117,6 @@ int createar_obj_regfile_multi(csavear *save, cdico *header, char *relpath, char
         }
     }
     
-    gcry_md_hash_buffer(GCRY_MD_MD5, md5sum, databuf, filesize);
-    dico_add_data(header, 0, DISKITEMKEY_MD5SUM, md5sum, 16);
-    
     // if shared-block with many small files is full, push it to queue and make a new one
     if (regmulti_save_enough_space_for_new_file(&save->regmulti, filesize)==false)
     {
@@ -135,26 +141,34 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
 {
     cdico *footerdico=NULL;
     struct s_blockinfo blkinfo;
-    gcry_md_hd_t md5ctx;
+    centropyfile entropy;
+    cfilehash *filehash=NULL;
+    cblkhashlist *blkhashlist=NULL;
     u32 curblocksize;
     bool eof=false;
     u64 remaining;
-    char text[256];
     u8 *origblock;
-    u8 *md5tmp;
-    u8 md5sum[16];
     u64 filepos;
+    u64 start;
     int ret=0;
     int res;
     int fd;
     
-    if (gcry_md_open(&md5ctx, GCRY_MD_MD5, 0) != GPG_ERR_NO_ERROR)
-    {   errprintf("gcry_md_open() failed\n");
+    if ((fd=open64(fullpath, O_RDONLY|O_LARGEFILE))<0)
+    {   sysprintf("Cannot open %s for reading\n", relpath);
         return -1;
     }
     
-    if ((fd=open64(fullpath, O_RDONLY|O_LARGEFILE))<0)
-    {   sysprintf("Cannot open %s for reading\n", relpath);
+    // the md5 is computed by the md5 thread which writes it in the footer, the hashes
+    // of the blocks (--block-hashes) are computed by the compression threads instead
+    if ((g_options.blkhashes==false) && ((filehash=filehash_alloc())==NULL))
+    {   errprintf("filehash_alloc() failed\n");
+        close(fd);
+        return -1;
+    }
+    if ((g_options.blkhashes==true) && ((blkhashlist=blkhashlist_alloc())==NULL))
+    {   errprintf("blkhashlist_alloc() failed\n");
+        close(fd);
         return -1;
     }
     
@@ -162,22 +176,26 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
     queue_add_header(&g_queue, header, FSA_MAGIC_OBJT, save->fsid);
     
     msgprintf(MSG_DEBUG1, "backup_obj_regfile_unique(file=%s, size=%lld)\n", relpath, (long long)filesize);
+    entropy_file_init(&entropy);
     for (filepos=0; (filesize>0) && (filepos < filesize) && (get_interrupted()==false); filepos+=curblocksize)
     {
         remaining=filesize-filepos;
         curblocksize=min(remaining, g_options.datablocksize);
         msgprintf(MSG_DEBUG2, "----> filepos=%lld, remaining=%lld, curblocksize=%lld\n", (long long)filepos, (long long)remaining, (long long)curblocksize);
         
-        origblock=malloc(curblocksize);
+        origblock=bufpool_alloc(curblocksize);
         if (!origblock)
-        {   errprintf("malloc(%ld) failed: cannot allocate data block\n", (long)origblock);
+        {   errprintf("bufpool_alloc(%ld) failed: cannot allocate data block\n", (long)curblocksize);
             ret=-1;
             goto backup_obj_regfile_unique_error;
         }
         
         if (eof==false) // file has not been truncated: read the next block
         {
-            if ((res=read(fd, origblock, (long)curblocksize))!=curblocksize)
+            start=pipestats_start();
+            res=read(fd, origblock, (long)curblocksize);
+            pipestats_add(PIPESTATS_READ, start, max(res, 0));
+            if (res!=curblocksize)
             {   ret=-1;
                 if (res>=0 && res<curblocksize) // file has been truncated: pad with zeros
                 {   errprintf("file [%s] has been truncated to %lld bytes (original size: %lld): padding with zeros\n", 
@@ -187,6 +205,7 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
                 }
                 else if (res<0) // read error
                 {   sysprintf("Cannot read data block from %s, block=%ld and res=%ld\n", relpath, (long)curblocksize, (long)res);
+                    bufpool_free(origblock);
                     ret=-1;
                     goto backup_obj_regfile_unique_error;
                 }
@@ -197,7 +216,13 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
             memset(origblock, 0, curblocksize);
         }
         
-        gcry_md_write(md5ctx, origblock, curblocksize);
+        // the md5 thread takes its own reference on the block before the compression threads can release it
+        if ((filehash!=NULL) && (filehash_write(filehash, (char*)origblock, (char*)origblock, curblocksize)!=0))
+        {   errprintf("filehash_write(%s) failed\n", relpath);
+            bufpool_free(origblock);
+            ret=-1;
+            goto backup_obj_regfile_unique_error;
+        }
         
         // add block to the queue
         memset(&blkinfo, 0, sizeof(blkinfo));
@@ -205,8 +230,17 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
         blkinfo.blkdata=(char*)origblock;
         blkinfo.blkoffset=filepos;
         blkinfo.blkfsid=save->fsid;
+        blkinfo.blkhint=entropy_file_hint(&entropy, origblock, curblocksize);
+        if ((blkhashlist!=NULL) && (blkhashlist_add_block(blkhashlist, &blkinfo)!=0))
+        {   errprintf("blkhashlist_add_block(%s) failed\n", relpath);
+            bufpool_free(origblock);
+            ret=-1;
+            goto backup_obj_regfile_unique_error;
+        }
         if (queue_add_block(&g_queue, &blkinfo, QITEM_STATUS_TODO)!=0)
         {   sysprintf("queue_add_block(%s) failed\n", relpath);
+            if (blkinfo.blkhashlist!=NULL) // the block won't be hashed by a compression thread
+                blkhashlist_set_block(&blkinfo);
             ret=-1;
             goto backup_obj_regfile_unique_error;
         }
@@ -218,16 +252,7 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
         goto backup_obj_regfile_unique_error;
     }
     
-    // write the footer with the global md5sum
-    if ((md5tmp=gcry_md_read(md5ctx, GCRY_MD_MD5))==NULL)
-    {   errprintf("gcry_md_read() failed\n");
-        ret=-1;
-        goto backup_obj_regfile_unique_error;
-    }
-    memcpy(md5sum, md5tmp, 16);
-    gcry_md_close(md5ctx);
-    
-    msgprintf(MSG_DEBUG1, "--> finished loop for file=%s, size=%lld, md5=[%s]\n", relpath, (long long)filesize, format_md5(text, sizeof(text), md5sum));
+    msgprintf(MSG_DEBUG1, "--> finished loop for file=%s, size=%lld\n", relpath, (long long)filesize);
     
     // don't write the footer for empty files (checksum does not make sense --> don't waste space in the archive)
     if (filesize>0)
@@ -237,9 +262,15 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
             ret=-1;
             goto backup_obj_regfile_unique_error;
         }
-        dico_add_data(footerdico, 0, BLOCKFOOTITEMKEY_MD5SUM, md5sum, 16);
         
-        if (queue_add_header(&g_queue, footerdico, FSA_MAGIC_FILF, save->fsid)!=0)
+        // the footer is written once the md5 thread (or the last compression thread) has added the checksum of the file
+        if (blkhashlist!=NULL)
+            res=blkhashlist_add_header(blkhashlist, &g_queue, footerdico, FSA_MAGIC_FILF, save->fsid, 0, BLOCKFOOTITEMKEY_BLKHASHES);
+        else
+            res=filehash_add_header(filehash, &g_queue, footerdico, FSA_MAGIC_FILF, save->fsid, 0, BLOCKFOOTITEMKEY_MD5SUM);
+        filehash=NULL;
+        blkhashlist=NULL;
+        if (res!=0)
         {   msgprintf(MSG_VERB2, "Cannot write footer for file %s\n", relpath);
             ret=-1;
             goto backup_obj_regfile_unique_error;
@@ -247,6 +278,10 @@ int createar_obj_regfile_unique(csavear *save, cdico *header, char *relpath, cha
     }
     
 backup_obj_regfile_unique_error:
+    if (filehash!=NULL)
+        filehash_final(filehash, NULL, 0);
+    if (blkhashlist!=NULL)
+        blkhashlist_release(blkhashlist);
     close(fd);
     return ret;
 }
@@ -844,7 +879,8 @@ int createar_save_directory_wrapper(csavear *save, char *root, char *path, u64 *
 int createar_write_mainhead(csavear *save, int archtype, int fscount)
 {
     u8 bufcheckclear[FSA_CHECKPASSBUF_SIZE+8];
-    u8 bufcheckcrypt[FSA_CHECKPASSBUF_SIZE+8];
+    u8 bufcheckcrypt[FSA_CHECKPASSBUF_SIZE+CRYPTO_AEAD_OVERHEAD];
+    u8 kdfsalt[CRYPTO_KDF_SALTSIZE];
     u64 cryptsize;
     u8 md5sum[16];
     struct timeval now;
@@ -873,27 +909,55 @@ int createar_write_mainhead(csavear *save, int archtype, int fscount)
     dico_add_u32(d, 0, MAINHEADKEY_ENCRYPTALGO, g_options.encryptalgo);
     dico_add_u32(d, 0, MAINHEADKEY_FSACOMPLEVEL, g_options.fsacomplevel);
     dico_add_u32(d, 0, MAINHEADKEY_HASDIRSINFOHEAD, true);
-    
-    // minimum fsarchiver version required to restore that archive
-    dico_add_u64(d, 0, MAINHEADKEY_MINFSAVERSION, FSA_VERSION_BUILD(0, 6, 4, 0));
+    if (g_options.checksumalgo!=CHECKSUM_FLETCHER32)
+        dico_add_u16(d, 0, MAINHEADKEY_CHECKSUMALGO, g_options.checksumalgo);
+    if (g_options.blkhashes==true)
+        dico_add_u32(d, 0, MAINHEADKEY_HASBLKHASHES, true);
+    
+    // minimum fsarchiver version required to restore that archive (zstd, lz4, the new checksums and ciphers, the block hashes and the index are not supported by older versions)
+    if (g_options.compressalgo==COMPRESS_ZSTD || g_options.compressalgo==COMPRESS_LZ4 || g_options.checksumalgo!=CHECKSUM_FLETCHER32 || 
+        g_options.blkhashes==true || g_options.encryptalgo>ENCRYPT_BLOWFISH || g_options.archindex==true)
+        dico_add_u64(d, 0, MAINHEADKEY_MINFSAVERSION, FSA_VERSION_BUILD(0, 6, 13, 0));
+    else
+        dico_add_u64(d, 0, MAINHEADKEY_MINFSAVERSION, FSA_VERSION_BUILD(0, 6, 4, 0));
     
     if (archtype==ARCHTYPE_FILESYSTEMS)
     {   
         dico_add_u64(d, 0, MAINHEADKEY_FSCOUNT, fscount);
     }
     
+    // the key of the authenticated algorithms is derived once with a random salt (before the first block is queued)
+    if ((g_options.encryptalgo!=ENCRYPT_NONE) && (g_options.encryptalgo!=ENCRYPT_BLOWFISH))
+    {
+        crypto_random(kdfsalt, sizeof(kdfsalt));
+        if (crypto_setkey(g_options.encryptalgo, g_options.encryptpass, strlen((char*)g_options.encryptpass), 
+            kdfsalt, sizeof(kdfsalt), CRYPTO_KDF_ITERATIONS)!=0)
+        {   errprintf("crypto_setkey() failed\n");
+            dico_destroy(d);
+            return -1;
+        }
+        dico_add_data(d, 0, MAINHEADKEY_KDFSALT, kdfsalt, sizeof(kdfsalt));
+        dico_add_u32(d, 0, MAINHEADKEY_KDFITERATIONS, CRYPTO_KDF_ITERATIONS);
+    }
+    
     // if encryption is enabled, save the md5sum of a random buffer to check the password
     if (g_options.encryptalgo!=ENCRYPT_NONE)
     {
         memset(md5sum, 0, sizeof(md5sum));
         crypto_random(bufcheckclear, FSA_CHECKPASSBUF_SIZE);
-        crypto_blowfish(FSA_CHECKPASSBUF_SIZE, &cryptsize, bufcheckclear, bufcheckcrypt, 
-            g_options.encryptpass, strlen((char*)g_options.encryptpass), true);
+        if (g_options.encryptalgo==ENCRYPT_BLOWFISH)
+            crypto_blowfish(FSA_CHECKPASSBUF_SIZE, &cryptsize, bufcheckclear, bufcheckcrypt, 
+                g_options.encryptpass, strlen((char*)g_options.encryptpass), true);
+        else if (crypto_aead(g_options.encryptalgo, FSA_CHECKPASSBUF_SIZE, &cryptsize, bufcheckclear, bufcheckcrypt, true)!=0)
+        {   errprintf("crypto_aead() failed\n");
+            dico_destroy(d);
+            return -1;
+        }
         
         gcry_md_hash_buffer(GCRY_MD_MD5, md5sum, bufcheckclear, FSA_CHECKPASSBUF_SIZE);
         
         assert(dico_add_data(d, 0, MAINHEADKEY_BUFCHECKPASSCLEARMD5, md5sum, 16)==0);
-        assert(dico_add_data(d, 0, MAINHEADKEY_BUFCHECKPASSCRYPTBUF, bufcheckcrypt, FSA_CHECKPASSBUF_SIZE)==0);
+        assert(dico_add_data(d, 0, MAINHEADKEY_BUFCHECKPASSCRYPTBUF, bufcheckcrypt, cryptsize)==0);
     }
     
     if (queue_add_header(&g_queue, d, FSA_MAGIC_MAIN, FSA_FILESYSID_NULL)!=0)
@@ -1110,7 +1174,6 @@ int createar_oper_savedir(csavear *save, char *rootdir)
 
 int oper_save(char *archive, int argc, char **argv, int archtype)
 {
-    pthread_t thread_comp[FSA_MAX_COMPJOBS];
     cdico *dicofsinfo[FSA_MAX_FSPERARCH];
     cdevinfo devinfo[FSA_MAX_FSPERARCH];
     pthread_t thread_writer;
@@ -1126,20 +1189,18 @@ int oper_save(char *archive, int argc, char **argv, int archtype)
     // init
     memset(&save, 0, sizeof(save));
     save.cost_global=0;
+    pipestats_init(false);
     
     // init archive
     archwriter_init(&save.ai);
     archwriter_generate_id(&save.ai);
+    save.ai.sumalgo=g_options.checksumalgo;
     
     // pass options to archive
     path_force_extension(save.ai.basepath, PATH_MAX, archive, ".fsa");
     
     // init misc data struct to zero
     thread_writer=0;
-    for (i=0; i<FSA_MAX_COMPJOBS; i++)
-    {
-        thread_comp[i]=0;
-    }
     for (i=0; i<FSA_MAX_FSPERARCH; i++)
     {
         memset(&devinfo[i], 0, sizeof(cdevinfo));
@@ -1169,22 +1230,28 @@ int oper_save(char *archive, int argc, char **argv, int archtype)
     }
     
     // create compression threads
-    for (i=0; (i<g_options.compressjobs) && (i<FSA_MAX_COMPJOBS); i++)
-    {
-        if (pthread_create(&thread_comp[i], NULL, thread_comp_fct, NULL) != 0)
-        {   errprintf("pthread_create(thread_comp_fct) failed\n");
-            ret=-1;
-            goto do_create_error;
-        }
+    if (thread_comp_start(COMPTHR_COMPRESS, g_options.compressjobs)!=0)
+    {   msgprintf(MSG_STACK, "thread_comp_start() failed\n");
+        ret=-1;
+        goto do_create_error;
+    }
+    
+    // create the thread which computes the md5 of the files
+    if (thread_hash_start()!=0)
+    {   msgprintf(MSG_STACK, "thread_hash_start() failed\n");
+        ret=-1;
+        goto do_create_error;
     }
     
     // create archive-writer thread
-    if (pthread_create(&thread_writer, NULL, thread_writer_fct, (void*)&save.ai) != 0)
+    if (pthread_create(&thread_writer, cpuinfo_thread_attr(CPUINFO_SET_IO), thread_writer_fct, (void*)&save.ai) != 0)
     {   errprintf("pthread_create(thread_writer_fct) failed\n");
         ret=-1;
         goto do_create_error;
     }
     
+    metrics_start((archtype==ARCHTYPE_FILESYSTEMS)?"savefs":"savedir", &save.cost_current, &save.cost_global, &save.stats, &save.ai.curvol);
+    
     // write archive main header
     if (createar_write_mainhead(&save, archtype, argc)!=0)
     {   errprintf("archive_write_mainhead(%s) failed\n", archive);
@@ -1282,7 +1349,7 @@ int oper_save(char *archive, int argc, char **argv, int archtype)
             {
                 msgprintf(MSG_VERB1, "============= archiving filesystem %s =============\n", devinfo[i].devpath);
                 save.fsid=i;
-                memset(&save.stats, 0, sizeof(save.stats));
+                metrics_reset_stats(&save.stats);
                 if (createar_oper_savefs(&save, &devinfo[i])!=0)
                 {   errprintf("archive_filesystem(%s) failed\n", devinfo[i].devpath);
                     goto do_create_error;
@@ -1349,15 +1416,19 @@ do_create_success:
         }
     }
     
+    thread_hash_join(); // the last footers are released to the writer when their md5 is known
+    
     queue_set_end_of_queue(&g_queue, true); // other threads must not wait for more data from this thread
     
-    for (i=0; (i<g_options.compressjobs) && (i<FSA_MAX_COMPJOBS); i++)
-        if (thread_comp[i] && pthread_join(thread_comp[i], NULL) != 0)
-            errprintf("pthread_join(thread_comp[%d]) failed\n", i);
+    metrics_comp_done();
+    thread_comp_join();
     
     if (thread_writer && pthread_join(thread_writer, NULL) != 0)
         errprintf("pthread_join(thread_writer) failed\n");
     
+    metrics_stop();
+    pipestats_show();
+    
     if (ret!=0)
         archwriter_remove(&save.ai);
     
@@ -23,6 +23,8 @@
 
 #include "fsarchiver.h"
 #include "options.h"
+#include "comp_zstd.h"
+#include "comp_lz4.h"
 #include "error.h"
 
 coptions g_options;
@@ -32,6 +34,8 @@ int options_init()
     memset(&g_options, 0, sizeof(coptions));
     if (strlist_init(&g_options.exclude)!=0)
         return -1;
+    if (strlist_init(&g_options.only)!=0)
+        return -1;
     return 0;
 }
 
@@ -39,6 +43,8 @@ int options_destroy()
 {
     if (strlist_destroy(&g_options.exclude)!=0)
         return -1;
+    if (strlist_destroy(&g_options.only)!=0)
+        return -1;
     memset(&g_options, 0, sizeof(coptions));
     return 0;
 }
@@ -109,3 +115,53 @@ int options_select_compress_level(int opt)
     
     return 0;
 }
+
+// zstd is selected with its own levels: negative levels are faster than lzo, high levels approach lzma
+int options_select_zstd_level(int level)
+{
+#ifdef OPTION_ZSTD_SUPPORT
+    if (level==0 || level<zstd_min_level() || level>zstd_max_level())
+    {   errprintf("invalid zstd compression level: %d, it must be between %d and %d (except 0)\n", 
+            level, zstd_min_level(), zstd_max_level());
+        return -1;
+    }
+    
+    g_options.compressalgo=COMPRESS_ZSTD;
+    g_options.compresslevel=level;
+    g_options.fsacomplevel=0; // not one of the "-z" levels
+    
+    // high levels search matches further away: it only helps if the blocks are big enough
+    if (level>=16)
+        g_options.datablocksize=FSA_MAX_BLKSIZE;
+    else if (level>=6)
+        g_options.datablocksize=524288;
+    else
+        g_options.datablocksize=FSA_DEF_BLKSIZE;
+    
+    return 0;
+#else
+    errprintf("zstd compression is not available: zstd has been disabled at compilation time\n");
+    return -1;
+#endif // OPTION_ZSTD_SUPPORT
+}
+
+// lz4 is faster than lzo and decompresses at several GB/s: for when the disks or the network are the limit
+int options_select_lz4_level(int level)
+{
+#ifdef OPTION_LZ4_SUPPORT
+    if (level<1 || level>LZ4_MAX_LEVEL)
+    {   errprintf("invalid lz4 compression level: %d, it must be between 1 and %d\n", level, LZ4_MAX_LEVEL);
+        return -1;
+    }
+    
+    g_options.compressalgo=COMPRESS_LZ4;
+    g_options.compresslevel=level;
+    g_options.fsacomplevel=0; // not one of the "-z" levels
+    g_options.datablocksize=FSA_DEF_BLKSIZE;
+    
+    return 0;
+#else
+    errprintf("lz4 compression is not available: lz4 has been disabled at compilation time\n");
+    return -1;
+#endif // OPTION_LZ4_SUPPORT
+}
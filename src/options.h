@@ -18,6 +18,8 @@
 #ifndef __OPTIONS_H__
 #define __OPTIONS_H__
 
+#include <limits.h>
+
 #include "strlist.h"
 
 struct s_options;
@@ -32,15 +34,25 @@ struct s_options
     int      debuglevel;
     int      compresslevel;
     int      compressjobs;
+    bool     autojobs;
     u16      compressalgo;
     u32      datablocksize;
     u32      smallfilethresh;
     u64      splitsize;
+    u64      queuemem;
+    bool     hugepages;
+    int      detectincomp;
+    int      metricsfd;
+    char     metricspath[PATH_MAX];
     u16      encryptalgo;
+    u16      checksumalgo;
+    bool     blkhashes;
+    bool     archindex;
     u16      fsacomplevel;
 	char     archlabel[FSA_MAX_LABELLEN];
     u8       encryptpass[FSA_MAX_PASSLEN+1];
     cstrlist exclude;
+    cstrlist only;
 };
 
 extern coptions g_options;
@@ -48,5 +60,7 @@ extern coptions g_options;
 int options_init();
 int options_destroy();
 int options_select_compress_level(int opt);
+int options_select_zstd_level(int level);
+int options_select_lz4_level(int level);
 
 #endif // __OPTIONS_H__
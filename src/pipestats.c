@@ -0,0 +1,211 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fsarchiver.h"
+#include "pipestats.h"
+#include "archinfo.h"
+#include "common.h"
+#include "error.h"
+
+// counters updated by all the threads (with atomic operations) and shown at the end of the operation
+cpipestats g_pipestats;
+
+void pipestats_init(bool restore)
+{
+    memset(&g_pipestats, 0, sizeof(g_pipestats));
+    g_pipestats.restore=restore;
+    g_pipestats.starttime=get_time_usec();
+}
+
+u64 pipestats_start()
+{
+    return get_time_usec();
+}
+
+// account a call to a stage which started at starttime (value returned by pipestats_start)
+void pipestats_add(int stage, u64 starttime, u64 bytes)
+{
+    cpipestage *st;
+    u64 usec;
+    int bucket;
+    
+    if (stage<0 || stage>=PIPESTATS_COUNT)
+        return;
+    st=&g_pipestats.stage[stage];
+    usec=get_time_usec()-starttime;
+    for (bucket=0; (bucket < PIPESTATS_HISTSIZE-1) && (usec >= (1LL<<bucket)); bucket++);
+    
+    (void)__sync_add_and_fetch(&st->calls, 1);
+    (void)__sync_add_and_fetch(&st->bytes, bytes);
+    (void)__sync_add_and_fetch(&st->usec, usec);
+    (void)__sync_add_and_fetch(&st->hist[bucket], 1);
+}
+
+void pipestats_add_codec(int compalgo, u64 realbytes, u64 compbytes)
+{
+    cpipecodec *codec;
+    
+    if (compalgo<0 || compalgo>=PIPESTATS_MAXCODECS)
+        return;
+    codec=&g_pipestats.codec[compalgo];
+    (void)__sync_add_and_fetch(&codec->blocks, 1);
+    (void)__sync_add_and_fetch(&codec->realbytes, realbytes);
+    (void)__sync_add_and_fetch(&codec->compbytes, compbytes);
+}
+
+// account the time spent in a compression algorithm, even when the result has not been used
+void pipestats_add_codec_time(int compalgo, u64 trybytes, u64 starttime)
+{
+    cpipecodec *codec;
+    
+    if (compalgo<0 || compalgo>=PIPESTATS_MAXCODECS)
+        return;
+    codec=&g_pipestats.codec[compalgo];
+    (void)__sync_add_and_fetch(&codec->trybytes, trybytes);
+    (void)__sync_add_and_fetch(&codec->tryusec, get_time_usec()-starttime);
+}
+
+void pipestats_add_probe(u64 starttime)
+{
+    (void)__sync_add_and_fetch(&g_pipestats.probe.blocks, 1);
+    (void)__sync_add_and_fetch(&g_pipestats.probe.usec, get_time_usec()-starttime);
+}
+
+void pipestats_add_stored(u64 bytes)
+{
+    (void)__sync_add_and_fetch(&g_pipestats.probe.storedblocks, 1);
+    (void)__sync_add_and_fetch(&g_pipestats.probe.storedbytes, bytes);
+}
+
+void pipestats_add_compressed_file()
+{
+    (void)__sync_add_and_fetch(&g_pipestats.probe.files, 1);
+}
+
+// upper bound of the time per call for a given percentile of the calls (from the histogram)
+static char *pipestats_format_percentile(cpipestage *st, int percent, char *text, int max)
+{
+    u64 limit;
+    u64 count=0;
+    int bucket;
+    
+    limit=(st->calls*percent+99)/100;
+    for (bucket=0; (bucket < PIPESTATS_HISTSIZE-1) && ((count+=st->hist[bucket]) < limit); bucket++);
+    
+    if (bucket < 10)
+        snprintf(text, max, "%lldus", (long long)(1LL<<bucket));
+    else if (bucket < 20)
+        snprintf(text, max, "%lldms", (long long)((1LL<<bucket)/1000));
+    else
+        snprintf(text, max, "%llds", (long long)((1LL<<bucket)/1000000));
+    return text;
+}
+
+static char *pipestats_stage_name(int stage)
+{
+    switch (stage)
+    {
+        case PIPESTATS_READ:     return (g_pipestats.restore)?"read archive":"read files";
+        case PIPESTATS_MD5:      return "md5 checksum";
+        case PIPESTATS_BLKHASH:  return "block hashes";
+        case PIPESTATS_COMPRESS: return (g_pipestats.restore)?"decrypt/decompress":"compress/encrypt";
+        case PIPESTATS_CHECKSUM: return "block checksum";
+        case PIPESTATS_QUEUEPUT: return "queue full wait";
+        case PIPESTATS_QUEUEGET: return "queue empty wait";
+        case PIPESTATS_WRITE:    return (g_pipestats.restore)?"write files":"write archive";
+        default:                 return "unknown";
+    }
+}
+
+int pipestats_show()
+{
+    char speedtext[128];
+    char sizetext[64];
+    char p50text[32];
+    char p99text[32];
+    char label[64];
+    cpipestage *st;
+    cpipecodec *codec;
+    cpipeprobe *probe;
+    u64 trybytes=0;
+    u64 tryusec=0;
+    double elapsed;
+    double seconds;
+    int i;
+    
+    elapsed=((double)(get_time_usec()-g_pipestats.starttime))/1000000.0;
+    msgprintf(MSG_VERB1, "Pipeline statistics (elapsed time: %.2f sec, times are added for all the threads)\n", elapsed);
+    
+    for (i=0; i < PIPESTATS_COUNT; i++)
+    {
+        st=&g_pipestats.stage[i];
+        if (st->calls==0)
+            continue;
+        seconds=((double)st->usec)/1000000.0;
+        snprintf(label, sizeof(label), "* %s:", pipestats_stage_name(i));
+        for (; strlen(label) < 24; strcat(label, "."));
+        if (st->bytes>0)
+            snprintf(speedtext, sizeof(speedtext), ", size=%s, speed=%.2f MB/s", format_size(st->bytes, sizetext, sizeof(sizetext), 'h'),
+                (seconds>0)?(((double)st->bytes)/(1024.0*1024.0)/seconds):0.0);
+        else // waits do not process any data
+            speedtext[0]=0;
+        msgprintf(MSG_VERB1, "%scalls=%lld, time=%.2f sec (%.1f%% of elapsed)%s, p50<%s, p99<%s\n",
+            label, (long long)st->calls, seconds, (elapsed>0)?(seconds*100.0/elapsed):0.0, speedtext,
+            pipestats_format_percentile(st, 50, p50text, sizeof(p50text)),
+            pipestats_format_percentile(st, 99, p99text, sizeof(p99text)));
+    }
+    
+    for (i=0; i < PIPESTATS_MAXCODECS; i++)
+    {
+        codec=&g_pipestats.codec[i];
+        if (codec->blocks==0)
+            continue;
+        snprintf(label, sizeof(label), "* codec %s:", compalgostr(i));
+        for (; strlen(label) < 24; strcat(label, "."));
+        msgprintf(MSG_VERB1, "%sblocks=%lld, size=%s, ratio=%.2f\n", label, (long long)codec->blocks,
+            format_size(codec->realbytes, sizetext, sizeof(sizetext), 'h'),
+            (codec->compbytes>0)?(((double)codec->realbytes)/((double)codec->compbytes)):0.0);
+    }
+    
+    // the time saved is estimated from the speed of the compression on the blocks which have been compressed
+    // minus the time spent analysing the blocks
+    probe=&g_pipestats.probe;
+    for (i=0; i < PIPESTATS_MAXCODECS; i++)
+    {   trybytes+=g_pipestats.codec[i].trybytes;
+        tryusec+=g_pipestats.codec[i].tryusec;
+    }
+    if ((probe->blocks>0) || (probe->storedblocks>0))
+    {   snprintf(label, sizeof(label), "* incompressible:");
+        for (; strlen(label) < 24; strcat(label, "."));
+        if (trybytes>0)
+            snprintf(speedtext, sizeof(speedtext), "%.2f sec", (((double)probe->storedbytes)*((double)tryusec)/((double)trybytes)-((double)probe->usec))/1000000.0);
+        else // nothing has been compressed: the speed is not known
+            snprintf(speedtext, sizeof(speedtext), "unknown");
+        msgprintf(MSG_VERB1, "%sanalysed=%lld blocks in %.2f sec, stored=%lld blocks (%s), files=%lld, cpu time saved=%s\n", label,
+            (long long)probe->blocks, ((double)probe->usec)/1000000.0, (long long)probe->storedblocks,
+            format_size(probe->storedbytes, sizetext, sizeof(sizetext), 'h'), (long long)probe->files, speedtext);
+    }
+    
+    return 0;
+}
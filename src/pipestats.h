@@ -0,0 +1,90 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __PIPESTATS_H__
+#define __PIPESTATS_H__
+
+#define PIPESTATS_HISTSIZE   32 // bucket N of the histogram counts the calls which took less than 2^N micro-seconds
+#define PIPESTATS_MAXCODECS  16 // compression algorithms are indexed by their COMPRESS_xxx value
+
+// stages of the pipeline: on restore the same stages are used in the opposite direction
+enum {PIPESTATS_READ=0,     // save: read the source files, restore: read the archive
+      PIPESTATS_MD5,        // md5 of the file contents (save and restore)
+      PIPESTATS_BLKHASH,    // sha256 of the contents of the blocks (archives created with --block-hashes)
+      PIPESTATS_COMPRESS,   // save: compress and encrypt blocks, restore: decrypt and decompress
+      PIPESTATS_CHECKSUM,   // checksum of the blocks as they are in the archive
+      PIPESTATS_QUEUEPUT,   // producer waiting for space in the queue
+      PIPESTATS_QUEUEGET,   // consumer waiting for the first item of the queue to be ready
+      PIPESTATS_WRITE,      // save: write the archive, restore: write the files
+      PIPESTATS_COUNT};
+
+struct s_pipestage;
+typedef struct s_pipestage cpipestage;
+
+struct s_pipecodec;
+typedef struct s_pipecodec cpipecodec;
+
+struct s_pipeprobe;
+typedef struct s_pipeprobe cpipeprobe;
+
+struct s_pipestats;
+typedef struct s_pipestats cpipestats;
+
+struct s_pipestage
+{   u64    calls; // how many times the stage has been executed
+    u64    bytes; // how much data has been processed by the stage
+    u64    usec; // total time spent in the stage (from all the threads)
+    u64    hist[PIPESTATS_HISTSIZE]; // histogram of the time spent per call
+};
+
+struct s_pipecodec
+{   u64    blocks; // how many blocks have been processed with that algorithm
+    u64    realbytes; // size of the blocks when uncompressed
+    u64    compbytes; // size of the blocks when compressed
+    u64    trybytes; // data given to the algorithm (including the blocks which have been stored uncompressed)
+    u64    tryusec; // time spent in the algorithm for trybytes
+};
+
+struct s_pipeprobe
+{   u64    blocks; // how many blocks have been analysed to find if they are worth compressing
+    u64    usec; // time spent analysing the blocks
+    u64    storedblocks; // blocks stored uncompressed without trying to compress them
+    u64    storedbytes;
+    u64    files; // files recognized as compressed from their first bytes
+};
+
+struct s_pipestats
+{   bool       restore; // true when extracting an archive: used to name the stages in the report
+    u64        starttime; // get_time_usec() when the operation started
+    cpipestage stage[PIPESTATS_COUNT];
+    cpipecodec codec[PIPESTATS_MAXCODECS];
+    cpipeprobe probe;
+};
+
+extern cpipestats g_pipestats;
+
+void pipestats_init(bool restore);
+u64  pipestats_start();
+void pipestats_add(int stage, u64 starttime, u64 bytes);
+void pipestats_add_codec(int compalgo, u64 realbytes, u64 compbytes);
+void pipestats_add_codec_time(int compalgo, u64 trybytes, u64 starttime);
+void pipestats_add_probe(u64 starttime);
+void pipestats_add_stored(u64 bytes);
+void pipestats_add_compressed_file();
+int  pipestats_show();
+
+#endif // __PIPESTATS_H__
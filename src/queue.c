@@ -34,16 +34,10 @@
 #include "common.h"
 #include "syncthread.h"
 #include "error.h"
+#include "pipestats.h"
+#include "bufpool.h"
 
-struct timespec get_timeout()
-{
-    struct timespec t;
-    clock_gettime(CLOCK_REALTIME, &t);
-    t.tv_sec++;
-    return t;
-}
-
-s64 queue_init(cqueue *q, s64 blkmax)
+s64 queue_init(cqueue *q, u64 bytemax)
 {
     pthread_mutexattr_t attr;
 
@@ -53,13 +47,25 @@ s64 queue_init(cqueue *q, s64 blkmax)
     }
     
     // ---- init default attributes
-    q->head=NULL;
     q->curitemnum=1;
+    q->headnum=1;
+    q->todonum=1;
     q->itemcount=0;
+    q->todocount=0;
     q->blkcount=0;
-    q->blkmax=blkmax;
+    q->bytecount=0;
+    q->bytemax=bytemax;
+    q->spacewaitusec=0;
+    q->headwaitusec=0;
     q->endofqueue=false;
     
+    // ---- allocate the ring buffer (it grows when there are more items)
+    q->slotcount=QUEUE_MIN_SLOTS;
+    if ((q->items=calloc(q->slotcount, sizeof(cqueueitem)))==NULL)
+    {   errprintf("calloc(%ld, %ld) failed: out of memory\n", (long)q->slotcount, (long)sizeof(cqueueitem));
+        return FSAERR_ENOMEM;
+    }
+    
     // ---- init pthread structures
     assert(pthread_mutexattr_init(&attr)==0);
     assert(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK)==0);
@@ -68,7 +74,8 @@ s64 queue_init(cqueue *q, s64 blkmax)
         return FSAERR_UNKNOWN;
     }
     
-    if (pthread_cond_init(&q->cond,NULL)!=0)
+    if (pthread_cond_init(&q->condspace,NULL)!=0 || pthread_cond_init(&q->condtodo,NULL)!=0 ||
+        pthread_cond_init(&q->condhead,NULL)!=0 || pthread_cond_init(&q->condempty,NULL)!=0)
     {   msgprintf(3, "pthread_cond_init failed\n");
         return FSAERR_UNKNOWN;
     }
@@ -78,9 +85,6 @@ s64 queue_init(cqueue *q, s64 blkmax)
 
 s64 queue_destroy(cqueue *q)
 {
-    cqueueitem *cur;
-    cqueueitem *next;
-    
     if (!q)
     {   errprintf("q is NULL\n");
         return FSAERR_EINVAL;
@@ -88,22 +92,183 @@ s64 queue_destroy(cqueue *q)
     
     assert(pthread_mutex_lock(&q->mutex)==0);
     
-    for (cur=q->head; cur!=NULL; cur=next)
-    {
-        next=cur->next;
-        free(cur);
-    }
-    q->head=NULL;
+    free(q->items);
+    q->items=NULL;
+    q->slotcount=0;
+    q->headnum=q->curitemnum;
     q->itemcount=0;
     
     assert(pthread_mutex_unlock(&q->mutex)==0);
     
     assert(pthread_mutex_destroy(&q->mutex)==0);
-    assert(pthread_cond_destroy(&q->cond)==0);
+    assert(pthread_cond_destroy(&q->condspace)==0);
+    assert(pthread_cond_destroy(&q->condtodo)==0);
+    assert(pthread_cond_destroy(&q->condhead)==0);
+    assert(pthread_cond_destroy(&q->condempty)==0);
+    
+    return FSAERR_SUCCESS;
+}
+
+// change the memory budget (the queue does not have to be empty)
+s64 queue_set_memory_limit(cqueue *q, u64 bytemax)
+{
+    if (!q)
+    {   errprintf("q is NULL\n");
+        return FSAERR_EINVAL;
+    }
+    
+    assert(pthread_mutex_lock(&q->mutex)==0);
+    q->bytemax=bytemax;
+    pthread_cond_broadcast(&q->condspace);
+    assert(pthread_mutex_unlock(&q->mutex)==0);
+    
+    return FSAERR_SUCCESS;
+}
+
+// memory used by a block: size of the buffer which holds the data (it comes from the buffer pool)
+static u64 queue_block_bytes(cblockinfo *blkinfo)
+{
+    return sizeof(cqueueitem) + max(bufpool_bufsize(blkinfo->blkdata), max(blkinfo->blkrealsize, blkinfo->blkarsize));
+}
+
+// memory used by an header
+static u64 queue_header_bytes(cheadinfo *headinfo)
+{
+    return sizeof(cqueueitem) + ((headinfo->dico!=NULL)?dico_get_memsize(headinfo->dico):0);
+}
+
+// true when an item of this size can be added without exceeding the memory budget
+// an empty queue always accepts an item else a big item could never be added
+static bool queuelocked_has_space(cqueue *q, u64 bytes)
+{
+    return (q->bytecount==0) || (q->bytecount + bytes <= q->bytemax);
+}
+
+// change the memory used by an item and wake up the threads waiting for memory if it has decreased
+static void queuelocked_set_item_bytes(cqueue *q, cqueueitem *item, u64 bytes)
+{
+    q->bytecount=q->bytecount - item->itembytes + bytes;
+    if (bytes < item->itembytes)
+        pthread_cond_broadcast(&q->condspace);
+    item->itembytes=bytes;
+}
+
+// returns the item which has this item number or NULL if it is not in the queue
+static cqueueitem *queuelocked_get_item(cqueue *q, s64 itemnum)
+{
+    if ((itemnum < q->headnum) || (itemnum >= q->curitemnum))
+        return NULL;
+    return &q->items[itemnum & (q->slotcount-1)];
+}
+
+// returns the first item of the queue or NULL if the queue is empty
+static cqueueitem *queuelocked_get_head(cqueue *q)
+{
+    return queuelocked_get_item(q, q->headnum);
+}
+
+// wake up all the threads which wait on the queue (when the end of the queue has changed)
+static void queuelocked_wakeup_all(cqueue *q)
+{
+    pthread_cond_broadcast(&q->condspace);
+    pthread_cond_broadcast(&q->condtodo);
+    pthread_cond_broadcast(&q->condhead);
+    pthread_cond_broadcast(&q->condempty);
+}
+
+// wait for a condition and add the time spent waiting to a stall counter (the mutex must be locked)
+static void queuelocked_wait(cqueue *q, pthread_cond_t *cond, u64 *waitusec, int stage)
+{
+    u64 start;
+    
+    start=get_time_usec();
+    pthread_cond_wait(cond, &q->mutex);
+    *waitusec+=get_time_usec()-start;
+    pipestats_add(stage, start, 0);
+}
+
+// double the size of the ring buffer when all the slots are used
+static int queuelocked_grow(cqueue *q)
+{
+    cqueueitem *newitems;
+    u64 newcount;
+    s64 i;
+    
+    newcount=q->slotcount*2;
+    if ((newitems=calloc(newcount, sizeof(cqueueitem)))==NULL)
+    {   errprintf("calloc(%ld, %ld) failed: out of memory\n", (long)newcount, (long)sizeof(cqueueitem));
+        return FSAERR_ENOMEM;
+    }
     
+    // the position of an item depends on the size of the buffer
+    for (i=q->headnum; i < q->curitemnum; i++)
+        newitems[i & (newcount-1)]=q->items[i & (q->slotcount-1)];
+    
+    free(q->items);
+    q->items=newitems;
+    q->slotcount=newcount;
+    msgprintf(MSG_DEBUG4, "queue ring buffer has been extended to %ld items\n", (long)newcount);
     return FSAERR_SUCCESS;
 }
 
+// reserve the slot which follows the last item of the queue
+static cqueueitem *queuelocked_append_item(cqueue *q, int type, int status, u64 bytes)
+{
+    cqueueitem *item;
+    
+    if ((q->itemcount >= q->slotcount) && (queuelocked_grow(q)!=FSAERR_SUCCESS))
+        return NULL;
+    
+    item=&q->items[q->curitemnum & (q->slotcount-1)];
+    memset(item, 0, sizeof(cqueueitem));
+    item->type=type;
+    item->status=status;
+    item->itemnum=q->curitemnum++;
+    item->itembytes=bytes;
+    q->itemcount++;
+    q->bytecount+=bytes;
+    
+    if (type==QITEM_TYPE_BLOCK)
+    {   q->blkcount++;
+        if (status!=QITEM_STATUS_DONE)
+            q->todocount++;
+    }
+    
+    // the caller fills the item before it releases the mutex so the waiters can be signaled now
+    if (q->itemcount==1)
+        pthread_cond_broadcast(&q->condhead);
+    if ((type==QITEM_TYPE_BLOCK) && (status==QITEM_STATUS_TODO))
+        pthread_cond_signal(&q->condtodo);
+    
+    return item;
+}
+
+// release the first item of the queue (its contents must have been copied or freed by the caller)
+static void queuelocked_remove_head(cqueue *q)
+{
+    cqueueitem *cur;
+    
+    cur=queuelocked_get_head(q);
+    queuelocked_set_item_bytes(q, cur, 0);
+    if (cur->type==QITEM_TYPE_BLOCK)
+    {   q->blkcount--;
+        if ((cur->status!=QITEM_STATUS_DONE) && (--q->todocount==0))
+            pthread_cond_broadcast(&q->condempty);
+    }
+    
+    q->headnum++;
+    q->itemcount--;
+    if (q->todonum < q->headnum)
+        q->todonum=q->headnum;
+    
+    if (q->itemcount>0) // there is a new head
+        pthread_cond_broadcast(&q->condhead);
+    else if (q->endofqueue==true) // end of queue reached
+        queuelocked_wakeup_all(q);
+    else
+        pthread_cond_broadcast(&q->condempty);
+}
+
 s64 queue_set_end_of_queue(cqueue *q, bool state)
 {
     if (!q)
@@ -113,8 +278,8 @@ s64 queue_set_end_of_queue(cqueue *q, bool state)
 
     assert(pthread_mutex_lock(&q->mutex)==0);
     q->endofqueue=state;
+    queuelocked_wakeup_all(q);
     assert(pthread_mutex_unlock(&q->mutex)==0);
-    pthread_cond_broadcast(&q->cond);
     return FSAERR_SUCCESS;
 }
 
@@ -166,6 +331,7 @@ s64 queue_count_status(cqueue *q, int status)
 {
     cqueueitem *cur;
     int count=0;
+    s64 i;
     
     if (!q)
     {   errprintf("q is NULL\n");
@@ -174,7 +340,7 @@ s64 queue_count_status(cqueue *q, int status)
 
     assert(pthread_mutex_lock(&q->mutex)==0);
     
-    for (cur=q->head; cur!=NULL; cur=cur->next)
+    for (i=q->headnum; (cur=queuelocked_get_item(q, i))!=NULL; i++)
     {
         if (status==QITEM_STATUS_NULL || cur->status==status)
             count++;
@@ -189,23 +355,61 @@ s64 queue_count_status(cqueue *q, int status)
 s64 queue_add_block(cqueue *q, cblockinfo *blkinfo, int status)
 {
     cqueueitem *item;
-    cqueueitem *cur;
+    u64 bytes;
     
     if (!q || !blkinfo)
     {   errprintf("a parameter is NULL\n");
         return FSAERR_EINVAL;
     }
     
-    // create the new item in memory
-    item=malloc(sizeof(cqueueitem));
-    if (!item)
-    {   errprintf("malloc(%ld) failed: out of memory\n", (long)sizeof(cqueueitem));
+    assert(pthread_mutex_lock(&q->mutex)==0);
+    
+    // does not make sense to add item on a queue where endofqueue is true
+    if (q->endofqueue==true)
+    {   assert(pthread_mutex_unlock(&q->mutex)==0);
+        return FSAERR_ENDOFFILE;
+    }
+    
+    // wait while (queue-is-full) to let the other threads remove items first
+    bytes=queue_block_bytes(blkinfo);
+    while (queuelocked_has_space(q, bytes)==false)
+    {
+        queuelocked_wait(q, &q->condspace, &q->spacewaitusec, PIPESTATS_QUEUEPUT);
+    }
+    
+    if ((item=queuelocked_append_item(q, QITEM_TYPE_BLOCK, status, bytes))==NULL)
+    {   assert(pthread_mutex_unlock(&q->mutex)==0);
         return FSAERR_ENOMEM;
     }
-    item->type=QITEM_TYPE_BLOCK;
-    item->status=status;
     item->blkinfo=*blkinfo;
-    item->next=NULL;
+    
+    assert(pthread_mutex_unlock(&q->mutex)==0);
+    
+    return FSAERR_SUCCESS;
+}
+
+s64 queue_add_header(cqueue *q, cdico *d, char *magic, u16 fsid)
+{
+    cheadinfo headinfo;
+    
+    if (!q || !d || !magic)
+    {   errprintf("parameter is null\n");
+        return FSAERR_EINVAL;
+    }
+    
+    memset(&headinfo, 0, sizeof(headinfo));
+    memcpy(headinfo.magic, magic, FSA_SIZEOF_MAGIC);
+    headinfo.fsid=fsid;
+    headinfo.dico=d;
+    
+    return     queue_add_header_internal(q, &headinfo);
+}
+
+// add an header with this status (the headers are normally ready when they are added)
+static s64 queue_add_header_status(cqueue *q, cheadinfo *headinfo, int status, s64 *itemnum)
+{
+    cqueueitem *item;
+    u64 bytes;
     
     assert(pthread_mutex_lock(&q->mutex)==0);
     
@@ -216,34 +420,32 @@ s64 queue_add_block(cqueue *q, cblockinfo *blkinfo, int status)
     }
     
     // wait while (queue-is-full) to let the other threads remove items first
-    while (q->blkcount > q->blkmax)
+    bytes=queue_header_bytes(headinfo);
+    while (queuelocked_has_space(q, bytes)==false)
     {
-        struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
+        queuelocked_wait(q, &q->condspace, &q->spacewaitusec, PIPESTATS_QUEUEPUT);
     }
     
-    if (q->head==NULL) // if list empty: item is head
-    {
-        q->head=item;
-    }
-    else // list not empty: add items at the end
-    {   for (cur=q->head; (cur!=NULL) && (cur->next!=NULL); cur=cur->next);
-        cur->next=item;
+    if ((item=queuelocked_append_item(q, QITEM_TYPE_HEADER, status, bytes))==NULL)
+    {   assert(pthread_mutex_unlock(&q->mutex)==0);
+        return FSAERR_ENOMEM;
     }
-    
-    q->blkcount++;
-    q->itemcount++;
-    item->itemnum=q->curitemnum++;
+    item->headinfo=*headinfo;
+    if (itemnum!=NULL)
+        *itemnum=item->itemnum;
     
     assert(pthread_mutex_unlock(&q->mutex)==0);
-    pthread_cond_broadcast(&q->cond);
     
     return FSAERR_SUCCESS;
 }
 
-s64 queue_add_header(cqueue *q, cdico *d, char *magic, u16 fsid)
+// add an header which is not ready: the consumers wait until queue_set_header_ready() is called
+// it's used for the headers which receive the md5 of a file computed by the md5 thread
+s64 queue_add_header_pending(cqueue *q, cdico *d, char *magic, u16 fsid)
 {
     cheadinfo headinfo;
+    s64 itemnum;
+    s64 lres;
     
     if (!q || !d || !magic)
     {   errprintf("parameter is null\n");
@@ -255,59 +457,74 @@ s64 queue_add_header(cqueue *q, cdico *d, char *magic, u16 fsid)
     headinfo.fsid=fsid;
     headinfo.dico=d;
     
-    return     queue_add_header_internal(q, &headinfo);
+    if ((lres=queue_add_header_status(q, &headinfo, QITEM_STATUS_PROGRESS, &itemnum))!=FSAERR_SUCCESS)
+        return lres;
+    return itemnum;
 }
 
 s64 queue_add_header_internal(cqueue *q, cheadinfo *headinfo)
 {
-    cqueueitem *item;
-    cqueueitem *cur;
-    
     if (!q || !headinfo)
     {   errprintf("parameter is null\n");
         return FSAERR_EINVAL;
     }
     
-    // create the new item in memory
-    item=malloc(sizeof(cqueueitem));
-    if (!item)
-    {   errprintf("malloc(%ld) failed: out of memory 1\n", (long)sizeof(cqueueitem));
-        return FSAERR_ENOMEM;
-    }
+    return queue_add_header_status(q, headinfo, QITEM_STATUS_DONE, NULL);
+}
+
+// the header added by queue_add_header_pending() is complete and it can be dequeued
+s64 queue_set_header_ready(cqueue *q, s64 itemnum)
+{
+    cqueueitem *cur;
     
-    item->headinfo=*headinfo;
-    item->type=QITEM_TYPE_HEADER;
-    item->status=QITEM_STATUS_DONE;
-    item->next=NULL;
+    if (!q)
+    {   errprintf("a parameter is null\n");
+        return FSAERR_EINVAL;
+    }
     
     assert(pthread_mutex_lock(&q->mutex)==0);
     
-    // does not make sense to add item on a queue where endofqueue is true
-    if (q->endofqueue==true)
+    if (((cur=queuelocked_get_item(q, itemnum))==NULL) || (cur->type!=QITEM_TYPE_HEADER))
     {   assert(pthread_mutex_unlock(&q->mutex)==0);
-        return FSAERR_ENDOFFILE;
+        msgprintf(MSG_DEBUG1, "header %ld is not in the queue\n", (long)itemnum);
+        return FSAERR_ENOENT;
     }
     
-    // wait while (queue-is-full) to let the other threads remove items first
-    while (q->blkcount > q->blkmax)
-    {
-        struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
-    }
+    cur->status=QITEM_STATUS_DONE;
+    if (itemnum==q->headnum) // the consumer may be waiting for this header
+        pthread_cond_broadcast(&q->condhead);
     
-    item->itemnum=q->curitemnum++;
-    if (q->head==NULL) // if list empty
-    {
-        q->head=item;
+    assert(pthread_mutex_unlock(&q->mutex)==0);
+    
+    return FSAERR_SUCCESS;
+}
+
+// update a block which has been processed (the mutex must be locked)
+static s64 queuelocked_replace_block(cqueue *q, s64 itemnum, cblockinfo *blkinfo, int newstatus)
+{
+    cqueueitem *cur;
+    
+    if ((cur=queuelocked_get_item(q, itemnum))==NULL)
+    {   msgprintf(MSG_DEBUG1, "item %ld is not in the queue\n", (long)itemnum);
+        return FSAERR_ENOENT; // item not found
     }
-    else // list not empty
-    {   for (cur=q->head; (cur!=NULL) && (cur->next!=NULL); cur=cur->next);
-        cur->next=item;
+    
+    // keep track of the blocks which still have to be processed
+    if ((cur->status!=QITEM_STATUS_DONE) && (newstatus==QITEM_STATUS_DONE) && (--q->todocount==0))
+        pthread_cond_broadcast(&q->condempty);
+    else if ((cur->status==QITEM_STATUS_DONE) && (newstatus!=QITEM_STATUS_DONE))
+        q->todocount++;
+    if (newstatus==QITEM_STATUS_TODO)
+    {   if (itemnum < q->todonum)
+            q->todonum=itemnum;
+        pthread_cond_signal(&q->condtodo);
     }
     
-    q->itemcount++;
-    assert(pthread_mutex_unlock(&q->mutex)==0);
-    pthread_cond_broadcast(&q->cond);
+    cur->status=newstatus;
+    cur->blkinfo=*blkinfo;
+    queuelocked_set_item_bytes(q, cur, queue_block_bytes(blkinfo));
+    if (itemnum==q->headnum) // the writer may be waiting for this block
+        pthread_cond_broadcast(&q->condhead);
     
     return FSAERR_SUCCESS;
 }
@@ -315,7 +532,7 @@ s64 queue_add_header_internal(cqueue *q, cheadinfo *headinfo)
 // function called by the compression thread when a block has been compressed
 s64 queue_replace_block(cqueue *q, s64 itemnum, cblockinfo *blkinfo, int newstatus)
 {
-    cqueueitem *cur;
+    s64 ret;
     
     if (!q || !blkinfo)
     {   errprintf("a parameter is null\n");
@@ -323,34 +540,62 @@ s64 queue_replace_block(cqueue *q, s64 itemnum, cblockinfo *blkinfo, int newstat
     }
     
     assert(pthread_mutex_lock(&q->mutex)==0);
+    ret=queuelocked_replace_block(q, itemnum, blkinfo, newstatus);
+    assert(pthread_mutex_unlock(&q->mutex)==0);
     
-    if (q->head==NULL)
-    {   assert(pthread_mutex_unlock(&q->mutex)==0);
-        msgprintf(MSG_DEBUG1, "q->head is NULL: list is empty\n");
-        return FSAERR_ENOENT; // item not found
+    return ret;
+}
+
+// update several blocks at once: returns how many blocks have been replaced
+// if trylock is true it does nothing and returns 0 when another thread is using the queue
+s64 queue_replace_blocks(cqueue *q, int count, s64 *itemnum, cblockinfo *blkinfo, int newstatus, bool trylock)
+{
+    s64 replaced=0;
+    int i;
+    
+    if (!q || !itemnum || !blkinfo)
+    {   errprintf("a parameter is null\n");
+        return FSAERR_EINVAL;
     }
     
-    for (cur=q->head; cur!=NULL; cur=cur->next)
-    {
-        if (cur->itemnum==itemnum) // block found
-        {
-            cur->status=newstatus;
-            cur->blkinfo=*blkinfo;
-            assert(pthread_mutex_unlock(&q->mutex)==0);
-            pthread_cond_broadcast(&q->cond);
-            return FSAERR_SUCCESS;
-        }
+    if (trylock==true)
+    {   if (pthread_mutex_trylock(&q->mutex)!=0)
+            return 0;
+    }
+    else
+    {   assert(pthread_mutex_lock(&q->mutex)==0);
     }
     
+    // don't stop on errors: blocks can be missing when we terminate after a problem
+    for (i=0; i < count; i++)
+        if (queuelocked_replace_block(q, itemnum[i], &blkinfo[i], newstatus)==FSAERR_SUCCESS)
+            replaced++;
+    
+    assert(pthread_mutex_unlock(&q->mutex)==0);
+    
+    return replaced;
+}
+
+// how long the producer and the consumer of the queue have been waiting for each other
+s64 queue_get_wait_times(cqueue *q, u64 *spacewaitusec, u64 *headwaitusec)
+{
+    if (!q || !spacewaitusec || !headwaitusec)
+    {   errprintf("a parameter is null\n");
+        return FSAERR_EINVAL;
+    }
+    
+    assert(pthread_mutex_lock(&q->mutex)==0);
+    *spacewaitusec=q->spacewaitusec;
+    *headwaitusec=q->headwaitusec;
     assert(pthread_mutex_unlock(&q->mutex)==0);
-    return FSAERR_ENOENT; // not found
+    
+    return FSAERR_SUCCESS;
 }
 
 // get number of items to be processed
 s64 queue_count_items_todo(cqueue *q)
 {
-    cqueueitem *cur;
-    s64 count=0;
+    s64 count;
     
     if (!q)
     {   errprintf("a parameter is null\n");
@@ -358,26 +603,65 @@ s64 queue_count_items_todo(cqueue *q)
     }
     
     assert(pthread_mutex_lock(&q->mutex)==0);
+    count=q->todocount;
+    assert(pthread_mutex_unlock(&q->mutex)==0);
     
-    for (cur=q->head; cur!=NULL; cur=cur->next)
-    {
-        if ((cur->type==QITEM_TYPE_BLOCK) && (cur->status!=QITEM_STATUS_DONE))
-            count++;
+    return count;
+}
+
+// wait until all the blocks in the queue have been processed by the compression threads
+s64 queue_wait_no_items_todo(cqueue *q)
+{
+    if (!q)
+    {   errprintf("a parameter is null\n");
+        return FSAERR_EINVAL;
     }
     
+    assert(pthread_mutex_lock(&q->mutex)==0);
+    while ((q->todocount>0) && (queuelocked_get_end_of_queue(q)==false))
+        pthread_cond_wait(&q->condempty, &q->mutex);
     assert(pthread_mutex_unlock(&q->mutex)==0);
     
-    return count;
+    return FSAERR_SUCCESS;
+}
+
+// wait until the consumer has removed all the items from the queue
+s64 queue_wait_empty(cqueue *q)
+{
+    if (!q)
+    {   errprintf("a parameter is null\n");
+        return FSAERR_EINVAL;
+    }
+    
+    assert(pthread_mutex_lock(&q->mutex)==0);
+    while (q->itemcount>0)
+        pthread_cond_wait(&q->condempty, &q->mutex);
+    assert(pthread_mutex_unlock(&q->mutex)==0);
+    
+    return FSAERR_SUCCESS;
 }
 
 // the compression thread requires the first block which has not yet been compressed
 s64 queue_get_first_block_todo(cqueue *q, cblockinfo *blkinfo)
+{
+    s64 itemnum;
+    s64 res;
+    
+    if ((res=queue_get_blocks_todo(q, 1, &itemnum, blkinfo, true))>0)
+        return itemnum; // ">0" means item found
+    else
+        return res;
+}
+
+// claim up to maxcount blocks which have not yet been processed (in the archive order)
+// returns how many blocks have been claimed, or 0 when (wait==false) and there is nothing to do
+s64 queue_get_blocks_todo(cqueue *q, int maxcount, s64 *itemnum, cblockinfo *blkinfo, bool wait)
 {
     cqueueitem *cur;
-    s64 itemfound=-1;
+    int count;
     int res;
     
-    if (!q || !blkinfo)
+    if (!q || !itemnum || !blkinfo || maxcount<1)
     {   errprintf("a parameter is null\n");
         return FSAERR_EINVAL;
     }
@@ -386,45 +670,47 @@ s64 queue_get_first_block_todo(cqueue *q, cblockinfo *blkinfo)
     
     while (queuelocked_get_end_of_queue(q)==false)
     {
-        for (cur=q->head; cur!=NULL; cur=cur->next)
+        // items before todonum have already been claimed so the search never goes backwards
+        for (count=0; (count < maxcount) && ((cur=queuelocked_get_item(q, q->todonum))!=NULL); q->todonum++)
         {
             if ((cur->type==QITEM_TYPE_BLOCK) && (cur->status==QITEM_STATUS_TODO))
             {
-                *blkinfo=cur->blkinfo;
+                blkinfo[count]=cur->blkinfo;
+                itemnum[count]=cur->itemnum;
                 cur->status=QITEM_STATUS_PROGRESS;
-                itemfound=cur->itemnum;
-                assert(pthread_mutex_unlock(&q->mutex)==0);
-                pthread_cond_broadcast(&q->cond);
-                return itemfound; // ">0" means item found
+                count++;
             }
         }
         
-        struct timespec t=get_timeout();
-        if ((res=pthread_cond_timedwait(&q->cond, &q->mutex, &t))!=0 && res!=ETIMEDOUT)
+        if (count>0 || wait==false)
         {   assert(pthread_mutex_unlock(&q->mutex)==0);
-            return FSAERR_UNKNOWN;
+            return count;
         }
         
+        if ((res=pthread_cond_wait(&q->condtodo, &q->mutex))!=0)
+        {   assert(pthread_mutex_unlock(&q->mutex)==0);
+            return FSAERR_UNKNOWN;
+        }
     }
     
     // if it failed at the other end of the queue
     assert(pthread_mutex_unlock(&q->mutex)==0);
     
-    if (queuelocked_get_end_of_queue(q))
-        return FSAERR_ENDOFFILE;
-    else
-        return FSAERR_UNKNOWN;
+    return FSAERR_ENDOFFILE;
 }
 
-// the writer thread requires the first block of the queue if it ready to go
-//s64 queue_dequeue_first(cqueue *q, int *type, char *magic, cdico **dico, cblockinfo *blkinfo)
-s64 queue_dequeue_first(cqueue *q, int *type, cheadinfo *headinfo, cblockinfo *blkinfo)
+// the writer thread requires the first items of the queue when they are ready to go
+// it waits for the first item and takes the next ones which are also ready, up to maxcount
+// items or until maxbytes is reached, so that they can be written with a single system call
+// returns how many items have been copied in the arrays
+s64 queue_dequeue_first(cqueue *q, int maxcount, u64 maxbytes, int *type, cheadinfo *headinfo, cblockinfo *blkinfo)
 {
     cqueueitem *cur=NULL;
-    s64 itemfound=-1;
+    u64 bytes;
+    int count;
     int ret;
     
-    if (!q || !headinfo || !blkinfo)
+    if (!q || !type || !headinfo || !blkinfo || maxcount<1)
     {   errprintf("a parameter is null\n");
         return FSAERR_EINVAL;
     }
@@ -433,32 +719,16 @@ s64 queue_dequeue_first(cqueue *q, int *type, cheadinfo *headinfo, cblockinfo *b
     
     while (queuelocked_get_end_of_queue(q)==false)
     {
-        if (((cur=q->head)!=NULL) && (cur->status==QITEM_STATUS_DONE))
+        for (count=0, bytes=0; (count < maxcount) && (count==0 || bytes < maxbytes) &&
+            ((cur=queuelocked_get_head(q))!=NULL) && (cur->status==QITEM_STATUS_DONE); count++)
         {
             if (cur->type==QITEM_TYPE_BLOCK) // item to dequeue is a block
             {
-                q->blkcount--;
-                *type=cur->type;
-                itemfound=cur->itemnum;
-                *blkinfo=cur->blkinfo;
-                q->head=cur->next;
-                free(cur);
-                q->itemcount--;
-                assert(pthread_mutex_unlock(&q->mutex)==0);
-                pthread_cond_broadcast(&q->cond);
-                return itemfound; // ">0" means item found
+                blkinfo[count]=cur->blkinfo;
             }
             else if (cur->type==QITEM_TYPE_HEADER) // item to dequeue is a dico
             {
-                *headinfo=cur->headinfo;
-                *type=cur->type;
-                itemfound=cur->itemnum;
-                q->head=cur->next;
-                free(cur);
-                q->itemcount--;
-                assert(pthread_mutex_unlock(&q->mutex)==0);
-                pthread_cond_broadcast(&q->cond);
-                return itemfound; // ">0" means item found
+                headinfo[count]=cur->headinfo;
             }
             else
             {
@@ -466,10 +736,17 @@ s64 queue_dequeue_first(cqueue *q, int *type, cheadinfo *headinfo, cblockinfo *b
                 assert(pthread_mutex_unlock(&q->mutex)==0);
                 return FSAERR_EINVAL;
             }
+            type[count]=cur->type;
+            bytes+=cur->itembytes;
+            queuelocked_remove_head(q);
         }
         
-        struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
+        if (count>0)
+        {   assert(pthread_mutex_unlock(&q->mutex)==0);
+            return count; // ">0" means items found
+        }
+        
+        queuelocked_wait(q, &q->condhead, &q->headwaitusec, PIPESTATS_QUEUEGET);
     }
     
     // if it failed at the other end of the queue
@@ -493,10 +770,9 @@ s64 queue_dequeue_block(cqueue *q, cblockinfo *blkinfo)
     assert(pthread_mutex_lock(&q->mutex)==0);
     
     // while ((first-item-of-the-queue-is-not-ready) && (not-at-the-end-of-the-queue))
-    while ( (((cur=q->head)==NULL) || (cur->status!=QITEM_STATUS_DONE)) && (queuelocked_get_end_of_queue(q)==false) )
+    while ( (((cur=queuelocked_get_head(q))==NULL) || (cur->status!=QITEM_STATUS_DONE)) && (queuelocked_get_end_of_queue(q)==false) )
     {
-        struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
+        queuelocked_wait(q, &q->condhead, &q->headwaitusec, PIPESTATS_QUEUEGET);
     }
     
     // if it failed at the other end of the queue
@@ -506,26 +782,21 @@ s64 queue_dequeue_block(cqueue *q, cblockinfo *blkinfo)
     }
     
     // should not happen since queuelocked_is_first_block_ready means there is at least one block in the queue
-    assert((cur=q->head)!=NULL);
+    assert((cur=queuelocked_get_head(q))!=NULL);
     
     // test the first item
     if ((cur->type==QITEM_TYPE_BLOCK) && (cur->status==QITEM_STATUS_DONE))
     {
         *blkinfo=cur->blkinfo;
-        q->head=cur->next;
         itemnum=cur->itemnum;
-        free(cur);
-        q->blkcount--;
-        q->itemcount--;
+        queuelocked_remove_head(q);
         assert(pthread_mutex_unlock(&q->mutex)==0);
-        pthread_cond_broadcast(&q->cond);
         return itemnum;
     }
     else
     {
         errprintf("dequeue - wrong type of data in the queue: wanted a block, found an header\n");
         assert(pthread_mutex_unlock(&q->mutex)==0);
-        pthread_cond_broadcast(&q->cond);
         return FSAERR_WRONGTYPE;  // ok but not found
     }
 }
@@ -565,10 +836,9 @@ s64 queue_dequeue_header_internal(cqueue *q, cheadinfo *headinfo)
     assert(pthread_mutex_lock(&q->mutex)==0);
     
     // while ((first-item-of-the-queue-is-not-ready) && (not-at-the-end-of-the-queue))
-    while ( (((cur=q->head)==NULL) || (cur->status!=QITEM_STATUS_DONE)) && (queuelocked_get_end_of_queue(q)==false) )
+    while ( (((cur=queuelocked_get_head(q))==NULL) || (cur->status!=QITEM_STATUS_DONE)) && (queuelocked_get_end_of_queue(q)==false) )
     {
-        struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
+        queuelocked_wait(q, &q->condhead, &q->headwaitusec, PIPESTATS_QUEUEGET);
     }
     
     // if it failed at the other end of the queue
@@ -578,29 +848,24 @@ s64 queue_dequeue_header_internal(cqueue *q, cheadinfo *headinfo)
     }
     
     // should not happen since queuelocked_is_first_block_ready means there is at least one block in the queue
-    assert ((cur=q->head)!=NULL);
+    assert ((cur=queuelocked_get_head(q))!=NULL);
     
     // test the first item
     switch (cur->type)
     {
         case QITEM_TYPE_HEADER:
-            q->head=cur->next;
             *headinfo=cur->headinfo;
             itemnum=cur->itemnum;
-            free(cur);
-            q->itemcount--;
+            queuelocked_remove_head(q);
             assert(pthread_mutex_unlock(&q->mutex)==0);
-            pthread_cond_broadcast(&q->cond);
             return itemnum;
         case QITEM_TYPE_BLOCK:
             errprintf("dequeue - wrong type of data in the queue: expected a dico and found a block\n");
             assert(pthread_mutex_unlock(&q->mutex)==0);
-            pthread_cond_broadcast(&q->cond);
             return FSAERR_WRONGTYPE;  // ok but not found
         default: // should never happen
             errprintf("dequeue - wrong type of data in the queue: expected a dico and found an unknown item\n");
             assert(pthread_mutex_unlock(&q->mutex)==0);
-            pthread_cond_broadcast(&q->cond);
             return FSAERR_WRONGTYPE;  // ok but not found
     }
 }
@@ -615,10 +880,10 @@ bool queuelocked_is_first_item_ready(cqueue *q)
         return false; // not found
     }
     
-    if ((cur=q->head)==NULL)
+    if ((cur=queuelocked_get_head(q))==NULL)
         return false; // list empty
-    else if (cur->type==QITEM_TYPE_HEADER)
-        return true; // a dico is always ready
+    else if ((cur->type==QITEM_TYPE_HEADER) && (cur->status==QITEM_STATUS_DONE))
+        return true; // a dico is ready unless it waits for the md5 of a file
     else if ((cur->type==QITEM_TYPE_BLOCK) && (cur->status==QITEM_STATUS_DONE))
         return true; // a block which has been prepared is ready
     else // other cases: block not yet prepared
@@ -641,10 +906,9 @@ s64 queue_check_next_item(cqueue *q, int *type, char *magic)
     assert(pthread_mutex_lock(&q->mutex)==0);
     
     // while ((first-item-of-the-queue-is-not-ready) && (not-at-the-end-of-the-queue))
-    while ( (((cur=q->head)==NULL) || (cur->status!=QITEM_STATUS_DONE)) && (queuelocked_get_end_of_queue(q)==false) )
+    while ( (((cur=queuelocked_get_head(q))==NULL) || (cur->status!=QITEM_STATUS_DONE)) && (queuelocked_get_end_of_queue(q)==false) )
     {
-        struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
+        queuelocked_wait(q, &q->condhead, &q->headwaitusec, PIPESTATS_QUEUEGET);
     }
     
     // if it failed at the other end of the queue
@@ -654,7 +918,7 @@ s64 queue_check_next_item(cqueue *q, int *type, char *magic)
     }
     
     // test the first item
-    if (((cur=q->head)!=NULL) && (cur->status==QITEM_STATUS_DONE))
+    if (((cur=queuelocked_get_head(q))!=NULL) && (cur->status==QITEM_STATUS_DONE))
     {
         if (cur->type==QITEM_TYPE_BLOCK) // item to dequeue is a block
         {
@@ -679,7 +943,6 @@ s64 queue_check_next_item(cqueue *q, int *type, char *magic)
     }
     
     assert(pthread_mutex_unlock(&q->mutex)==0);
-    pthread_cond_broadcast(&q->cond);
     
     return FSAERR_ENOENT;  // not found
 }
@@ -697,9 +960,8 @@ s64 queue_destroy_first_item(cqueue *q)
     assert(pthread_mutex_lock(&q->mutex)==0);
     
     // while ((first-item-of-the-queue-is-not-ready or first-item-is-being-processed-by-comp-thread) && (not-at-the-end-of-the-queue))
-    while ( (((cur=q->head)==NULL) || (cur->status==QITEM_STATUS_PROGRESS)) && (queuelocked_get_end_of_queue(q)==false) )
-    {   struct timespec t=get_timeout();
-        pthread_cond_timedwait(&q->cond, &q->mutex, &t);
+    while ( (((cur=queuelocked_get_head(q))==NULL) || (cur->status==QITEM_STATUS_PROGRESS)) && (queuelocked_get_end_of_queue(q)==false) )
+    {   pthread_cond_wait(&q->condhead, &q->mutex);
     }
     
     // if it failed at the other end of the queue
@@ -709,23 +971,19 @@ s64 queue_destroy_first_item(cqueue *q)
     }
     
     // should not happen since queuelocked_is_first_block_ready means there is at least one block in the queue
-    assert((cur=q->head)!=NULL);
+    assert((cur=queuelocked_get_head(q))!=NULL);
     
     switch (cur->type)
     {
         case QITEM_TYPE_BLOCK:
-            q->blkcount--;
-            free(cur->blkinfo.blkdata);
+            bufpool_free(cur->blkinfo.blkdata);
             break;
         case QITEM_TYPE_HEADER:
             dico_destroy(cur->headinfo.dico);
             break;
     }
     
-    q->head=cur->next;
-    free(cur);
-    q->itemcount--;
+    queuelocked_remove_head(q);
     assert(pthread_mutex_unlock(&q->mutex)==0);
-    pthread_cond_broadcast(&q->cond);
     return FSAERR_SUCCESS;
 }
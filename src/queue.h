@@ -20,6 +20,8 @@
 
 #include <pthread.h>
 
+#define QUEUE_MIN_SLOTS 64 // initial size of the ring buffer which stores the items
+
 enum {QITEM_STATUS_NULL=0, QITEM_STATUS_TODO, QITEM_STATUS_PROGRESS, QITEM_STATUS_DONE};
 enum {QITEM_TYPE_NULL=0, QITEM_TYPE_BLOCK, QITEM_TYPE_HEADER};
 
@@ -28,6 +30,8 @@ struct s_dico;
 struct s_blockinfo;
 typedef struct s_blockinfo cblockinfo;
 
+struct s_blkhashlist;
+
 struct s_headinfo;
 typedef struct s_headinfo cheadinfo;
 
@@ -41,13 +45,19 @@ struct s_blockinfo // used when (type==QITEM_TYPE_BLOCK)
 {   char                 *blkdata; // pointer to data block as it is at a particular time (compressed or uncompressed)
     u32                  blkrealsize; // size of the data in the normal state (not compressed and not crypted)
     u64                  blkoffset; // offset of the block in the normal file
-    u32                  blkarcsum; // checksum of the block as it it when it's in the archive (compressed and encrypted)
+    u64                  blkarcsum; // checksum of the block as it it when it's in the archive (compressed and encrypted)
+    u16                  blksumalgo; // CHECKSUM_xxx algorithm used for blkarcsum
     u32                  blkarsize; // size of the block as it is in the archive (compressed and encrypted)
     u16                  blkcompalgo; // algo used to compressed the block
     u32                  blkcompsize; // size of the block after compression and before encryption
     u16                  blkcryptalgo; // algo used to compressed the block
     u16                  blkfsid; // id of filesystem to which the block belongs
+    u8                   blkhint; // BLKHINT_xxx: what the reader already knows about the compressibility of the block
     bool                 blklocked; // true if locked (being processed in the compress/crypt thread)
+    bool                 blkhashed; // true if blkhash contains the hash of the contents of the block
+    u8                   blkhash[FSA_BLKHASH_SIZE]; // sha256 of the data in the normal state (not compressed and not crypted)
+    struct s_blkhashlist *blkhashlist; // save: list of the hashes of the file which receives blkhash
+    u64                  blkhashidx; // save: position of the block in blkhashlist
 };
 
 struct s_headinfo // used when (type==QITEM_TYPE_HEADER)
@@ -60,19 +70,29 @@ struct s_queueitem
 {   int                  type; // QITEM_TYPE_BLOCK or QITEM_TYPE_HEADER
     int                  status; // compressed, being-compressed, not-yet-compressed
     s64                  itemnum; // unique identifier of the item in the queue
-    cqueueitem           *next; // next block in the linked list
+    u64                  itembytes; // memory used by the item (counted in the memory budget of the queue)
     cblockinfo           blkinfo; // used when type==QITEM_TYPE_BLOCK (for blocks only)
     cheadinfo            headinfo; // used when type==QITEM_TYPE_HEADER (for headers only)
 };
 
 struct s_queue
-{   cqueueitem           *head; // head of the queue: first item
+{   cqueueitem           *items; // ring buffer: item number N is stored in items[N & (slotcount-1)]
+    u64                  slotcount; // size of the ring buffer (always a power of two)
+    s64                  headnum; // item number of the first item of the queue (next to be dequeued)
+    s64                  todonum; // no block with an item number lower than this one is in the TODO state
     pthread_mutex_t      mutex; // pthread mutex for data protection
-    pthread_cond_t       cond; // condition for pthread synchronization
+    pthread_cond_t       condspace; // signaled when a block can be added because the queue is not full any more
+    pthread_cond_t       condtodo; // signaled when there is a new block to be processed by a compression thread
+    pthread_cond_t       condhead; // signaled when the first item of the queue has changed or has been processed
+    pthread_cond_t       condempty; // signaled when all the blocks have been processed or when the queue is empty
     s64                  curitemnum; // unique id given to every new item (block or header)
     u64                  itemcount; // how many items there are (headers + blocks)
+    u64                  todocount; // how many blocks there are which are not yet in the DONE state
     u64                  blkcount; // how many blocks items there are (items where type==QITEM_TYPE_BLOCK only)
-    u64                  blkmax; // how many blocks items there can be before the queue is considered as full
+    u64                  bytecount; // memory used by the items in the queue (block data + header dicos)
+    u64                  bytemax; // memory budget: new items have to wait when bytecount would exceed that
+    u64                  spacewaitusec; // total time spent by the producer waiting for space in the queue
+    u64                  headwaitusec; // total time spent by the consumer waiting for the first item to be ready
     bool                 endofqueue; // set to true when no more data to put in queue (like eof): reader must stop
 };
 
@@ -82,8 +102,9 @@ struct s_queue
 // c) "<0" QERR error number
 
 // init and destroy
-s64  queue_init(cqueue *l, s64 blkmax);
+s64  queue_init(cqueue *l, u64 bytemax);
 s64  queue_destroy(cqueue *l);
+s64  queue_set_memory_limit(cqueue *q, u64 bytemax);
 
 // information functions
 s64  queue_count(cqueue *l);
@@ -91,12 +112,20 @@ s64  queue_count_status(struct s_queue *l, int status);
 s64  queue_is_first_item_ready(struct s_queue *q);
 s64  queue_check_next_item(cqueue *q, int *type, char *magic);
 s64  queue_count_items_todo(cqueue *q);
+s64  queue_get_wait_times(cqueue *q, u64 *spacewaitusec, u64 *headwaitusec);
+
+// wait functions
+s64  queue_wait_no_items_todo(cqueue *q);
+s64  queue_wait_empty(cqueue *q);
 
 // modification functions
 s64  queue_add_block(cqueue *q, cblockinfo *blkinfo, int status);
 s64  queue_add_header(cqueue *q, struct s_dico *d, char *magic, u16 fsid);
 s64  queue_add_header_internal(cqueue *q, cheadinfo *headinfo);
+s64  queue_add_header_pending(cqueue *q, struct s_dico *d, char *magic, u16 fsid);
+s64  queue_set_header_ready(cqueue *q, s64 itemnum);
 s64  queue_replace_block(cqueue *q, s64 itemnum, cblockinfo *blkinfo, int newstatus);
+s64  queue_replace_blocks(cqueue *q, int count, s64 *itemnum, cblockinfo *blkinfo, int newstatus, bool trylock);
 s64  queue_destroy_first_item(cqueue *q);
 
 // end of queue functions
@@ -105,9 +134,10 @@ bool queue_get_end_of_queue(cqueue *q);
 
 // get item from queue functions
 s64  queue_get_first_block_todo(cqueue *q, cblockinfo *blkinfo);
+s64  queue_get_blocks_todo(cqueue *q, int maxcount, s64 *itemnum, cblockinfo *blkinfo, bool wait);
 s64  queue_dequeue_header(cqueue *q, struct s_dico **d, char *magicbuf, u16 *fsid);
 s64  queue_dequeue_header_internal(cqueue *q, cheadinfo *headinfo);
 s64  queue_dequeue_block(cqueue *q, cblockinfo *blkinfo);
-s64  queue_dequeue_first(cqueue *q, int *type, cheadinfo *headinfo, cblockinfo *blkinfo);
+s64  queue_dequeue_first(cqueue *q, int maxcount, u64 maxbytes, int *type, cheadinfo *headinfo, cblockinfo *blkinfo);
 
 #endif // __QUEUE_H__
@@ -29,6 +29,8 @@
 #include "common.h"
 #include "queue.h"
 #include "error.h"
+#include "bufpool.h"
+#include "thread_hash.h"
 
 int regmulti_empty(cregmulti *m)
 {
@@ -111,6 +113,7 @@ int regmulti_save_addfile(cregmulti *m, cdico *header, char *data, u32 datsize)
 // add headers and datblock at the end of the queue
 int regmulti_save_enqueue(cregmulti *m, cqueue *q, int fsid)
 {
+    cfilehash *filehash;
     cblockinfo blkinfo;
     char *dynblock;
     u32 offset=0;
@@ -126,45 +129,56 @@ int regmulti_save_enqueue(cregmulti *m, cqueue *q, int fsid)
     if (m->count==0)
         return 0;
     
+    // make a copy of the static block to a buffer which can be handed to the other threads
+    if ((dynblock=bufpool_alloc(m->usedsize)) == NULL)
+    {   errprintf("bufpool_alloc(%ld) failed: out of memory\n", (long)m->usedsize);
+        return -1;
+    }
+    memcpy(dynblock, m->data, m->usedsize);
+    
     for (i=0; i < m->count; i++)
     {
         if (m->objhead[i]==NULL)
         {   errprintf("error: objhead[%d]==NULL\n", i);
-            return -1;
+            goto regmulti_save_enqueue_error;
         }
         
         // get file size from header
         if (dico_get_u64(m->objhead[i], DICO_OBJ_SECTION_STDATTR, DISKITEMKEY_SIZE, &filesize)!=0)
         {   errprintf("Cannot read filesize DISKITEMKEY_SIZE from archive\n");
-            return -1;
+            goto regmulti_save_enqueue_error;
         }
         
         // the extraction function needs to know how many small-files are packed together
         if (dico_add_u32(m->objhead[i], DICO_OBJ_SECTION_STDATTR, DISKITEMKEY_MULTIFILESCOUNT, (u32)m->count)!=0)
         {   errprintf("dico_add_u32(DISKITEMKEY_MULTIFILESCOUNT) failed\n");
-            return -1;
+            goto regmulti_save_enqueue_error;
         }
         
         // the extraction function needs to know where the data for this file are in the block
         if (dico_add_u32(m->objhead[i], DICO_OBJ_SECTION_STDATTR, DISKITEMKEY_MULTIFILESOFFSET, (u32)offset)!=0)
         {   errprintf("dico_add_u32(DISKITEMKEY_MULTIFILESCOUNT) failed\n");
-            return -1;
+            goto regmulti_save_enqueue_error;
+        }
+        
+        // the md5 thread hashes the data of the file in the shared block and adds the md5 to the header
+        if ((filehash=filehash_alloc())==NULL)
+        {   errprintf("filehash_alloc() failed\n");
+            goto regmulti_save_enqueue_error;
+        }
+        if (filehash_write(filehash, dynblock, dynblock+offset, filesize)!=0)
+        {   errprintf("filehash_write() failed\n");
+            filehash_final(filehash, NULL, 0);
+            goto regmulti_save_enqueue_error;
         }
         offset+=(u32)filesize;
         
-        if (queue_add_header(q, m->objhead[i], FSA_MAGIC_OBJT, fsid)!=0)
+        if (filehash_add_header(filehash, q, m->objhead[i], FSA_MAGIC_OBJT, fsid, DICO_OBJ_SECTION_STDATTR, DISKITEMKEY_MD5SUM)!=0)
         {   errprintf("queue_add_header() failed\n");
-            return -1;
+            goto regmulti_save_enqueue_error;
         }
     }
     
-    // make a copy of the static block to dynamic memory
-    if ((dynblock=malloc(m->usedsize)) == NULL)
-    {   errprintf("malloc(%ld) failed: out of memory\n", (long)m->usedsize);
-        return -1;
-    }
-    memcpy(dynblock, m->data, m->usedsize);
-    
     memset(&blkinfo, 0, sizeof(blkinfo));
     blkinfo.blkrealsize=m->usedsize;
     blkinfo.blkdata=(char*)dynblock;
@@ -172,10 +186,14 @@ int regmulti_save_enqueue(cregmulti *m, cqueue *q, int fsid)
     blkinfo.blkfsid=fsid;
     if (queue_add_block(q, &blkinfo, QITEM_STATUS_TODO)!=0)
     {   errprintf("queue_add_block() failed\n");
-        return -1;
+        goto regmulti_save_enqueue_error;
     }
     
-     return 0;
+    return 0;
+    
+regmulti_save_enqueue_error:
+    bufpool_free(dynblock);
+    return -1;
 }
 
 int regmulti_rest_addheader(cregmulti *m, cdico *header)
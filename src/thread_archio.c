@@ -31,14 +31,22 @@
 #include "error.h"
 #include "syncthread.h"
 #include "queue.h"
+#include "bufpool.h"
+#include "checksum.h"
+#include "archinfo.h"
+#include "options.h"
+#include "crypto.h"
+#include "archindex.h"
+#include "strlist.h"
 
 void *thread_writer_fct(void *args)
 {
-    struct s_headinfo headinfo;
-    struct s_blockinfo blkinfo;
+    struct s_headinfo headinfo[ARCHWRITER_MAXITEMS];
+    struct s_blockinfo blkinfo[ARCHWRITER_MAXITEMS];
+    int type[ARCHWRITER_MAXITEMS];
     carchwriter *ai=NULL;
-    s64 blknum;
-    int type;
+    s64 count;
+    int i;
     
     // init
     inc_secthreads();
@@ -62,33 +70,49 @@ void *thread_writer_fct(void *args)
     
     while (queue_get_end_of_queue(&g_queue)==false)
     {
-        if ((blknum=queue_dequeue_first(&g_queue, &type, &headinfo, &blkinfo))<0 && blknum!=FSAERR_ENDOFFILE) // error
-        {   msgprintf(MSG_STACK, "queue_dequeue_first()=%ld=%s failed\n", (long)blknum, error_int_to_string(blknum));
+        // all the consecutive items which are ready are written together
+        if ((count=queue_dequeue_first(&g_queue, ARCHWRITER_MAXITEMS, ARCHWRITER_MAXBATCH, type, headinfo, blkinfo))<0 && count!=FSAERR_ENDOFFILE) // error
+        {   msgprintf(MSG_STACK, "queue_dequeue_first()=%ld=%s failed\n", (long)count, error_int_to_string(count));
             goto thread_writer_fct_error;
         }
-        else if (blknum>0) // block or header found
+        
+        for (i=0; i < count; i++)
         {
-            switch (type)
+            switch (type[i])
             {
                 case QITEM_TYPE_BLOCK:
-                    if (archwriter_dowrite_block(ai, &blkinfo)!=0)
+                    if (archwriter_dowrite_block(ai, &blkinfo[i])!=0)
                     {   msgprintf(MSG_STACK, "archive_dowrite_block() failed\n");
                         goto thread_writer_fct_error;
                     }
-                    free(blkinfo.blkdata);
                     break;
                 case QITEM_TYPE_HEADER:
-                    if (archwriter_dowrite_header(ai, &headinfo)!=0)
+                    if (archwriter_dowrite_header(ai, &headinfo[i])!=0)
                     {   msgprintf(MSG_STACK, "archive_write_header() failed\n");
                         goto thread_writer_fct_error;
                     }
-                    dico_destroy(headinfo.dico);
                     break;
                 default:
-                    errprintf("unexpected item type from queue: type=%d\n", type);
+                    errprintf("unexpected item type from queue: type=%d\n", type[i]);
                     break;
             }
         }
+        
+        // the buffers of the blocks are released by the archwriter when they have been written
+        if (archwriter_flush(ai)!=0)
+        {   msgprintf(MSG_STACK, "archwriter_flush() failed\n");
+            goto thread_writer_fct_error;
+        }
+        
+        for (i=0; i < count; i++)
+            if (type[i]==QITEM_TYPE_HEADER)
+                dico_destroy(headinfo[i].dico);
+    }
+    
+    // the index goes after the contents and before the last volume footer which says where it starts
+    if (archwriter_write_index(ai)!=0)
+    {   msgprintf(MSG_STACK, "archwriter_write_index() failed\n");
+        goto thread_writer_fct_error;
     }
     
     // write last volume footer
@@ -96,7 +120,10 @@ void *thread_writer_fct(void *args)
     {   msgprintf(MSG_STACK, "cannot write volume footer: archio_write_volfooter() failed\n");
         goto thread_writer_fct_error;
     }
-    archwriter_close(ai);
+    if (archwriter_close(ai)!=0)
+    {   msgprintf(MSG_STACK, "archwriter_close() failed\n");
+        goto thread_writer_fct_error;
+    }
     msgprintf(MSG_DEBUG1, "THREAD-WRITER: exit success\n");
     dec_secthreads();
     return NULL;
@@ -114,14 +141,23 @@ thread_writer_fct_error:
 void *thread_reader_fct(void *args)
 {
     char magic[FSA_SIZEOF_MAGIC];
+    u8 kdfsalt[CRYPTO_KDF_SALTSIZE];
     struct s_blockinfo blkinfo;
     u32 endofarchive=false;
+    u32 iterations;
+    u32 cryptalgo;
+    u16 saltsize;
     carchreader *ai=NULL;
+    carchindex *index=NULL;
+    bool indextried=false;
+    carchindexfs fspos;
+    carchindexrange *skips=NULL;
+    u64 skipcount=0;
+    u64 skipnext=0;
+    s64 curpos;
     cdico *dico=NULL;
     int skipblock;
     u16 fsid;
-    int sumok;
-    int status;
     u64 errors;
     s64 lres;
     int res;
@@ -163,14 +199,76 @@ void *thread_reader_fct(void *args)
         goto thread_reader_fct_error;
     }
     
+    // the next headers are verified with the checksum of the archive (MAINHEADKEY_CHECKSUMALGO is missing when it is fletcher32)
+    if (dico_get_u16(dico, 0, MAINHEADKEY_CHECKSUMALGO, &ai->sumalgo)!=0)
+        ai->sumalgo=CHECKSUM_FLETCHER32;
+    if (checksum_supported(ai->sumalgo)==false)
+    {   errprintf("the checksum algorithm of this archive (%s) is not supported by this version of fsarchiver\n", sumalgostr(ai->sumalgo));
+        goto thread_reader_fct_error;
+    }
+    
+    // the key of the authenticated ciphers must be derived before the blocks are given to the decompression threads
+    if ((dico_get_u32(dico, 0, MAINHEADKEY_ENCRYPTALGO, &cryptalgo)==0) && (cryptalgo>ENCRYPT_BLOWFISH) && (g_options.encryptalgo!=ENCRYPT_NONE))
+    {
+        if (crypto_supported(cryptalgo)==false)
+        {   errprintf("the encryption algorithm of this archive (%s) is not supported by this version of fsarchiver\n", cryptalgostr(cryptalgo));
+            goto thread_reader_fct_error;
+        }
+        if ((dico_get_data(dico, 0, MAINHEADKEY_KDFSALT, kdfsalt, sizeof(kdfsalt), &saltsize)!=0) ||
+            (dico_get_u32(dico, 0, MAINHEADKEY_KDFITERATIONS, &iterations)!=0))
+        {   errprintf("cannot find MAINHEADKEY_KDFSALT and MAINHEADKEY_KDFITERATIONS in main-header\n");
+            goto thread_reader_fct_error;
+        }
+        if (crypto_setkey(cryptalgo, g_options.encryptpass, strlen((char*)g_options.encryptpass), kdfsalt, saltsize, iterations)!=0)
+        {   errprintf("crypto_setkey() failed\n");
+            goto thread_reader_fct_error;
+        }
+    }
+    
     if ((lres=queue_add_header(&g_queue, dico, magic, fsid))!=FSAERR_SUCCESS)
     {   errprintf("queue_add_header()=%ld=%s failed to add the archive header\n", (long)lres, error_int_to_string(lres));
         goto thread_reader_fct_error;
     }
     
+    // with --only the index says which parts of the archive have no selected object
+    if (strlist_count(&g_options.only)>0)
+    {
+        indextried=true;
+        if (((index=archindex_alloc())!=NULL) && (archindex_load(index, ai, true)!=0))
+        {   archindex_destroy(index);
+            index=NULL;
+        }
+        if ((index!=NULL) && (archindex_get_skips(index, &g_options.only, g_fsbitmap, &skips, &skipcount)!=0))
+        {   msgprintf(MSG_STACK, "archindex_get_skips() failed\n");
+            goto thread_reader_fct_error;
+        }
+        if (index==NULL)
+            msgprintf(MSG_VERB1, "the archive has no index: all its contents have to be read\n");
+        else
+            msgprintf(MSG_VERB2, "%lld parts of the archive will be skipped\n", (long long)skipcount);
+    }
+    
     // read all other data from file (filesys-header, normal objects headers, ...)
     while (endofarchive==false && get_stopfillqueue()==false)
     {
+        // jump over the objects which are not selected when the next header is where such a part starts
+        if (skipnext < skipcount)
+        {
+            curpos=archreader_get_pos(ai);
+            while ((skipnext < skipcount) && ((skips[skipnext].startvol < ai->curvol) || 
+                ((skips[skipnext].startvol==ai->curvol) && (skips[skipnext].startoff < curpos))))
+                skipnext++;
+            if ((skipnext < skipcount) && (skips[skipnext].startvol==ai->curvol) && (skips[skipnext].startoff==curpos))
+            {
+                msgprintf(MSG_DEBUG1, "skipping offset %lld to %lld\n", (long long)skips[skipnext].startoff, (long long)skips[skipnext].endoff);
+                if (archreader_goto(ai, skips[skipnext].endvol, skips[skipnext].endoff)!=0)
+                {   msgprintf(MSG_STACK, "archreader_goto() failed\n");
+                    goto thread_reader_fct_error;
+                }
+                skipnext++;
+            }
+        }
+        
         if ((res=archreader_read_header(ai, magic, &dico, true, &fsid))!=FSAERR_SUCCESS)
         {   dico_destroy(dico);
             msgprintf(MSG_STACK, "archreader_read_header() failed to read next header\n");
@@ -203,8 +301,7 @@ void *thread_reader_fct(void *args)
                 while (regfile_exists(ai->volpath)!=true)
                 {
                     // wait until the queue is empty so that the main thread does not pollute the screen
-                    while (queue_count(&g_queue)>0)
-                        usleep(5000);
+                    queue_wait_empty(&g_queue);
                     fflush(stdout);
                     fflush(stderr);
                     msgprintf(MSG_FORCE, "File [%s] is not found, please type the path to volume %ld:\n", ai->volpath, (long)ai->curvol);
@@ -229,24 +326,27 @@ void *thread_reader_fct(void *args)
             if (strncmp(magic, FSA_MAGIC_BLKH, FSA_SIZEOF_MAGIC)==0) // header starts a data block
             {
                 skipblock=(g_fsbitmap[fsid]==0);
-                //errprintf("DEBUG: skipblock=%d g_fsbitmap[fsid=%d]=%d\n", skipblock, (int)fsid, (int)g_fsbitmap[fsid]);
-                if (archreader_read_block(ai, dico, skipblock, &sumok, &blkinfo)!=0)
+                if (archreader_read_block(ai, dico, skipblock, &blkinfo)!=0)
                 {   msgprintf(MSG_STACK, "archreader_read_block() failed\n");
                     goto thread_reader_fct_error;
                 }
                 
                 if (skipblock==false)
                 {
-                    status=((sumok==true)?QITEM_STATUS_TODO:QITEM_STATUS_DONE);
-                    if ((lres=queue_add_block(&g_queue, &blkinfo, status))!=FSAERR_SUCCESS)
+                    // the checksum is verified when the block is decompressed
+                    if ((lres=queue_add_block(&g_queue, &blkinfo, QITEM_STATUS_TODO))!=FSAERR_SUCCESS)
                     {   if (lres!=FSAERR_NOTOPEN)
                             errprintf("queue_add_block()=%ld=%s failed\n", (long)lres, error_int_to_string(lres));
+                        bufpool_free(blkinfo.blkdata); // else the read buffer it belongs to never goes back to the pool
                         goto thread_reader_fct_error;
                     }
-                    if (sumok==false) errors++;
                     dico_destroy(dico);
                 }
             }
+            else if (strncmp(magic, FSA_MAGIC_INDX, FSA_SIZEOF_MAGIC)==0) // the index is read by archindex_load() when it's needed
+            {
+                dico_destroy(dico);
+            }
             else // another higher level header
             {
                 // if it's a global header or a if this local header belongs to a filesystem that the main thread needs
@@ -260,12 +360,34 @@ void *thread_reader_fct(void *args)
                 else // header not used: remove data strucutre in dynamic memory
                 {
                     dico_destroy(dico);
+                    
+                    // when the archive has an index, jump to the end of a filesystem which is not restored
+                    if ((strncmp(magic, FSA_MAGIC_FSYB, FSA_SIZEOF_MAGIC)==0) && (fsid < FSA_MAX_FSPERARCH))
+                    {
+                        if (indextried==false)
+                        {   indextried=true;
+                            if (((index=archindex_alloc())!=NULL) && (archindex_load(index, ai, false)!=0))
+                            {   archindex_destroy(index);
+                                index=NULL;
+                            }
+                        }
+                        if ((index!=NULL) && (archindex_get_fs(index, fsid, &fspos)==true))
+                        {
+                            msgprintf(MSG_VERB2, "skipping filesystem %d: going to offset %lld of volume %ld\n", (int)fsid, (long long)fspos.endoff, (long)fspos.endvol);
+                            if (archreader_goto(ai, fspos.endvol, fspos.endoff)!=0)
+                            {   msgprintf(MSG_STACK, "archreader_goto() failed\n");
+                                goto thread_reader_fct_error;
+                            }
+                        }
+                    }
                 }
             }
         }
     }
     
 thread_reader_fct_error:
+    archindex_destroy(index);
+    free(skips);
     msgprintf(MSG_DEBUG1, "THREAD-READER: queue_set_end_of_queue(&g_queue, true)\n");
     queue_set_end_of_queue(&g_queue, true); // don't wait for more data from this thread
     dec_secthreads();
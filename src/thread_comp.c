@@ -23,7 +23,9 @@
 #include <time.h>
 #include <pthread.h>
 #include <string.h>
-#include <pthread.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/time.h>
 
 #include "fsarchiver.h"
 #include "common.h"
@@ -32,11 +34,25 @@
 #include "comp_bzip2.h"
 #include "comp_lzma.h"
 #include "comp_lzo.h"
+#include "comp_zstd.h"
+#include "comp_lz4.h"
 #include "crypto.h"
 #include "syncthread.h"
 #include "thread_comp.h"
 #include "error.h"
+#include "pipestats.h"
 #include "queue.h"
+#include "cpuinfo.h"
+#include "bufpool.h"
+#include "entropy.h"
+#include "checksum.h"
+#include "blkhash.h"
+
+// the controller looks at the pipeline every COMPCTL_INTERVAL_MSEC milli-seconds
+#define COMPCTL_INTERVAL_MSEC   250
+#define COMPCTL_BUSY_HIGH       85 // percentage of the time the active threads are using a cpu to compress
+#define COMPCTL_BUSY_LOW        50
+#define COMPCTL_STALL_HIGH      10 // percentage of the time the reader/writer threads wait for each other
 
 int compress_block_generic(struct s_blockinfo *blkinfo)
 {
@@ -46,71 +62,106 @@ int compress_block_generic(struct s_blockinfo *blkinfo)
     int complevel;
     u64 compsize;
     u64 bufsize;
+    u64 trystart;
+    u64 start;
     int res;
     
-    bufsize = (blkinfo->blkrealsize) + (blkinfo->blkrealsize / 16) + 64 + 3; // alloc bigger buffer else lzo will crash
-    if ((bufcomp=malloc(bufsize))==NULL)
-    {   errprintf("malloc(%ld) failed: out of memory\n", (long)bufsize);
-        return -1;
+    // hash the contents of the block before it's compressed (--block-hashes)
+    if (blkinfo->blkhashlist!=NULL)
+    {   blkhash_compute(blkinfo->blkhash, blkinfo->blkdata, blkinfo->blkrealsize);
+        blkinfo->blkhashed=true;
+        blkhashlist_set_block(blkinfo);
     }
     
-    // compression level/algo to use for the first attempt
-    compalgo=g_options.compressalgo;
-    complevel=g_options.compresslevel;
+    start=pipestats_start();
+    bufsize = (blkinfo->blkrealsize) + (blkinfo->blkrealsize / 16) + 64 + 3; // alloc bigger buffer else lzo will crash
     
-    // compress the block
-    do
+    // blocks which have been found incompressible are stored without calling the compression algorithm
+    if ((blkinfo->blkhint==BLKHINT_UNKNOWN) && (g_options.detectincomp!=INCOMP_DETECT_OFF) &&
+        (entropy_block_incompressible((u8*)blkinfo->blkdata, blkinfo->blkrealsize)==true))
+        blkinfo->blkhint=BLKHINT_STORE;
+    if (blkinfo->blkhint==BLKHINT_STORE)
+    {   pipestats_add_stored(blkinfo->blkrealsize);
+        res=FSAERR_SUCCESS;
+        compsize=blkinfo->blkrealsize;
+    }
+    else // try the compression algorithm
     {
-        switch (compalgo)
+        if ((bufcomp=bufpool_alloc(bufsize))==NULL)
+        {   errprintf("bufpool_alloc(%ld) failed: out of memory\n", (long)bufsize);
+            return -1;
+        }
+        
+        // compression level/algo to use for the first attempt
+        compalgo=g_options.compressalgo;
+        complevel=g_options.compresslevel;
+        
+        // compress the block
+        do
         {
+            trystart=pipestats_start();
+            switch (compalgo)
+            {
 #ifdef OPTION_LZO_SUPPORT
-            case COMPRESS_LZO:
-                res=compress_block_lzo(blkinfo->blkrealsize, &compsize, (u8*)blkinfo->blkdata, (void*)bufcomp, bufsize, complevel);
-                blkinfo->blkcompalgo=COMPRESS_LZO;
-                break;
+                case COMPRESS_LZO:
+                    res=compress_block_lzo(blkinfo->blkrealsize, &compsize, (u8*)blkinfo->blkdata, (void*)bufcomp, bufsize, complevel);
+                    blkinfo->blkcompalgo=COMPRESS_LZO;
+                    break;
 #endif // OPTION_LZO_SUPPORT
-            case COMPRESS_GZIP:
-                res=compress_block_gzip(blkinfo->blkrealsize, &compsize, (u8*)blkinfo->blkdata, (void*)bufcomp, bufsize, complevel);
-                blkinfo->blkcompalgo=COMPRESS_GZIP;
-                break;
-            case COMPRESS_BZIP2:
-                res=compress_block_bzip2(blkinfo->blkrealsize, &compsize, (u8*)blkinfo->blkdata, (void*)bufcomp, bufsize, complevel);
-                blkinfo->blkcompalgo=COMPRESS_BZIP2;
-                break;
+                case COMPRESS_GZIP:
+                    res=compress_block_gzip(blkinfo->blkrealsize, &compsize, (u8*)blkinfo->blkdata, (void*)bufcomp, bufsize, complevel);
+                    blkinfo->blkcompalgo=COMPRESS_GZIP;
+                    break;
+                case COMPRESS_BZIP2:
+                    res=compress_block_bzip2(blkinfo->blkrealsize, &compsize, (u8*)blkinfo->blkdata, (void*)bufcomp, bufsize, complevel);
+                    blkinfo->blkcompalgo=COMPRESS_BZIP2;
+                    break;
 #ifdef OPTION_LZMA_SUPPORT
-            case COMPRESS_LZMA:
-                res=compress_block_lzma(blkinfo->blkrealsize, &compsize, (u8*)blkinfo->blkdata, (void*)bufcomp, bufsize, complevel);
-                blkinfo->blkcompalgo=COMPRESS_LZMA;
-                break;
+                case COMPRESS_LZMA:
+                    res=compress_block_lzma(blkinfo->blkrealsize, &compsize, (u8*)blkinfo->blkdata, (void*)bufcomp, bufsize, complevel);
+                    blkinfo->blkcompalgo=COMPRESS_LZMA;
+                    break;
 #endif // OPTION_LZMA_SUPPORT
-            default:
-                free(bufcomp);
-                msgprintf(2, "invalid compression level: %d\n", (int)compalgo);
-                return -1;
-        }
-        
-        // retry if high compression was used and compression failed because of FSAERR_ENOMEM
-        if ((res == FSAERR_ENOMEM) && (compalgo > FSA_DEF_COMPRESS_ALGO))
-        {
-            errprintf("attempt to compress the current block using an alternative algorithm (\"-z%d\")\n", FSA_DEF_COMPRESS_ALGO);
-            compalgo = FSA_DEF_COMPRESS_ALGO;
-            complevel = FSA_DEF_COMPRESS_LEVEL;
-        }
-        
-    } while ((res == FSAERR_ENOMEM) && (attempt++ == 0));
+#ifdef OPTION_ZSTD_SUPPORT
+                case COMPRESS_ZSTD:
+                    res=compress_block_zstd(blkinfo->blkrealsize, &compsize, (u8*)blkinfo->blkdata, (void*)bufcomp, bufsize, complevel);
+                    blkinfo->blkcompalgo=COMPRESS_ZSTD;
+                    break;
+#endif // OPTION_ZSTD_SUPPORT
+#ifdef OPTION_LZ4_SUPPORT
+                case COMPRESS_LZ4:
+                    res=compress_block_lz4(blkinfo->blkrealsize, &compsize, (u8*)blkinfo->blkdata, (void*)bufcomp, bufsize, complevel);
+                    blkinfo->blkcompalgo=COMPRESS_LZ4;
+                    break;
+#endif // OPTION_LZ4_SUPPORT
+                default:
+                    bufpool_free(bufcomp);
+                    msgprintf(2, "invalid compression level: %d\n", (int)compalgo);
+                    return -1;
+            }
+            pipestats_add_codec_time(compalgo, blkinfo->blkrealsize, trystart);
+            
+            // retry if high compression was used and compression failed because of FSAERR_ENOMEM
+            if ((res == FSAERR_ENOMEM) && (compalgo > FSA_DEF_COMPRESS_ALGO))
+            {
+                errprintf("attempt to compress the current block using an alternative algorithm (\"-z%d\")\n", FSA_DEF_COMPRESS_ALGO);
+                compalgo = FSA_DEF_COMPRESS_ALGO;
+                complevel = FSA_DEF_COMPRESS_LEVEL;
+            }
+            
+        } while ((res == FSAERR_ENOMEM) && (attempt++ == 0));
+    }
     
     // check compression status and efficiency
     if ((res==FSAERR_SUCCESS) && (compsize < blkinfo->blkrealsize)) // compression worked and saved space
-    {   free(blkinfo->blkdata); // free old buffer (with uncompressed data)
+    {   bufpool_free(blkinfo->blkdata); // release old buffer (with uncompressed data)
         blkinfo->blkdata=bufcomp; // new buffer (with compressed data)
         blkinfo->blkcompsize=compsize; // size after compression and before encryption
         blkinfo->blkarsize=compsize; // in case there is no encryption to set this
         //errprintf ("COMP_DBG: block successfully compressed using %s\n", compress_algo_int_to_string(compalgo));
     }
-    else // compressed version is bigger or compression failed: keep the original block
-    {   memcpy(bufcomp, blkinfo->blkdata, blkinfo->blkrealsize);
-        free(blkinfo->blkdata); // free old buffer
-        blkinfo->blkdata=bufcomp; // new buffer
+    else // compressed version is bigger or compression failed: keep the original block (no copy)
+    {   bufpool_free(bufcomp);
         blkinfo->blkcompsize=blkinfo->blkrealsize; // size after compression and before encryption
         blkinfo->blkarsize=blkinfo->blkrealsize;  // in case there is no encryption to set this
         blkinfo->blkcompalgo=COMPRESS_NONE;
@@ -119,84 +170,127 @@ int compress_block_generic(struct s_blockinfo *blkinfo)
     
     u64 cryptsize;
     char *bufcrypt=NULL;
-    if (g_options.encryptalgo==ENCRYPT_BLOWFISH)
+    if (g_options.encryptalgo!=ENCRYPT_NONE)
     {
-        if ((bufcrypt=malloc(bufsize+8))==NULL)
-        {   errprintf("malloc(%ld) failed: out of memory\n", (long)bufsize+8);
+        if ((bufcrypt=bufpool_alloc(bufsize+CRYPTO_AEAD_OVERHEAD))==NULL)
+        {   errprintf("bufpool_alloc(%ld) failed: out of memory\n", (long)bufsize+CRYPTO_AEAD_OVERHEAD);
             return -1;
         }
-        if ((res=crypto_blowfish(blkinfo->blkcompsize, &cryptsize, (u8*)bufcomp, (u8*)bufcrypt, 
-            g_options.encryptpass, strlen((char*)g_options.encryptpass), 1))!=0)
-        {   errprintf("crypt_block_blowfish() failed\n");
+        if (g_options.encryptalgo==ENCRYPT_BLOWFISH)
+            res=crypto_blowfish(blkinfo->blkcompsize, &cryptsize, (u8*)blkinfo->blkdata, (u8*)bufcrypt, 
+                g_options.encryptpass, strlen((char*)g_options.encryptpass), 1);
+        else // the key has been derived when the main header was written
+            res=crypto_aead(g_options.encryptalgo, blkinfo->blkcompsize, &cryptsize, (u8*)blkinfo->blkdata, (u8*)bufcrypt, 1);
+        if (res!=0)
+        {   errprintf("cannot encrypt the block with %s\n", (g_options.encryptalgo==ENCRYPT_BLOWFISH)?"crypto_blowfish()":"crypto_aead()");
+            bufpool_free(bufcrypt);
             return -1;
         }
-        free(bufcomp);
+        bufpool_free(blkinfo->blkdata);
         blkinfo->blkdata=bufcrypt;
         blkinfo->blkarsize=cryptsize;
-        blkinfo->blkcryptalgo=ENCRYPT_BLOWFISH;
+        blkinfo->blkcryptalgo=g_options.encryptalgo;
     }
     else
     {
         blkinfo->blkcryptalgo=ENCRYPT_NONE;
     }
     
+    pipestats_add(PIPESTATS_COMPRESS, start, blkinfo->blkrealsize);
+    pipestats_add_codec(blkinfo->blkcompalgo, blkinfo->blkrealsize, blkinfo->blkcompsize);
+    
     // calculates the final block checksum (block as it will be stored in the archive)
-    blkinfo->blkarcsum=fletcher32((void*)blkinfo->blkdata, blkinfo->blkarsize);
+    start=pipestats_start();
+    blkinfo->blksumalgo=g_options.checksumalgo;
+    blkinfo->blkarcsum=checksum_compute(blkinfo->blksumalgo, (u8*)blkinfo->blkdata, blkinfo->blkarsize);
+    pipestats_add(PIPESTATS_CHECKSUM, start, blkinfo->blkarsize);
     
     return 0;
 }
 
 int decompress_block_generic(struct s_blockinfo *blkinfo)
 {
+    u8 hash[FSA_BLKHASH_SIZE];
     u64 checkorigsize;
     char *bufcomp=NULL;
+    bool sumok;
+    u64 start;
     int res;
     
-    // allocate memory for uncompressed data
-    if ((bufcomp=malloc(blkinfo->blkrealsize))==NULL)
-    {   errprintf("malloc(%ld) failed: cannot allocate memory for compressed block\n", (long)blkinfo->blkrealsize);
+    // allocate memory for uncompressed data (not needed if the block is stored uncompressed)
+    if ((blkinfo->blkcompalgo!=COMPRESS_NONE) && ((bufcomp=bufpool_alloc(blkinfo->blkrealsize))==NULL))
+    {   errprintf("bufpool_alloc(%ld) failed: cannot allocate memory for compressed block\n", (long)blkinfo->blkrealsize);
         return -1;
     }
     
     // check the block checksum
-    if (fletcher32((u8*)blkinfo->blkdata, blkinfo->blkarsize)!=(blkinfo->blkarcsum))
-    {   errprintf("block is corrupt at blockoffset=%ld, blksize=%ld\n", (long)blkinfo->blkoffset, (long)blkinfo->blkrealsize);
-        memset(bufcomp, 0, blkinfo->blkrealsize);
-    }
-    else // data not corrupted, decompresses the block
+    start=pipestats_start();
+    sumok=(checksum_compute(blkinfo->blksumalgo, (u8*)blkinfo->blkdata, blkinfo->blkarsize)==(blkinfo->blkarcsum));
+    pipestats_add(PIPESTATS_CHECKSUM, start, blkinfo->blkarsize);
+    if (sumok==false)
+        errprintf("block is corrupt at blockoffset=%ld, blksize=%ld\n", (long)blkinfo->blkoffset, (long)blkinfo->blkrealsize);
+    
+    // decrypt the block: the authenticated algorithms also detect the blocks which have been modified
+    start=pipestats_start();
+    if ((sumok==true) && (blkinfo->blkcryptalgo!=ENCRYPT_NONE))
     {
-        if ((blkinfo->blkcryptalgo!=ENCRYPT_NONE) && (g_options.encryptalgo!=ENCRYPT_BLOWFISH))
+        if (g_options.encryptalgo==ENCRYPT_NONE)
         {   msgprintf(MSG_DEBUG1, "this archive has been encrypted, you have to provide a password "
                 "on the command line using option '-c'\n");
+            bufpool_free(bufcomp);
             return -1;
         }
         
         char *bufcrypt=NULL;
         u64 clearsize;
+        if ((bufcrypt=bufpool_alloc(blkinfo->blkrealsize+8))==NULL)
+        {   errprintf("bufpool_alloc(%ld) failed: out of memory\n", (long)blkinfo->blkrealsize+8);
+            bufpool_free(bufcomp);
+            return -1;
+        }
         if (blkinfo->blkcryptalgo==ENCRYPT_BLOWFISH)
         {
-            if ((bufcrypt=malloc(blkinfo->blkrealsize+8))==NULL)
-            {   errprintf("malloc(%ld) failed: out of memory\n", (long)blkinfo->blkrealsize+8);
-                return -1;
-            }
             if ((res=crypto_blowfish(blkinfo->blkarsize, &clearsize, (u8*)blkinfo->blkdata, (u8*)bufcrypt, 
                 g_options.encryptpass, strlen((char*)g_options.encryptpass), 0))!=0)
             {   errprintf("crypt_block_blowfish() failed\n");
+                bufpool_free(bufcrypt);
+                bufpool_free(bufcomp);
                 return -1;
             }
-            if (clearsize!=blkinfo->blkcompsize)
-            {   errprintf("clearsize does not match blkcompsize: clearsize=%ld and blkcompsize=%ld\n", 
-                    (long)clearsize, (long)blkinfo->blkcompsize);
-                return -1;
-            }
-            free(blkinfo->blkdata);
-            blkinfo->blkdata=bufcrypt;
         }
-        
+        else if ((blkinfo->blkarsize!=blkinfo->blkcompsize+CRYPTO_AEAD_OVERHEAD) ||
+            (crypto_aead(blkinfo->blkcryptalgo, blkinfo->blkarsize, &clearsize, (u8*)blkinfo->blkdata, (u8*)bufcrypt, 0)!=0))
+        {   errprintf("block cannot be decrypted at blockoffset=%ld, blksize=%ld: it is corrupt or the password is wrong\n", 
+                (long)blkinfo->blkoffset, (long)blkinfo->blkrealsize);
+            clearsize=blkinfo->blkcompsize;
+            sumok=false;
+        }
+        if (clearsize!=blkinfo->blkcompsize)
+        {   errprintf("clearsize does not match blkcompsize: clearsize=%ld and blkcompsize=%ld\n", 
+                (long)clearsize, (long)blkinfo->blkcompsize);
+            bufpool_free(bufcrypt);
+            bufpool_free(bufcomp);
+            return -1;
+        }
+        bufpool_free(blkinfo->blkdata);
+        blkinfo->blkdata=bufcrypt;
+    }
+    
+    if (sumok==false) // restore zeros instead of the corrupt data
+    {
+        if ((bufcomp==NULL) && ((bufcomp=bufpool_alloc(blkinfo->blkrealsize))==NULL))
+        {   errprintf("bufpool_alloc(%ld) failed: cannot allocate memory for compressed block\n", (long)blkinfo->blkrealsize);
+            return -1;
+        }
+        memset(bufcomp, 0, blkinfo->blkrealsize);
+    }
+    else // data not corrupted, decompresses the block
+    {
         switch (blkinfo->blkcompalgo)
         {
-            case COMPRESS_NONE:
-                memcpy(bufcomp, blkinfo->blkdata, blkinfo->blkarsize);
+            case COMPRESS_NONE: // the buffer already contains the data: hand it over instead of copying
+                bufcomp=blkinfo->blkdata;
+                blkinfo->blkdata=NULL;
                 res=0;
                 break;
 #ifdef OPTION_LZO_SUPPORT
@@ -235,52 +329,256 @@ int decompress_block_generic(struct s_blockinfo *blkinfo)
                 }
                 break;
 #endif // OPTION_LZMA_SUPPORT
+#ifdef OPTION_ZSTD_SUPPORT
+            case COMPRESS_ZSTD:
+                if ((res=uncompress_block_zstd(blkinfo->blkcompsize, &checkorigsize, (void*)bufcomp, blkinfo->blkrealsize, (u8*)blkinfo->blkdata))!=0)
+                {   errprintf("uncompress_block_zstd()=%d failed: finalsize=%ld and checkorigsize=%ld\n", 
+                        res, (long)blkinfo->blkarsize, (long)checkorigsize);
+                    memset(bufcomp, 0, blkinfo->blkrealsize);
+                    // TODO: inc(error_counter);
+                }
+                break;
+#endif // OPTION_ZSTD_SUPPORT
+#ifdef OPTION_LZ4_SUPPORT
+            case COMPRESS_LZ4:
+                if ((res=uncompress_block_lz4(blkinfo->blkcompsize, &checkorigsize, (void*)bufcomp, blkinfo->blkrealsize, (u8*)blkinfo->blkdata))!=0)
+                {   errprintf("uncompress_block_lz4()=%d failed: finalsize=%ld and checkorigsize=%ld\n", 
+                        res, (long)blkinfo->blkarsize, (long)checkorigsize);
+                    memset(bufcomp, 0, blkinfo->blkrealsize);
+                    // TODO: inc(error_counter);
+                }
+                break;
+#endif // OPTION_LZ4_SUPPORT
             default:
                 errprintf("unsupported compression algorithm: %ld\n", (long)blkinfo->blkcompalgo);
                 return -1;
         }
-        free(blkinfo->blkdata); // free old buffer (with compressed data)
-        blkinfo->blkdata=bufcomp; // pointer to new buffer with uncompressed data
+        pipestats_add(PIPESTATS_COMPRESS, start, blkinfo->blkrealsize);
+        pipestats_add_codec(blkinfo->blkcompalgo, blkinfo->blkrealsize, blkinfo->blkcompsize);
+    }
+    
+    bufpool_free(blkinfo->blkdata); // release old buffer (with compressed data)
+    blkinfo->blkdata=bufcomp; // pointer to new buffer with uncompressed data (or zeros if the block is corrupt)
+    
+    // verify the contents of the block (--block-hashes): blkhash is replaced with the hash of the data
+    // which is restored so that the main thread can compare the list of the hashes with the file footer
+    if ((blkinfo->blkhashed==true) && (sumok==true))
+    {   blkhash_compute(hash, blkinfo->blkdata, blkinfo->blkrealsize);
+        if (memcmp(hash, blkinfo->blkhash, FSA_BLKHASH_SIZE)!=0)
+        {   errprintf("block is corrupt at blockoffset=%ld, blksize=%ld: its hash does not match\n", (long)blkinfo->blkoffset, (long)blkinfo->blkrealsize);
+            memcpy(blkinfo->blkhash, hash, FSA_BLKHASH_SIZE);
+        }
+    }
+    else if (blkinfo->blkhashed==true)
+    {   memset(blkinfo->blkhash, 0, FSA_BLKHASH_SIZE);
     }
     
     return 0;
 }
 
-int compression_function(int oper)
+// blocks claimed by a compression thread which have not been processed yet
+struct s_compworker
+{   pthread_mutex_t      mutex; // protects the claimed blocks (other threads can steal them)
+    s64                  itemnum[FSA_MAX_COMPBATCH]; // item numbers of the claimed blocks
+    cblockinfo           blkinfo[FSA_MAX_COMPBATCH]; // contents of the claimed blocks
+    int                  first; // next block to be processed by the owner of the batch
+    int                  last; // end of the batch: other threads steal blocks from this end
+    int                  index; // position in the pool: threads with index>=g_compactive are parked
+    u64                  busyusec; // cpu time spent compressing/decompressing blocks
+};
+
+typedef struct s_compworker ccompworker;
+
+// pool of compression threads (allocated for the number of jobs requested)
+pthread_t *g_compthread=NULL;
+ccompworker *g_compworker=NULL;
+int g_compworkercount=0;
+
+// how many threads of the pool are allowed to work (changed at run time when "-j auto" is used)
+pthread_mutex_t g_compparkmutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_compparkcond=PTHREAD_COND_INITIALIZER;
+pthread_t g_compcontroller=0;
+bool g_compcontrollerstop=false;
+int g_compactive=0;
+
+// take the next block of our own batch
+bool compworker_pop(ccompworker *worker, s64 *itemnum, cblockinfo *blkinfo)
+{
+    bool found=false;
+    
+    assert(pthread_mutex_lock(&worker->mutex)==0);
+    if (worker->first < worker->last)
+    {   *itemnum=worker->itemnum[worker->first];
+        *blkinfo=worker->blkinfo[worker->first];
+        worker->first++;
+        found=true;
+    }
+    assert(pthread_mutex_unlock(&worker->mutex)==0);
+    
+    return found;
+}
+
+// take the last block claimed by another thread which is still busy with an earlier block
+bool compworker_steal(ccompworker *self, s64 *itemnum, cblockinfo *blkinfo)
+{
+    ccompworker *victim;
+    bool found=false;
+    int i;
+    
+    for (i=0; (i < g_compworkercount) && (found==false); i++)
+    {
+        if ((victim=&g_compworker[i])==self)
+            continue;
+        assert(pthread_mutex_lock(&victim->mutex)==0);
+        if (victim->first < victim->last)
+        {   victim->last--;
+            *itemnum=victim->itemnum[victim->last];
+            *blkinfo=victim->blkinfo[victim->last];
+            found=true;
+        }
+        assert(pthread_mutex_unlock(&victim->mutex)==0);
+    }
+    
+    return found;
+}
+
+// claim a new batch of blocks from the queue
+s64 compworker_claim(ccompworker *worker, int batchsize, bool wait)
 {
+    s64 itemnum[FSA_MAX_COMPBATCH];
+    cblockinfo blkinfo[FSA_MAX_COMPBATCH];
+    s64 count;
+    int i;
+    
+    if ((count=queue_get_blocks_todo(&g_queue, batchsize, itemnum, blkinfo, wait))<=0)
+        return count;
+    
+    assert(pthread_mutex_lock(&worker->mutex)==0);
+    for (i=0; i < count; i++)
+    {   worker->itemnum[i]=itemnum[i];
+        worker->blkinfo[i]=blkinfo[i];
+    }
+    worker->first=0;
+    worker->last=count;
+    assert(pthread_mutex_unlock(&worker->mutex)==0);
+    
+    return count;
+}
+
+// give the blocks which have not been processed back to the queue so that other threads can do it
+void compworker_release(ccompworker *worker)
+{
+    assert(pthread_mutex_lock(&worker->mutex)==0);
+    if (worker->first < worker->last)
+        queue_replace_blocks(&g_queue, worker->last-worker->first, &worker->itemnum[worker->first], 
+            &worker->blkinfo[worker->first], QITEM_STATUS_TODO, false);
+    worker->first=0;
+    worker->last=0;
+    assert(pthread_mutex_unlock(&worker->mutex)==0);
+}
+
+// park the thread while the controller does not need it (returns immediately if it is active)
+void compworker_park(ccompworker *worker)
+{
+    assert(pthread_mutex_lock(&g_compparkmutex)==0);
+    while ((worker->index >= g_compactive) && (queue_get_end_of_queue(&g_queue)==false))
+        pthread_cond_wait(&g_compparkcond, &g_compparkmutex);
+    assert(pthread_mutex_unlock(&g_compparkmutex)==0);
+}
+
+bool compworker_is_parked(ccompworker *worker)
+{
+    bool parked;
+    
+    assert(pthread_mutex_lock(&g_compparkmutex)==0);
+    parked=(worker->index >= g_compactive);
+    assert(pthread_mutex_unlock(&g_compparkmutex)==0);
+    
+    return parked;
+}
+
+int compression_function(ccompworker *worker, int oper)
+{
+    struct s_blockinfo doneblkinfo[FSA_MAX_COMPBATCH];
+    s64 doneitemnum[FSA_MAX_COMPBATCH];
     struct s_blockinfo blkinfo;
+    int donecount=0;
+    int batchsize;
+    bool trylock;
+    u64 start;
     s64 blknum;
+    s64 lres;
     int res;
     
+    // claim several blocks at once but leave enough blocks in the queue for the other threads
+    batchsize=(g_queue.bytemax / g_options.datablocksize) / (2 * max(g_options.compressjobs, 1));
+    batchsize=max(min(batchsize, FSA_MAX_COMPBATCH), 1);
+    
     while (queue_get_end_of_queue(&g_queue)==false)
     {
-        if ((blknum=queue_get_first_block_todo(&g_queue, &blkinfo))>0) // block found
+        // give our blocks to the other threads before we stop working
+        if (compworker_is_parked(worker))
+        {   if (donecount>0)
+            {   queue_replace_blocks(&g_queue, donecount, doneitemnum, doneblkinfo, QITEM_STATUS_DONE, false);
+                donecount=0;
+            }
+            compworker_release(worker);
+            compworker_park(worker);
+            continue;
+        }
+        
+        // a) next block of our batch, b) new batch from the queue, c) block of a busy thread
+        if ((compworker_pop(worker, &blknum, &blkinfo)==false) &&
+            (compworker_claim(worker, batchsize, false)<=0 || compworker_pop(worker, &blknum, &blkinfo)==false) &&
+            (compworker_steal(worker, &blknum, &blkinfo)==false))
         {
-            switch (oper)
-            {
-                case COMPTHR_COMPRESS:
-                    res=compress_block_generic(&blkinfo);
-                    break;
-                case COMPTHR_DECOMPRESS:
-                    res=decompress_block_generic(&blkinfo);
-                    break;
-                default:
-                    errprintf("oper is invalid: %d\n", oper);
-                    goto thread_comp_fct_error;
+            // publish the blocks which are done before we wait for more work
+            if (donecount>0)
+            {   queue_replace_blocks(&g_queue, donecount, doneitemnum, doneblkinfo, QITEM_STATUS_DONE, false);
+                donecount=0;
             }
-            if (res!=0)
-            {   msgprintf(MSG_STACK, "compress_block()=%d failed\n", res);
+            if ((lres=compworker_claim(worker, batchsize, true))<=0 && lres!=FSAERR_ENDOFFILE)
+            {   msgprintf(MSG_STACK, "compworker_claim()=%ld=%s failed\n", (long)lres, error_int_to_string(lres));
                 goto thread_comp_fct_error;
             }
-            // don't check for errors: it's normal to fail when we terminate after a problem
-            queue_replace_block(&g_queue, blknum, &blkinfo, QITEM_STATUS_DONE);
+            continue;
+        }
+        
+        start=get_thread_cputime_usec();
+        switch (oper)
+        {
+            case COMPTHR_COMPRESS:
+                res=compress_block_generic(&blkinfo);
+                break;
+            case COMPTHR_DECOMPRESS:
+                res=decompress_block_generic(&blkinfo);
+                break;
+            default:
+                errprintf("oper is invalid: %d\n", oper);
+                goto thread_comp_fct_error;
         }
+        if (res!=0)
+        {   msgprintf(MSG_STACK, "compress_block()=%d failed\n", res);
+            goto thread_comp_fct_error;
+        }
+        (void)__sync_add_and_fetch(&worker->busyusec, get_thread_cputime_usec()-start);
+        
+        // publish the results without waiting if the queue is busy, unless too many blocks are pending
+        doneitemnum[donecount]=blknum;
+        doneblkinfo[donecount]=blkinfo;
+        trylock=(++donecount < FSA_MAX_COMPBATCH);
+        // don't check for errors: it's normal to fail when we terminate after a problem
+        if (queue_replace_blocks(&g_queue, donecount, doneitemnum, doneblkinfo, QITEM_STATUS_DONE, trylock)>0 || trylock==false)
+            donecount=0;
     }
     
     msgprintf(MSG_DEBUG1, "THREAD-COMP: exit success\n");
     return 0;
     
 thread_comp_fct_error:
+    if (donecount>0)
+        queue_replace_blocks(&g_queue, donecount, doneitemnum, doneblkinfo, QITEM_STATUS_DONE, false);
+    compworker_release(worker);
     get_stopfillqueue();
     msgprintf(MSG_DEBUG1, "THREAD-COMP: exit error\n");
     return 0;
@@ -289,7 +587,7 @@ thread_comp_fct_error:
 void *thread_comp_fct(void *args)
 {
     inc_secthreads();
-    compression_function(COMPTHR_COMPRESS);
+    compression_function((ccompworker *)args, COMPTHR_COMPRESS);
     dec_secthreads();
     return NULL;
 }
@@ -297,7 +595,184 @@ void *thread_comp_fct(void *args)
 void *thread_decomp_fct(void *args)
 {
     inc_secthreads();
-    compression_function(COMPTHR_DECOMPRESS);
+    compression_function((ccompworker *)args, COMPTHR_DECOMPRESS);
     dec_secthreads();
     return NULL;
 }
+
+// total time spent by all the threads of the pool processing blocks
+u64 compworker_busy_total()
+{
+    u64 total=0;
+    int i;
+    
+    for (i=0; i < g_compworkercount; i++)
+        total+=__sync_add_and_fetch(&g_compworker[i].busyusec, 0);
+    return total;
+}
+
+// change the number of active threads: the parked threads wait in compworker_park()
+void compworker_set_active(int active)
+{
+    assert(pthread_mutex_lock(&g_compparkmutex)==0);
+    g_compactive=active;
+    pthread_cond_broadcast(&g_compparkcond);
+    assert(pthread_mutex_unlock(&g_compparkmutex)==0);
+}
+
+// find how many threads are needed from the time the threads have been working or waiting
+// - compression is the slowest stage: the active threads are busy and the reader/writer wait for them
+// - traversal or archive io is the slowest stage: the active threads are often waiting for blocks
+int compworker_adjust(int active, u64 elapsed, u64 busy, u64 stall)
+{
+    int busypct;
+    int stallpct;
+    int needed;
+    
+    busypct=(int)((busy*100) / (elapsed*active));
+    stallpct=(int)((stall*100) / elapsed);
+    
+    if ((busypct >= COMPCTL_BUSY_HIGH) && (stallpct >= COMPCTL_STALL_HIGH))
+        return min(active + max(active/4, 1), g_compworkercount);
+    
+    if ((busypct < COMPCTL_BUSY_LOW) && (active > 1))
+    {   needed=(int)((busy*100) / (elapsed*COMPCTL_BUSY_HIGH)) + 1; // keep a thread in reserve
+        return max(min(needed, active-1), 1);
+    }
+    
+    return active;
+}
+
+void *thread_comp_controller_fct(void *args)
+{
+    u64 lastbusy, lastspace, lasthead, lasttime;
+    u64 busy, space, head, now;
+    struct timespec deadline;
+    struct timeval tv;
+    int active;
+    int newactive;
+    
+    lasttime=get_time_usec();
+    lastbusy=compworker_busy_total();
+    queue_get_wait_times(&g_queue, &lastspace, &lasthead);
+    
+    assert(pthread_mutex_lock(&g_compparkmutex)==0);
+    while ((g_compcontrollerstop==false) && (queue_get_end_of_queue(&g_queue)==false))
+    {
+        gettimeofday(&tv, NULL);
+        deadline.tv_sec=tv.tv_sec + (tv.tv_usec/1000 + COMPCTL_INTERVAL_MSEC) / 1000;
+        deadline.tv_nsec=((tv.tv_usec/1000 + COMPCTL_INTERVAL_MSEC) % 1000) * 1000000;
+        if (pthread_cond_timedwait(&g_compparkcond, &g_compparkmutex, &deadline)!=ETIMEDOUT)
+            continue;
+        active=g_compactive;
+        assert(pthread_mutex_unlock(&g_compparkmutex)==0);
+        
+        now=get_time_usec();
+        busy=compworker_busy_total();
+        queue_get_wait_times(&g_queue, &space, &head);
+        newactive=compworker_adjust(active, max(now-lasttime, 1), busy-lastbusy, (space-lastspace)+(head-lasthead));
+        if (newactive!=active)
+        {   msgprintf(MSG_VERB2, "compression threads: %d active (was %d, pool of %d)\n", newactive, active, g_compworkercount);
+            compworker_set_active(newactive);
+        }
+        lasttime=now;
+        lastbusy=busy;
+        lastspace=space;
+        lasthead=head;
+        
+        assert(pthread_mutex_lock(&g_compparkmutex)==0);
+    }
+    assert(pthread_mutex_unlock(&g_compparkmutex)==0);
+    
+    return NULL;
+}
+
+// create the compression or decompression threads: the threads which have been created
+// before a failure are still running and thread_comp_join() must be called in all cases
+int thread_comp_start(int oper, int count)
+{
+    int i;
+    
+    g_compthread=calloc(count, sizeof(pthread_t));
+    g_compworker=calloc(count, sizeof(ccompworker));
+    if (!g_compthread || !g_compworker)
+    {   errprintf("calloc(%d) failed: out of memory\n", count);
+        return -1;
+    }
+    for (i=0; i < count; i++)
+    {   assert(pthread_mutex_init(&g_compworker[i].mutex, NULL)==0);
+        g_compworker[i].index=i;
+    }
+    g_compworkercount=count;
+    g_compcontrollerstop=false;
+    g_compactive=count;
+    
+    for (i=0; i < count; i++)
+    {
+        if (pthread_create(&g_compthread[i], cpuinfo_thread_attr(CPUINFO_SET_COMP), (oper==COMPTHR_COMPRESS)?thread_comp_fct:thread_decomp_fct, &g_compworker[i]) != 0)
+        {   errprintf("pthread_create(%s) failed\n", (oper==COMPTHR_COMPRESS)?"thread_comp_fct":"thread_decomp_fct");
+            return -1;
+        }
+    }
+    
+    // the number of active threads is only adapted when the user lets fsarchiver choose it
+    if ((g_options.autojobs==true) && (count > 1))
+    {
+        if (pthread_create(&g_compcontroller, cpuinfo_thread_attr(CPUINFO_SET_IO), thread_comp_controller_fct, NULL) != 0)
+        {   errprintf("pthread_create(thread_comp_controller_fct) failed\n");
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+// wait for the compression threads (they exit when the queue reaches its end) and free the pool
+int thread_comp_join()
+{
+    int i;
+    
+    // stop the controller and wake up the parked threads so that they can see the end of the queue
+    assert(pthread_mutex_lock(&g_compparkmutex)==0);
+    g_compcontrollerstop=true;
+    g_compactive=g_compworkercount;
+    pthread_cond_broadcast(&g_compparkcond);
+    assert(pthread_mutex_unlock(&g_compparkmutex)==0);
+    if (g_compcontroller && pthread_join(g_compcontroller, NULL) != 0)
+        errprintf("pthread_join(thread_comp_controller) failed\n");
+    g_compcontroller=0;
+    
+    for (i=0; (g_compthread!=NULL) && (i < g_compworkercount); i++)
+        if (g_compthread[i] && pthread_join(g_compthread[i], NULL) != 0)
+            errprintf("pthread_join(thread_comp[%d]) failed\n", i);
+    
+    for (i=0; (g_compworker!=NULL) && (i < g_compworkercount); i++)
+        pthread_mutex_destroy(&g_compworker[i].mutex);
+    
+    // thread_comp_get_busy() can be called from another thread at any time
+    assert(pthread_mutex_lock(&g_compparkmutex)==0);
+    free(g_compthread);
+    free(g_compworker);
+    g_compthread=NULL;
+    g_compworker=NULL;
+    g_compworkercount=0;
+    g_compactive=0;
+    assert(pthread_mutex_unlock(&g_compparkmutex)==0);
+    return 0;
+}
+
+// cpu time used by each compression thread: returns how many threads there are in the pool
+int thread_comp_get_busy(u64 *busyusec, int maxcount, int *active)
+{
+    int count;
+    int i;
+    
+    assert(pthread_mutex_lock(&g_compparkmutex)==0);
+    count=min(g_compworkercount, maxcount);
+    for (i=0; i < count; i++)
+        busyusec[i]=__sync_add_and_fetch(&g_compworker[i].busyusec, 0);
+    *active=g_compactive;
+    assert(pthread_mutex_unlock(&g_compparkmutex)==0);
+    
+    return count;
+}
@@ -22,5 +22,8 @@ enum {COMPTHR_COMPRESS=1, COMPTHR_DECOMPRESS=2};
 
 void *thread_comp_fct(void *args);
 void *thread_decomp_fct(void *args);
+int  thread_comp_start(int oper, int count);
+int  thread_comp_join();
+int  thread_comp_get_busy(u64 *busyusec, int maxcount, int *active);
 
 #endif // __THREAD_COMP_H__
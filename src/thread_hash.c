@@ -0,0 +1,315 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <gcrypt.h>
+
+#include "fsarchiver.h"
+#include "thread_hash.h"
+#include "common.h"
+#include "dico.h"
+#include "queue.h"
+#include "bufpool.h"
+#include "cpuinfo.h"
+#include "pipestats.h"
+#include "error.h"
+
+// the md5 of the files is computed by a thread which follows the thread walking the files
+// the data to hash is given to it as a list of jobs which are processed in order, so
+// that the blocks of a file are hashed in sequence while the next blocks are being read
+
+enum {HASHJOB_DATA=1, HASHJOB_HEADER};
+
+struct s_hashjob;
+typedef struct s_hashjob chashjob;
+
+struct s_filehash
+{   gcry_md_hd_t         md5ctx; // md5 of the data which has already been hashed
+    u64                  pending; // jobs of this file which have not yet been processed
+};
+
+struct s_hashjob
+{   int                  type; // HASHJOB_DATA or HASHJOB_HEADER
+    cfilehash            *fh; // file to which the data belongs
+    char                 *buf; // buffer from the pool which contains the data (the job owns a reference)
+    char                 *data; // data to hash
+    u64                  len;
+    struct s_queue       *q; // HASHJOB_HEADER: queue where the header waits for the md5
+    s64                  itemnum; // HASHJOB_HEADER: item number of the header in that queue
+    struct s_dico        *dico; // HASHJOB_HEADER: the md5 is written in that dico with section and key
+    u8                   section;
+    u16                  key;
+    chashjob             *next;
+};
+
+static pthread_mutex_t   g_hashmutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    g_hashcondjob=PTHREAD_COND_INITIALIZER; // signaled when there is a new job or when the thread must exit
+static pthread_cond_t    g_hashconddone=PTHREAD_COND_INITIALIZER; // signaled when a job has been processed
+static chashjob          *g_hashfirst=NULL; // next job to process
+static chashjob          *g_hashlast=NULL;
+static u64               g_hashbytes=0; // data waiting in the jobs
+static bool              g_hashstop=false;
+static bool              g_hashrunning=false; // without the thread the data is hashed by the caller
+static pthread_t         g_hashthread;
+
+cfilehash *filehash_alloc()
+{
+    cfilehash *fh;
+    
+    if ((fh=calloc(1, sizeof(cfilehash)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)sizeof(cfilehash));
+        return NULL;
+    }
+    
+    if (gcry_md_open(&fh->md5ctx, GCRY_MD_MD5, 0) != GPG_ERR_NO_ERROR)
+    {   errprintf("gcry_md_open() failed\n");
+        free(fh);
+        return NULL;
+    }
+    
+    return fh;
+}
+
+// read the md5 and release the file: the jobs of the file must have been processed
+static int filehash_destroy(cfilehash *fh, u8 *md5sum, int md5size)
+{
+    u8 *md5tmp;
+    int ret=0;
+    
+    if (md5sum!=NULL)
+    {
+        if (md5size < 16)
+        {   errprintf("Buffer too small for md5 checksum\n");
+            ret=-1;
+        }
+        else if ((md5tmp=gcry_md_read(fh->md5ctx, GCRY_MD_MD5))==NULL)
+        {   errprintf("gcry_md_read() failed\n");
+            ret=-1;
+        }
+        else
+        {   memcpy(md5sum, md5tmp, 16);
+        }
+    }
+    
+    gcry_md_close(fh->md5ctx);
+    free(fh);
+    return ret;
+}
+
+static void filehash_push_job(chashjob *job)
+{
+    assert(pthread_mutex_lock(&g_hashmutex)==0);
+    
+    // limit the memory which is kept in the buffers waiting for the md5 thread
+    while ((g_hashbytes>0) && (g_hashbytes+job->len > HASH_MAX_PENDING))
+        pthread_cond_wait(&g_hashconddone, &g_hashmutex);
+    
+    if (g_hashlast!=NULL)
+        g_hashlast->next=job;
+    else
+        g_hashfirst=job;
+    g_hashlast=job;
+    g_hashbytes+=job->len;
+    job->fh->pending++;
+    pthread_cond_signal(&g_hashcondjob);
+    
+    assert(pthread_mutex_unlock(&g_hashmutex)==0);
+}
+
+// the data will be hashed by the md5 thread: buf is the buffer from the pool which contains the data
+// and it's referenced until the data has been hashed, if buf is NULL the data is copied
+int filehash_write(cfilehash *fh, char *buf, char *data, u64 len)
+{
+    chashjob *job;
+    u64 start;
+    
+    assert(fh);
+    
+    if (len==0)
+        return 0;
+    
+    if (g_hashrunning==false)
+    {   start=pipestats_start();
+        gcry_md_write(fh->md5ctx, data, len);
+        pipestats_add(PIPESTATS_MD5, start, len);
+        return 0;
+    }
+    
+    if ((job=calloc(1, sizeof(chashjob)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)sizeof(chashjob));
+        return -1;
+    }
+    
+    if (buf==NULL)
+    {   if ((buf=bufpool_alloc(len))==NULL)
+        {   errprintf("bufpool_alloc(%ld) failed: out of memory\n", (long)len);
+            free(job);
+            return -1;
+        }
+        memcpy(buf, data, len);
+        data=buf;
+    }
+    else
+    {   bufpool_ref(buf);
+    }
+    
+    job->type=HASHJOB_DATA;
+    job->fh=fh;
+    job->buf=buf;
+    job->data=data;
+    job->len=len;
+    filehash_push_job(job);
+    
+    return 0;
+}
+
+// wait until all the data of the file has been hashed, copy the md5 and release the file
+int filehash_final(cfilehash *fh, u8 *md5sum, int md5size)
+{
+    assert(fh);
+    
+    assert(pthread_mutex_lock(&g_hashmutex)==0);
+    while (fh->pending > 0)
+        pthread_cond_wait(&g_hashconddone, &g_hashmutex);
+    assert(pthread_mutex_unlock(&g_hashmutex)==0);
+    
+    return filehash_destroy(fh, md5sum, md5size);
+}
+
+// add an header which receives the md5 of the file (as the data item section/key) to the queue:
+// the consumer of the queue gets it when the md5 thread has hashed all the data of the file
+// the file is released by the md5 thread so fh must not be used after this call
+s64 filehash_add_header(cfilehash *fh, cqueue *q, cdico *d, char *magic, u16 fsid, u8 section, u16 key)
+{
+    u8 md5sum[16];
+    chashjob *job;
+    s64 itemnum;
+    
+    assert(fh);
+    
+    if (g_hashrunning==false)
+    {   if (filehash_final(fh, md5sum, sizeof(md5sum))!=0)
+            return FSAERR_UNKNOWN;
+        dico_add_data(d, section, key, md5sum, 16);
+        return queue_add_header(q, d, magic, fsid);
+    }
+    
+    if ((job=calloc(1, sizeof(chashjob)))==NULL)
+    {   errprintf("calloc(%ld) failed: out of memory\n", (long)sizeof(chashjob));
+        filehash_final(fh, NULL, 0);
+        return FSAERR_ENOMEM;
+    }
+    
+    if ((itemnum=queue_add_header_pending(q, d, magic, fsid))<=0)
+    {   filehash_final(fh, NULL, 0);
+        free(job);
+        return itemnum;
+    }
+    
+    job->type=HASHJOB_HEADER;
+    job->fh=fh;
+    job->q=q;
+    job->itemnum=itemnum;
+    job->dico=d;
+    job->section=section;
+    job->key=key;
+    filehash_push_job(job);
+    
+    return FSAERR_SUCCESS;
+}
+
+void *thread_hash_fct(void *args)
+{
+    u8 md5sum[16];
+    chashjob *job;
+    u64 start;
+    
+    assert(pthread_mutex_lock(&g_hashmutex)==0);
+    while (true)
+    {
+        while ((g_hashfirst==NULL) && (g_hashstop==false))
+            pthread_cond_wait(&g_hashcondjob, &g_hashmutex);
+        if ((job=g_hashfirst)==NULL) // all the jobs have been processed and the thread must exit
+            break;
+        if ((g_hashfirst=job->next)==NULL)
+            g_hashlast=NULL;
+        assert(pthread_mutex_unlock(&g_hashmutex)==0);
+        
+        switch (job->type)
+        {
+            case HASHJOB_DATA:
+                start=pipestats_start();
+                gcry_md_write(job->fh->md5ctx, job->data, job->len);
+                pipestats_add(PIPESTATS_MD5, start, job->len);
+                bufpool_free(job->buf);
+                break;
+            case HASHJOB_HEADER: // the data of the file have been hashed by the previous jobs
+                if (filehash_destroy(job->fh, md5sum, sizeof(md5sum))==0)
+                    dico_add_data(job->dico, job->section, job->key, md5sum, 16);
+                job->fh=NULL;
+                queue_set_header_ready(job->q, job->itemnum);
+                break;
+        }
+        
+        assert(pthread_mutex_lock(&g_hashmutex)==0);
+        g_hashbytes-=job->len;
+        if (job->fh!=NULL)
+            job->fh->pending--;
+        pthread_cond_broadcast(&g_hashconddone);
+        free(job);
+    }
+    assert(pthread_mutex_unlock(&g_hashmutex)==0);
+    
+    return NULL;
+}
+
+int thread_hash_start()
+{
+    g_hashstop=false;
+    if (pthread_create(&g_hashthread, cpuinfo_thread_attr(CPUINFO_SET_COMP), thread_hash_fct, NULL) != 0)
+    {   errprintf("pthread_create(thread_hash_fct) failed\n");
+        return -1;
+    }
+    g_hashrunning=true;
+    
+    return 0;
+}
+
+// wait until the jobs have been processed and stop the thread
+int thread_hash_join()
+{
+    if (g_hashrunning==false)
+        return 0;
+    
+    assert(pthread_mutex_lock(&g_hashmutex)==0);
+    g_hashstop=true;
+    pthread_cond_broadcast(&g_hashcondjob);
+    assert(pthread_mutex_unlock(&g_hashmutex)==0);
+    
+    if (pthread_join(g_hashthread, NULL) != 0)
+        errprintf("pthread_join(thread_hash) failed\n");
+    g_hashrunning=false;
+    
+    return 0;
+}
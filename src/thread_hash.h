@@ -0,0 +1,37 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __THREAD_HASH_H__
+#define __THREAD_HASH_H__
+
+#define HASH_MAX_PENDING  (16LL*1024LL*1024LL) // data which has been given to the md5 thread and not yet hashed
+
+struct s_dico;
+struct s_queue;
+
+struct s_filehash;
+typedef struct s_filehash cfilehash;
+
+void      *thread_hash_fct(void *args);
+int       thread_hash_start();
+int       thread_hash_join();
+cfilehash *filehash_alloc();
+int       filehash_write(cfilehash *fh, char *buf, char *data, u64 len);
+int       filehash_final(cfilehash *fh, u8 *md5sum, int md5size);
+s64       filehash_add_header(cfilehash *fh, struct s_queue *q, struct s_dico *d, char *magic, u16 fsid, u8 section, u16 key);
+
+#endif // __THREAD_HASH_H__
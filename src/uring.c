@@ -0,0 +1,195 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef OPTION_URING_SUPPORT
+#include <linux/io_uring.h>
+#endif // OPTION_URING_SUPPORT
+
+#include "fsarchiver.h"
+#include "uring.h"
+#include "common.h"
+#include "error.h"
+
+// minimal io_uring interface used to keep several writes in flight: it talks to the kernel
+// with the system calls so that it does not depend on liburing. The ring is only used by
+// one thread, the functions return -1 when io_uring is not available and the caller falls
+// back to the normal system calls
+
+#ifdef OPTION_URING_SUPPORT
+
+int uring_init(curing *r, u32 entries)
+{
+    struct io_uring_params params;
+    u8 *sqring;
+    u8 *cqring;
+    
+    memset(r, 0, sizeof(curing));
+    memset(&params, 0, sizeof(params));
+    
+    // fails with ENOSYS on old kernels and EPERM when io_uring is disabled (sysctl or seccomp)
+    if ((r->ringfd=syscall(__NR_io_uring_setup, entries, &params))<0)
+    {   msgprintf(MSG_DEBUG1, "io_uring_setup(%d) failed: %s\n", (int)entries, strerror(errno));
+        r->ringfd=-1;
+        return -1;
+    }
+    r->entries=params.sq_entries;
+    
+    r->sqringsize=params.sq_off.array+params.sq_entries*sizeof(u32);
+    r->cqringsize=params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+    r->sqessize=params.sq_entries*sizeof(struct io_uring_sqe);
+    r->sqring=mmap(NULL, r->sqringsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->ringfd, IORING_OFF_SQ_RING);
+    r->cqring=mmap(NULL, r->cqringsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->ringfd, IORING_OFF_CQ_RING);
+    r->sqes=mmap(NULL, r->sqessize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->ringfd, IORING_OFF_SQES);
+    if (r->sqring==MAP_FAILED || r->cqring==MAP_FAILED || r->sqes==MAP_FAILED)
+    {   sysprintf("cannot map the rings of io_uring\n");
+        uring_destroy(r);
+        return -1;
+    }
+    
+    sqring=r->sqring;
+    r->sqhead=(u32*)(sqring+params.sq_off.head);
+    r->sqtail=(u32*)(sqring+params.sq_off.tail);
+    r->sqmask=(u32*)(sqring+params.sq_off.ring_mask);
+    r->sqarray=(u32*)(sqring+params.sq_off.array);
+    cqring=r->cqring;
+    r->cqhead=(u32*)(cqring+params.cq_off.head);
+    r->cqtail=(u32*)(cqring+params.cq_off.tail);
+    r->cqmask=(u32*)(cqring+params.cq_off.ring_mask);
+    r->cqes=cqring+params.cq_off.cqes;
+    
+    msgprintf(MSG_DEBUG1, "io_uring initialized with %d entries\n", (int)r->entries);
+    return 0;
+}
+
+void uring_destroy(curing *r)
+{
+    if (r->sqring!=NULL && r->sqring!=MAP_FAILED)
+        munmap(r->sqring, r->sqringsize);
+    if (r->cqring!=NULL && r->cqring!=MAP_FAILED)
+        munmap(r->cqring, r->cqringsize);
+    if (r->sqes!=NULL && r->sqes!=MAP_FAILED)
+        munmap(r->sqes, r->sqessize);
+    if (r->ringfd>=0)
+        close(r->ringfd);
+    memset(r, 0, sizeof(curing));
+    r->ringfd=-1;
+}
+
+// queue a writev() at a given offset of the file and submit it to the kernel
+// the caller must not have more than r->entries operations in flight
+int uring_writev(curing *r, int fd, struct iovec *iov, int iovcnt, u64 offset, u64 userdata)
+{
+    struct io_uring_sqe *sqe;
+    u32 tail;
+    u32 index;
+    int res;
+    
+    if (r->ringfd<0)
+        return -1;
+    
+    tail=*r->sqtail;
+    index=tail & *r->sqmask;
+    sqe=&((struct io_uring_sqe *)r->sqes)[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode=IORING_OP_WRITEV;
+    sqe->fd=fd;
+    sqe->addr=(u64)(unsigned long)iov;
+    sqe->len=iovcnt;
+    sqe->off=offset;
+    sqe->user_data=userdata;
+    r->sqarray[index]=index;
+    
+    // the kernel must see the contents of the entry before the new tail
+    __atomic_store_n(r->sqtail, tail+1, __ATOMIC_RELEASE);
+    
+    while ((res=syscall(__NR_io_uring_enter, r->ringfd, 1, 0, 0, NULL, 0))<0 && errno==EINTR);
+    if (res!=1)
+    {   sysprintf("io_uring_enter() failed to submit the write\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+// wait for the next completion: result is what writev() would have returned, or -errno
+int uring_wait(curing *r, u64 *userdata, s64 *result)
+{
+    struct io_uring_cqe *cqe;
+    u32 head;
+    int res;
+    
+    if (r->ringfd<0)
+        return -1;
+    
+    head=*r->cqhead;
+    while (head==__atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE))
+    {
+        res=syscall(__NR_io_uring_enter, r->ringfd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (res<0 && errno!=EINTR)
+        {   sysprintf("io_uring_enter() failed to wait for a completion\n");
+            return -1;
+        }
+    }
+    
+    cqe=&((struct io_uring_cqe *)r->cqes)[head & *r->cqmask];
+    *userdata=cqe->user_data;
+    *result=cqe->res;
+    __atomic_store_n(r->cqhead, head+1, __ATOMIC_RELEASE);
+    
+    return 0;
+}
+
+#else // OPTION_URING_SUPPORT
+
+int uring_init(curing *r, u32 entries)
+{
+    memset(r, 0, sizeof(curing));
+    r->ringfd=-1;
+    return -1;
+}
+
+void uring_destroy(curing *r)
+{
+}
+
+int uring_writev(curing *r, int fd, struct iovec *iov, int iovcnt, u64 offset, u64 userdata)
+{
+    return -1;
+}
+
+int uring_wait(curing *r, u64 *userdata, s64 *result)
+{
+    return -1;
+}
+
+#endif // OPTION_URING_SUPPORT
+
+bool uring_enabled(curing *r)
+{
+    return (r->ringfd>=0);
+}
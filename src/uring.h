@@ -0,0 +1,51 @@
+/*
+ * fsarchiver: Filesystem Archiver
+ *
+ * Copyright (C) 2008-2010 Francois Dupoux.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * Homepage: http://www.fsarchiver.org
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/uio.h>
+
+struct s_uring;
+typedef struct s_uring curing;
+
+struct s_uring
+{   int    ringfd; // file descriptor of the ring or -1 when io_uring is not used
+    u32    entries; // size of the submission queue
+    u32    *sqhead; // the following fields point to the rings shared with the kernel
+    u32    *sqtail;
+    u32    *sqmask;
+    u32    *sqarray;
+    void   *sqes;
+    u32    *cqhead;
+    u32    *cqtail;
+    u32    *cqmask;
+    void   *cqes;
+    void   *sqring; // mappings which have to be released by uring_destroy()
+    u64    sqringsize;
+    void   *cqring;
+    u64    cqringsize;
+    u64    sqessize;
+};
+
+int  uring_init(curing *r, u32 entries);
+void uring_destroy(curing *r);
+bool uring_enabled(curing *r);
+int  uring_writev(curing *r, int fd, struct iovec *iov, int iovcnt, u64 offset, u64 userdata);
+int  uring_wait(curing *r, u64 *userdata, s64 *result);
+
+#endif // __URING_H__
@@ -30,6 +30,7 @@
 #include "error.h"
 #include "queue.h"
 #include "dico.h"
+#include "checksum.h"
 
 cwritebuf *writebuf_alloc()
 {
@@ -39,6 +40,7 @@ cwritebuf *writebuf_alloc()
         return NULL;
     }
     wb->size=0;
+    wb->alloc=0;
     wb->data=NULL;
     return wb;
 }
@@ -56,28 +58,63 @@ int writebuf_destroy(cwritebuf *wb)
         wb->data=NULL;
     }
     wb->size=0;
+    wb->alloc=0;
     free(wb);
     return 0;
 }
 
-int writebuf_add_data(cwritebuf *wb, void *data, u64 size)
+// forget the contents of the buffer but keep its memory for the next items
+int writebuf_reset(cwritebuf *wb)
+{
+    if (wb==NULL)
+    {   errprintf("wb is NULL\n");
+        return -1;
+    }
+    
+    wb->size=0;
+    return 0;
+}
+
+// make sure that size more bytes can be added to the buffer without reallocating it
+int writebuf_reserve(cwritebuf *wb, u64 size)
 {
-    u64 newsize;
+    u64 newalloc;
+    char *newdata;
     
     if (wb==NULL)
     {   errprintf("wb is NULL\n");
         return -1;
     }
     
+    // "+4" required else the last byte of the buffer may be alterred (see release-0.3.3)
+    if (wb->size+size+4 <= wb->alloc)
+        return 0;
+    
+    // the size is doubled so that the headers added one field at a time do not cause a realloc each
+    newalloc=max(wb->size+size+4, wb->alloc*2);
+    if ((newdata=realloc(wb->data, newalloc))==NULL)
+    {   errprintf("realloc(oldsize=%ld, newsize=%ld) failed\n", (long)wb->alloc, (long)newalloc);
+        return -1;
+    }
+    wb->data=newdata;
+    wb->alloc=newalloc;
+    return 0;
+}
+
+int writebuf_add_data(cwritebuf *wb, void *data, u64 size)
+{
+    if (wb==NULL)
+    {   errprintf("wb is NULL\n");
+        return -1;
+    }
+    
     if (size==0)
     {   errprintf("size=0\n");
         return -1;
     }
     
-    newsize=wb->size+size;
-    wb->data=realloc(wb->data, newsize+4); // "+4" required else the last byte of the buffer may be alterred (see release-0.3.3)
-    if (!wb->data)
-    {   errprintf("realloc(oldsize=%ld, newsize=%ld) failed\n", (long)wb->size, (long)newsize+4);
+    if (writebuf_reserve(wb, size)!=0)
+    {   msgprintf(MSG_STACK, "writebuf_reserve(%ld) failed\n", (long)size);
         return -1;
     }
     memcpy(wb->data+wb->size, data, size);
@@ -86,16 +123,17 @@ int writebuf_add_data(cwritebuf *wb, void *data, u64 size)
     return 0;
 }
 
-int writebuf_add_dico(cwritebuf *wb, cdico *d, char *magic)
+int writebuf_add_dico(cwritebuf *wb, cdico *d, char *magic, int sumalgo)
 {
     struct s_dicoitem *item;
     int itemnum;
     u32 headerlen;
-    u32 checksum;
+    u64 checksum;
     u8 *buffer;
     u8 *bufpos;
     u16 temp16;
     u32 temp32;
+    u64 temp64;
     u16 count;
     
     if (!wb || !d)
@@ -125,12 +163,14 @@ int writebuf_add_dico(cwritebuf *wb, cdico *d, char *magic)
     }
     msgprintf(MSG_DEBUG2, "calculated headerlen for that dico: headerlen=%d\n", (int)headerlen);
     
-    // 3. allocate memory for header
-    bufpos=buffer=malloc(headerlen);
-    if (!buffer)
-    {   errprintf("cannot allocate memory for buffer");
+    // 3. the header is serialized in place: header-len, header-data, header-checksum
+    if (writebuf_reserve(wb, sizeof(temp32)+headerlen+sizeof(temp64))!=0)
+    {   errprintf("cannot allocate memory for the header\n");
         return -1;
     }
+    temp32=cpu_to_le32(headerlen);
+    memcpy(wb->data+wb->size, &temp32, sizeof(temp32));
+    bufpos=buffer=(u8*)wb->data+wb->size+sizeof(temp32);
     
     // 4. write items count in buffer
     temp16=cpu_to_le16(count);
@@ -163,32 +203,19 @@ int writebuf_add_dico(cwritebuf *wb, cdico *d, char *magic)
     }
     msgprintf(MSG_DEBUG2, "all %d items mempcopied to buffer\n", (int)itemnum);
     
-    // 6. write header-len, header-data, header-checksum
-    temp32=cpu_to_le32(headerlen);
-    if (writebuf_add_data(wb, &temp32, sizeof(temp32))!=0)
-    {   free(buffer);
-        return -1;
-    }
-    
-    if (writebuf_add_data(wb, buffer, headerlen)!=0)
-    {   free(buffer);
-        return -1;
-    }
-    
-    checksum=fletcher32(buffer, headerlen);
-    temp32=cpu_to_le32(checksum);
-    if (writebuf_add_data(wb, &temp32, sizeof(temp32))!=0)
-    {   free(buffer);
-        return -1;
-    }
+    // 6. write header-checksum (the size of the checksum depends on the algorithm)
+    checksum=checksum_compute(sumalgo, buffer, headerlen);
+    temp32=cpu_to_le32((u32)checksum);
+    temp64=cpu_to_le64(checksum);
+    memcpy(bufpos, (checksum_size(sumalgo)==8)?(void*)&temp64:(void*)&temp32, checksum_size(sumalgo));
+    wb->size+=sizeof(temp32)+headerlen+checksum_size(sumalgo);
     
-    free(buffer);
     msgprintf(MSG_DEBUG2, "end of archio_write_dico(wb=%p, dico=%p, magic=[%c%c%c%c])\n", wb, d, magic[0], magic[1], magic[2], magic[3]);
     
     return 0;
 }
 
-int writebuf_add_header(cwritebuf *wb, cdico *d, char *magic, u32 archid, u16 fsid)
+int writebuf_add_header(cwritebuf *wb, cdico *d, char *magic, u32 archid, u16 fsid, int sumalgo)
 {
     u16 temp16;
     u32 temp32;
@@ -219,7 +246,7 @@ int writebuf_add_header(cwritebuf *wb, cdico *d, char *magic, u32 archid, u16 fs
     }
     
     // D. write the dico of the header
-    if (writebuf_add_dico(wb, d, magic) != 0)
+    if (writebuf_add_dico(wb, d, magic, checksum_header_algo(magic, sumalgo)) != 0)
     {   errprintf("archio_write_dico() failed to write the header dico\n");
         return -4;
     }
@@ -227,7 +254,8 @@ int writebuf_add_header(cwritebuf *wb, cdico *d, char *magic, u32 archid, u16 fs
     return 0;
 }
 
-int writebuf_add_block(cwritebuf *wb, struct s_blockinfo *blkinfo, u32 archid, u16 fsid)
+// write the header of a block: the data of the block is written from its own buffer by the caller
+int writebuf_add_blockhead(cwritebuf *wb, struct s_blockinfo *blkinfo, u32 archid, u16 fsid, int sumalgo)
 {
     cdico *blkdico; // header written in file
     int res;
@@ -252,23 +280,25 @@ int writebuf_add_block(cwritebuf *wb, struct s_blockinfo *blkinfo, u32 archid, u
     dico_add_u32(blkdico, 0, BLOCKHEADITEMKEY_REALSIZE, blkinfo->blkrealsize);
     dico_add_u32(blkdico, 0, BLOCKHEADITEMKEY_ARSIZE, blkinfo->blkarsize);
     dico_add_u32(blkdico, 0, BLOCKHEADITEMKEY_COMPSIZE, blkinfo->blkcompsize);
-    dico_add_u32(blkdico, 0, BLOCKHEADITEMKEY_ARCSUM, blkinfo->blkarcsum);
+    if (blkinfo->blksumalgo==CHECKSUM_FLETCHER32) // same header as in older versions
+    {   dico_add_u32(blkdico, 0, BLOCKHEADITEMKEY_ARCSUM, (u32)blkinfo->blkarcsum);
+    }
+    else
+    {   dico_add_u16(blkdico, 0, BLOCKHEADITEMKEY_ARCSUMALGO, blkinfo->blksumalgo);
+        dico_add_u64(blkdico, 0, BLOCKHEADITEMKEY_ARCSUM64, blkinfo->blkarcsum);
+    }
     dico_add_u16(blkdico, 0, BLOCKHEADITEMKEY_COMPRESSALGO, blkinfo->blkcompalgo);
     dico_add_u16(blkdico, 0, BLOCKHEADITEMKEY_ENCRYPTALGO, blkinfo->blkcryptalgo);
+    if (blkinfo->blkhashed==true) // archives created with --block-hashes
+        dico_add_data(blkdico, 0, BLOCKHEADITEMKEY_BLKHASH, blkinfo->blkhash, FSA_BLKHASH_SIZE);
     
     // write block header
-    res=writebuf_add_header(wb, blkdico, FSA_MAGIC_BLKH, archid, fsid);
+    res=writebuf_add_header(wb, blkdico, FSA_MAGIC_BLKH, archid, fsid, sumalgo);
     dico_destroy(blkdico);
     if (res!=0)
     {   msgprintf(MSG_STACK, "cannot write FSA_MAGIC_BLKH block-header\n");
         return -1;
     }
     
-    // write block data
-    if (writebuf_add_data(wb, blkinfo->blkdata, blkinfo->blkarsize)!=0)
-    {   msgprintf(MSG_STACK, "cannot write data block: writebuf_add_data() failed\n");
-        return -1;
-    }
-    
     return 0;
 }
@@ -26,14 +26,17 @@ typedef struct s_writebuf cwritebuf;
 
 struct s_writebuf
 {   char *data;
-    u64  size;
+    u64  size; // how many bytes are used in data
+    u64  alloc; // how many bytes have been allocated for data
 };
 
 cwritebuf *writebuf_alloc();
 int writebuf_destroy(cwritebuf *wb);
+int writebuf_reset(cwritebuf *wb);
+int writebuf_reserve(cwritebuf *wb, u64 size);
 int writebuf_add_data(cwritebuf *wb, void *data, u64 size);
-int writebuf_add_dico(cwritebuf *wb, struct s_dico *d, char *magic);
-int writebuf_add_header(cwritebuf *wb, struct s_dico *d, char *magic, u32 archid, u16 fsid);
-int writebuf_add_block(cwritebuf *wb, struct s_blockinfo *blkinfo, u32 archid, u16 fsid);
+int writebuf_add_dico(cwritebuf *wb, struct s_dico *d, char *magic, int sumalgo);
+int writebuf_add_header(cwritebuf *wb, struct s_dico *d, char *magic, u32 archid, u16 fsid, int sumalgo);
+int writebuf_add_blockhead(cwritebuf *wb, struct s_blockinfo *blkinfo, u32 archid, u16 fsid, int sumalgo);
 
 #endif // __WRITEBUF_H__